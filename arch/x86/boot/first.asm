@@ -5,6 +5,10 @@
 [BITS 16]
 [ORG 0x7C00]
 
+%ifndef STAGE2_SECTORS
+%define STAGE2_SECTORS 16
+%endif
+
 start:
     ; setup segments & stack at 0x7C00
     ; because it can overlap some BIOS data / video memory
@@ -14,6 +18,10 @@ start:
     mov ss, ax
     mov sp, 0x7C00
 
+    rdtsc               ; first boot timeline stamp
+    mov [stage1Tsc], eax
+    mov [stage1Tsc + 4], edx
+
     mov [bootDrive], dl
 
     mov cx, 0x0002      ; sector 2 (CH = 0, CL = 2)
@@ -22,7 +30,7 @@ start:
 
 load_loop:
     mov ah, 0x02        ; BIOS read sector function
-    mov al, 3           ; Read 3 sectors (second stage)
+    mov al, STAGE2_SECTORS ; Read second stage
     mov ch, 0           ; head number
     int 0x13            ; read disk op
     jc disk_error       ; jump if disk error
@@ -32,6 +40,8 @@ load_loop:
     call print_16bit
 
     mov dl, [bootDrive]
+    mov esi, [stage1Tsc]     ; hand stage 1 TSC to stage 2 in EDI:ESI
+    mov edi, [stage1Tsc + 4]
     jmp 0x0000:0x7E00   ; jump to segment 0x0000 at offset 0x7E00
 
 ; print error msg for debugging purpose in case the
@@ -84,6 +94,7 @@ print_hex:
 diskErrorMessage db 'Disk error code ', 0
 successMessage db 'Loaded bootloader stage 2', 13, 10, 0
 bootDrive db 0
+stage1Tsc dd 0, 0
 
 ; keeps the file limit as 512 otherwise it returns a negative value
 times 510 - ($ - $$) db 0
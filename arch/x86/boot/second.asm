@@ -5,42 +5,380 @@
 [BITS 16]
 [ORG 0x7E00]
 
+; disk layout, normally passed in by the Makefile
+%ifndef STAGE2_SECTORS
+%define STAGE2_SECTORS 16
+%endif
+%ifndef KERNEL_LBA
+%define KERNEL_LBA (1 + STAGE2_SECTORS)
+%endif
+%ifndef KERNEL_SECTORS
+%define KERNEL_SECTORS 128
+%endif
+%ifndef KERNEL_SIZE
+%define KERNEL_SIZE (KERNEL_SECTORS * 512)
+%endif
+%ifndef KERNEL_PHYS_END
+%define KERNEL_PHYS_END 0x400000
+%endif
+
 KERNEL_OFFSET_HIGH  equ 0xFFFF_FFFF_8000_0000
-KERNEL_LOAD_SEGMENT equ 0x1000
-KERNEL_LOAD_OFFSET  equ 0x0000
-KERNEL_OFFSET_LOW   equ (KERNEL_LOAD_SEGMENT << 4) + KERNEL_LOAD_OFFSET
+%assign KERNEL_OFFSET_LOW 0x100000          ; kernel is linked at 1 MB
+
+; The kernel ELF is staged right past where its segments end up
+%assign ELF_STAGING (KERNEL_PHYS_END + 0xFFF) & ~0xFFF
+
+%ifdef KERNEL_COMPRESSED
+; The LZ4 payload is read to the tail of the staged ELF's place, with
+; enough slack past the end that expanding it front to back never
+; overwrites input that hasn't been consumed yet. The margin counts from
+; the frame's real end, the sector padding read after it lies beyond,
+; and aligning the start rounds it up so the frame never ends short
+%ifndef KERNEL_LZ4_SIZE
+%define KERNEL_LZ4_SIZE (KERNEL_SECTORS * 512)
+%endif
+LZ4_FRAME_MAGIC     equ 0x184D2204
+%assign LZ4_INPLACE_MARGIN (KERNEL_LZ4_SIZE >> 8) + 64
+%assign KERNEL_LOAD_ADDR (ELF_STAGING + KERNEL_SIZE + LZ4_INPLACE_MARGIN - KERNEL_LZ4_SIZE + 0xF) & ~0xF
+%if KERNEL_LOAD_ADDR < ELF_STAGING
+%error "compressed kernel is larger than the uncompressed one"
+%endif
+%else
+%assign KERNEL_LOAD_ADDR ELF_STAGING
+%endif
+
+; 4 KB page tables for the higher half kernel, one flat run of PTEs
+; covering physical 0 up to the end of the kernel (see map_kernel)
+KERNEL_PT_BASE      equ 0x10000
+%assign KERNEL_PT_COUNT (KERNEL_PHYS_END + 0x1FFFFF) >> 21
+%if KERNEL_PT_COUNT > 16
+%error "kernel too large for the boot page tables"
+%endif
+
+ELF_MAGIC           equ 0x464C457F          ; 0x7F 'ELF'
+PT_LOAD             equ 1
+PF_X                equ 1
+PF_W                equ 2
+
+; sectors are read below 1 MB and then copied up in unreal mode
+BOUNCE_SEGMENT      equ 0x1000
+BOUNCE_SECTORS      equ 127                 ; some BIOSes can't do more per call
+
+; boot info block handed over to the kernel (see kernel/boot.h)
+BOOT_INFO           equ 0x500
+BOOT_INFO_MAGIC     equ 0x42534F76          ; 'vOSB'
+BOOT_MMAP_MAX       equ 64
+E820_SIGNATURE      equ 0x534D4150          ; 'SMAP'
+BOOT_FONT           equ 0x6000              ; 8x16 font, 4 KB below the stack
+
+; VBE_WIDTH/VBE_HEIGHT (VBE=1 in the Makefile) bound the framebuffer mode.
+; The info blocks go in the bounce buffer, free once the kernel is read
+%ifdef VBE_WIDTH
+VBE_SCRATCH_SEGMENT equ BOUNCE_SEGMENT
+VBE_INFO            equ 0                   ; VbeInfoBlock, 512 bytes
+VBE_MODE_INFO       equ 512                 ; ModeInfoBlock, 256 bytes
+VBE_MODE_ATTRS      equ 0x99                ; supported, colour, graphics, LFB
+VBE_DIRECT_COLOR    equ 6
+VBE_LFB             equ 0x4000              ; 4F02h: use the linear framebuffer
+%endif
+
+; boot timeline slots in boot_info.tsc
+BOOT_TSC_STAGE1     equ 0
+BOOT_TSC_STAGE2     equ 1
+BOOT_TSC_E820       equ 2
+BOOT_TSC_A20        equ 3
+BOOT_TSC_LOADED     equ 4
+BOOT_TSC_PROTECTED  equ 5
+BOOT_TSC_DECOMPRESS equ 6
+BOOT_TSC_LONG_MODE  equ 7
+BOOT_TSC_HANDOFF    equ 8
+BOOT_TSC_COUNT      equ 9
+
+struc boot_info
+    .magic:         resd 1
+    .boot_drive:    resb 1
+    .reserved0:     resb 3
+    .kernel_start:  resq 1
+    .kernel_end:    resq 1
+    .tsc:           resq BOOT_TSC_COUNT
+    .mmap_count:    resd 1
+    .reserved1:     resd 1
+    .mmap:          resb 24 * BOOT_MMAP_MAX
+    .fb_addr:       resq 1
+    .fb_pitch:      resd 1
+    .fb_width:      resw 1
+    .fb_height:     resw 1
+    .fb_bpp:        resb 1
+    .fb_red:        resb 2              ; mask size, field position
+    .fb_green:      resb 2
+    .fb_blue:       resb 2
+    .reserved2:     resb 1
+    .font:          resd 1
+    .reserved3:     resd 1
+endstruc
+
+; records the TSC into boot_info.tsc[slot], works in any mode
+%macro stamp_tsc 1
+    rdtsc
+    mov [BOOT_INFO + boot_info.tsc + 8 * %1], eax
+    mov [BOOT_INFO + boot_info.tsc + 8 * %1 + 4], edx
+%endmacro
 
 start:
-    ; just before getting here DL=bootdrive
-    ; set up segments & stack at 0x9000
+    ; just before getting here DL=bootdrive, EDI:ESI=stage 1 TSC
+    ; set up segments & stack below stage 1
     xor ax, ax
     mov ds, ax
     mov es, ax
     mov ss, ax
-    mov sp, 0x9000
+    mov sp, 0x7C00
+
+    mov [bootDrive], dl
+    push edi
+    push esi
+
+    ; clear boot info before filling it in
+    mov di, BOOT_INFO
+    mov cx, boot_info_size
+    xor al, al
+    cld
+    rep stosb
+    mov dword [BOOT_INFO + boot_info.magic], BOOT_INFO_MAGIC
+    mov [BOOT_INFO + boot_info.boot_drive], dl
+    pop dword [BOOT_INFO + boot_info.tsc + 8 * BOOT_TSC_STAGE1]
+    pop dword [BOOT_INFO + boot_info.tsc + 8 * BOOT_TSC_STAGE1 + 4]
+    stamp_tsc BOOT_TSC_STAGE2
 
     ; print 'Jumped to stage 2'
     mov si, stage2Message
     call print_16bit
 
+    call detect_memory              ; collect E820 map while BIOS is around
+    stamp_tsc BOOT_TSC_E820
     call enable_A20                 ; enable A20 for mem access beyond 1 MB
-    call load_kernel                ; load the rest of stage 2 and kernel
+    stamp_tsc BOOT_TSC_A20
+    call load_kernel                ; stage the kernel ELF (or its LZ4 payload) above 1 MB
+    stamp_tsc BOOT_TSC_LOADED
+    call copy_font                  ; the kernel draws with the BIOS font on a framebuffer
+%ifdef VBE_WIDTH
+    call setup_video                ; last BIOS call, the screen goes graphical
+%endif
+
     call enable_protected_mode      ; load GDT and switch to protected mode
 
-; @NOTE: this part is basically 'load_loop' from stage 1
-; but has some extras & some stuff removed
+; Reads the kernel with INT 13h extensions (AH=42h) in runs of
+; BOUNCE_SECTORS into a buffer below 1 MB, then copies each run
+; to its final place above 1 MB through unreal mode
 load_kernel:
-    mov ah, 0x02            ; BIOS read sector function
-    mov al, 64              ; read 9 sectors / time
-    mov ch, 0               ; cylinder number
-    mov cl, 5               ; start from sector 5
-    mov dh, 0               ; Head number
-    push KERNEL_LOAD_SEGMENT
+    mov ah, 0x41                    ; check for INT 13h extensions
+    mov bx, 0x55AA
+    mov dl, [bootDrive]
+    int 0x13
+    jc disk_error
+    cmp bx, 0xAA55
+    jne disk_error
+
+    mov dword [kernelDest], KERNEL_LOAD_ADDR
+    mov dword [kernelSectorsLeft], KERNEL_SECTORS
+    mov dword [dap.lba], KERNEL_LBA
+    mov word [dap.segment], BOUNCE_SEGMENT
+.loop:
+    mov eax, [kernelSectorsLeft]
+    test eax, eax
+    jz .done
+    cmp eax, BOUNCE_SECTORS
+    jbe .read
+    mov eax, BOUNCE_SECTORS
+.read:
+    mov [dap.count], ax
+    mov si, dap
+    mov ah, 0x42                    ; BIOS extended read function
+    mov dl, [bootDrive]
+    int 0x13
+    jc disk_error
+
+    ; BIOS calls may reload segment limits, so redo it every run
+    call enable_unreal_mode
+
+    movzx ecx, word [dap.count]
+    add [dap.lba], ecx
+    sub [kernelSectorsLeft], ecx
+    shl ecx, 7                      ; sectors -> dwords
+    mov esi, BOUNCE_SEGMENT << 4
+    mov edi, [kernelDest]
+    cld
+    a32 rep movsd
+    mov [kernelDest], edi
+    jmp .loop
+.done:
+    ret
+
+; Walks INT 15h E820 into boot_info.mmap, skipping empty entries.
+; A BIOS without E820 just leaves mmap_count at 0
+detect_memory:
+    mov di, BOOT_INFO + boot_info.mmap   ; ES:DI = entry buffer
+    xor ebx, ebx                    ; continuation value, 0 to start
+    xor bp, bp                      ; entry count
+.loop:
+    mov eax, 0xE820
+    mov edx, E820_SIGNATURE
+    mov ecx, 24
+    mov dword [di + 20], 1          ; valid ACPI 3.0 attributes by default
+    int 0x15
+    jc .done                        ; carry means end of list (or no E820)
+    cmp eax, E820_SIGNATURE
+    jne .done
+    jcxz .next                      ; ignore empty entries
+    mov ecx, [di + 8]
+    or ecx, [di + 12]
+    jz .next                        ; ignore zero-length regions
+    add di, 24
+    inc bp
+    cmp bp, BOOT_MMAP_MAX
+    jae .done
+.next:
+    test ebx, ebx
+    jnz .loop
+.done:
+    mov [BOOT_INFO + boot_info.mmap_count], bp
+    ret
+
+; Copies the VGA BIOS 8x16 font (INT 10h AX=1130h) to BOOT_FONT
+copy_font:
+    push ds
+    push es
+    push bp
+    mov ax, 0x1130
+    mov bh, 0x06                    ; 8x16 font, ES:BP = glyphs
+    int 0x10
+    mov si, bp
+    mov ax, es
+    mov ds, ax
+    xor ax, ax
+    mov es, ax
+    mov di, BOOT_FONT
+    mov cx, 4096 / 2
+    cld
+    rep movsw
+    pop bp
     pop es
-    mov bx, KERNEL_LOAD_OFFSET
-                            ; ES:BX is location where sectors will be loaded
-    int 0x13                ; read disk op
-    jc disk_error           ; jump if disk error
+    pop ds
+    mov dword [BOOT_INFO + boot_info.font], BOOT_FONT
+    ret
+
+%ifdef VBE_WIDTH
+; Picks the largest 32 bpp direct colour mode with a linear framebuffer
+; that fits VBE_WIDTH x VBE_HEIGHT, sets it and records it in boot_info.
+; Without VBE 2.0 or such a mode the screen stays in text mode
+setup_video:
+    push es
+    mov ax, VBE_SCRATCH_SEGMENT
+    mov es, ax
+    mov dword [es:VBE_INFO], 'VBE2'  ; ask for the VBE 2.0 fields
+    mov ax, 0x4F00
+    mov di, VBE_INFO
+    int 0x10
+    cmp ax, 0x004F
+    jne .done
+    cmp word [es:VBE_INFO + 4], 0x0200
+    jb .done
+
+    lfs si, [es:VBE_INFO + 14]      ; VideoModePtr
+.mode:
+    mov cx, [fs:si]
+    cmp cx, 0xFFFF                  ; end of the list
+    je .set
+    add si, 2
+    push si
+    push fs
+    push cx
+    mov ax, 0x4F01
+    mov di, VBE_MODE_INFO
+    int 0x10
+    pop cx
+    pop fs
+    pop si
+    cmp ax, 0x004F
+    jne .mode
+    mov ax, [es:VBE_MODE_INFO]      ; ModeAttributes
+    and ax, VBE_MODE_ATTRS
+    cmp ax, VBE_MODE_ATTRS
+    jne .mode
+    cmp byte [es:VBE_MODE_INFO + 25], 32    ; BitsPerPixel
+    jne .mode
+    cmp byte [es:VBE_MODE_INFO + 27], VBE_DIRECT_COLOR
+    jne .mode
+    movzx eax, word [es:VBE_MODE_INFO + 18] ; XResolution
+    cmp eax, VBE_WIDTH
+    ja .mode
+    movzx ebx, word [es:VBE_MODE_INFO + 20] ; YResolution
+    cmp ebx, VBE_HEIGHT
+    ja .mode
+    imul eax, ebx
+    cmp eax, [vbeBestArea]
+    jbe .mode
+    mov [vbeBestArea], eax
+    mov [vbeBestMode], cx
+    jmp .mode
+
+.set:
+    mov cx, [vbeBestMode]
+    test cx, cx
+    jz .done
+    mov ax, 0x4F01                  ; its ModeInfoBlock again for the geometry
+    mov di, VBE_MODE_INFO
+    int 0x10
+    mov ax, 0x4F02
+    mov bx, [vbeBestMode]
+    or bx, VBE_LFB
+    int 0x10
+    cmp ax, 0x004F
+    jne .done
+
+    mov eax, [es:VBE_MODE_INFO + 40]        ; PhysBasePtr
+    mov [BOOT_INFO + boot_info.fb_addr], eax
+    movzx eax, word [es:VBE_MODE_INFO + 16] ; BytesPerScanLine
+    cmp word [es:VBE_INFO + 4], 0x0300
+    jb .pitch
+    mov ax, [es:VBE_MODE_INFO + 50]         ; LinBytesPerScanLine, VBE 3.0
+.pitch:
+    mov [BOOT_INFO + boot_info.fb_pitch], eax
+    mov ax, [es:VBE_MODE_INFO + 18]
+    mov [BOOT_INFO + boot_info.fb_width], ax
+    mov ax, [es:VBE_MODE_INFO + 20]
+    mov [BOOT_INFO + boot_info.fb_height], ax
+    mov al, [es:VBE_MODE_INFO + 25]
+    mov [BOOT_INFO + boot_info.fb_bpp], al
+    mov ax, [es:VBE_MODE_INFO + 31]         ; RedMaskSize, RedFieldPosition
+    mov [BOOT_INFO + boot_info.fb_red], ax
+    mov ax, [es:VBE_MODE_INFO + 33]
+    mov [BOOT_INFO + boot_info.fb_green], ax
+    mov ax, [es:VBE_MODE_INFO + 35]
+    mov [BOOT_INFO + boot_info.fb_blue], ax
+.done:
+    pop es
+    ret
+%endif
+
+; Loads 4 GB limits into DS/ES by briefly entering protected
+; mode, then drops back to real mode with the limits cached
+enable_unreal_mode:
+    cli
+    push ds
+    push es
+    lgdt [gdt_descriptor]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp $ + 2
+    mov bx, 0x10                    ; 32-bit data descriptor
+    mov ds, bx
+    mov es, bx
+    and al, 0xFE
+    mov cr0, eax
+    pop es
+    pop ds
+    sti
     ret
 
 enable_A20:
@@ -71,8 +409,17 @@ protected_mode_entry:
     mov gs, ax
     mov ss, ax
 
-    ; set up stack at 0x200000
-    mov esp, 0x200000
+    ; keep using the stack below stage 1, the kernel may
+    ; already cover everything from 1 MB up
+    mov esp, 0x7C00
+    stamp_tsc BOOT_TSC_PROTECTED
+
+%ifdef KERNEL_COMPRESSED
+    mov esi, KERNEL_LOAD_ADDR
+    mov edi, ELF_STAGING
+    call lz4_decompress
+    stamp_tsc BOOT_TSC_DECOMPRESS
+%endif
 
     ; say 'Entered protected mode'
     mov esi, protectedModeMessage
@@ -86,6 +433,98 @@ protected_mode_entry:
     call enable_long_mode
     jmp 0x08:long_mode_entry        ; jump to segment 0x08 at offset long_mode_entry
 
+%ifdef KERNEL_COMPRESSED
+; Expands an LZ4 frame (linked or independent blocks)
+; ESI = frame, EDI = destination, returns EDI = end of output
+lz4_decompress:
+    cld
+    cmp dword [esi], LZ4_FRAME_MAGIC
+    jne lz4_error
+    mov al, [esi + 4]               ; FLG byte
+    mov [lz4Flags], al
+    add esi, 6                      ; magic, FLG, BD
+    test al, 0x08                   ; content size present
+    jz .no_size
+    add esi, 8
+.no_size:
+    test al, 0x01                   ; dictionary ID present
+    jz .no_dict
+    add esi, 4
+.no_dict:
+    inc esi                         ; header checksum
+.block:
+    lodsd                           ; block size, 0 = end mark
+    test eax, eax
+    jz .done
+    mov ecx, eax
+    and ecx, 0x7FFFFFFF
+    lea edx, [esi + ecx]            ; EDX = end of this block
+    test eax, 0x80000000            ; high bit = stored uncompressed
+    jz .compressed
+    rep movsb
+    jmp .next
+.compressed:
+    call lz4_block
+.next:
+    mov esi, edx
+    test byte [lz4Flags], 0x10      ; block checksum present
+    jz .block
+    add esi, 4
+    jmp .block
+.done:
+    ret
+
+; Decodes one LZ4 block from ESI up to EDX into EDI
+lz4_block:
+.sequence:
+    cmp esi, edx
+    jae .done
+    movzx ebx, byte [esi]           ; token
+    inc esi
+    mov ecx, ebx
+    shr ecx, 4                      ; literal length
+    cmp ecx, 15
+    jne .literals
+.literal_length:
+    movzx eax, byte [esi]
+    inc esi
+    add ecx, eax
+    cmp al, 255
+    je .literal_length
+.literals:
+    rep movsb
+    cmp esi, edx                    ; last sequence is literals only
+    jae .done
+    movzx eax, word [esi]           ; match offset
+    add esi, 2
+    mov ecx, ebx
+    and ecx, 0x0F                   ; match length - 4
+    cmp ecx, 15
+    jne .match
+.match_length:
+    movzx ebx, byte [esi]
+    inc esi
+    add ecx, ebx
+    cmp bl, 255
+    je .match_length
+.match:
+    add ecx, 4
+    push esi
+    mov esi, edi
+    sub esi, eax
+    rep movsb                       ; bytewise, so overlapping matches repeat
+    pop esi
+    jmp .sequence
+.done:
+    ret
+
+lz4_error:
+    mov esi, lz4ErrorMessage
+    call print_protected_mode
+    cli
+    hlt
+%endif
+
 setup_paging:
     mov edi, 0x1000                 ; assuming they are 4KB aligned
     xor eax, eax
@@ -97,24 +536,46 @@ setup_paging:
     ; Identity map first 2MB
     ; Map 0x0000000000000000-0x00000000001fffff
     ; to physical 0x00000000-0x001fffff
+    ; Identity map first 1GB
+    ; Map 0x0000000000000000-0x000000003fffffff
+    ; to physical 0x00000000-0x3fffffff
     mov dword [0x1000], 0x00002003  ; PML4[0] = 0x2000 | PRESENT | READWRITE
     mov dword [0x2000], 0x00003003  ; PDP[0]  = 0x3000 | PRESENT | READWRITE
-    mov dword [0x3000], 0x00000083  ; PD[0]   = 0x0000 | PRESENT | READWRITE | 2MB_PAGE
 
-    ; Map 0xFFFFFFFF80000000-0xffffffff801fffff
-    ; to physical 0x00000000-0x001fffff
+    ; Map 0xFFFFFFFF80000000-0xffffffffbfffffff
+    ; to physical 0x00000000-0x3fffffff
     mov dword [0x1000 + 8 * ((KERNEL_OFFSET_HIGH >> 39) & 0x1ff)], 0x00004003    ; PML4[511] = 0x4000 | PRESENT | READWRITE
     mov dword [0x4000 + 8 * ((KERNEL_OFFSET_HIGH >> 30) & 0x1ff)], 0x00005003    ; PDP[510]  = 0x5000 | PRESENT | READWRITE
-    mov dword [0x5000 + 8 * ((KERNEL_OFFSET_HIGH >> 21) & 0x1ff)], 0x00000083    ; PD[0]     = 0x0000 | PRESENT | READWRITE | 2MB_PAGE
+
+    ; Fill both PDs with 2MB pages so multi-MB kernels stay mapped
+    mov edi, 0x3000
+    mov eax, 0x00000083             ; PRESENT | READWRITE | 2MB_PAGE
+    mov ecx, 512
+.map_2mb:
+    mov [edi], eax                  ; PD[i] at 0x3000 (identity)
+    mov [edi + 0x2000], eax         ; PD[i] at 0x5000 (higher half)
+    add eax, 0x200000
+    add edi, 8
+    loop .map_2mb
 
     mov edi, 0x1000
     mov cr3, edi                    ; load page dir base into cr3 to set PDBR
     ret
 
 enable_long_mode:
+    ; turn on NX too when the CPU has it, map_kernel uses it
+    mov eax, 0x80000001
+    cpuid
+    xor ebx, ebx
+    test edx, 1 << 20
+    jz .no_nx
+    mov ebx, 1 << 11                ; EFER.NXE
+    mov byte [nxSupported], 1
+.no_nx:
     mov ecx, 0xC0000080
     rdmsr
     or eax, 1 << 8
+    or eax, ebx
     wrmsr
 
     ; enable PAE and PGE bits in CR0
@@ -122,7 +583,7 @@ enable_long_mode:
     mov cr4, eax
 
     mov eax, cr0
-    or eax, 1 << 31                 ; enable paging
+    or eax, (1 << 31) | (1 << 16)   ; enable paging, honour read-only pages in ring 0
     mov cr0, eax
     ret
 
@@ -137,13 +598,141 @@ long_mode_entry:
 
     ; setup stack for kernel higher half
     mov rsp, 0x90000 + KERNEL_OFFSET_HIGH
+    stamp_tsc BOOT_TSC_LONG_MODE
 
     ; print 'Reached long mode'
     mov rsi, longModeMessage
     call print_long_mode
 
-    mov rax, KERNEL_OFFSET_HIGH + KERNEL_OFFSET_LOW
-    jmp rax
+    call build_kernel_tables
+    mov rsi, ELF_STAGING
+    call load_elf
+    mov r12, rax                    ; entry point
+
+    mov rax, cr3                    ; drop the 2 MB kernel mapping from the TLB
+    mov cr3, rax
+
+    stamp_tsc BOOT_TSC_HANDOFF
+
+    ; kernel_start(boot_info) with boot info seen through the higher half
+    mov rdi, KERNEL_OFFSET_HIGH + BOOT_INFO
+    jmp r12
+
+; Splits the first KERNEL_PT_COUNT 2 MB pages of the higher half
+; into 4 KB pages (all read/write) so segments can get their own
+; permissions. PTEs for physical page N live at KERNEL_PT_BASE + N * 8
+build_kernel_tables:
+    mov rdi, KERNEL_PT_BASE
+    mov rax, 0x03                   ; PRESENT | READWRITE
+    mov rcx, KERNEL_PT_COUNT * 512
+.pte:
+    mov [rdi], rax
+    add rax, 0x1000
+    add rdi, 8
+    loop .pte
+
+    xor rbx, rbx
+    mov rax, KERNEL_PT_BASE | 0x03
+.pde:
+    mov [0x5000 + rbx * 8], rax     ; PD[i] = PT | PRESENT | READWRITE
+    add rax, 0x1000
+    inc rbx
+    cmp rbx, KERNEL_PT_COUNT
+    jb .pde
+    ret
+
+; Copies every PT_LOAD segment of the ELF at RSI to its physical
+; address, zeroes its BSS tail and gives its pages the segment's
+; permissions. Returns the entry point in RAX
+load_elf:
+    cmp dword [rsi], ELF_MAGIC
+    jne elf_error
+    mov r13, rsi                    ; ELF base
+    mov rbx, [r13 + 32]             ; e_phoff
+    add rbx, r13
+    movzx r14, word [r13 + 54]      ; e_phentsize
+    movzx r15, word [r13 + 56]      ; e_phnum
+    mov qword [BOOT_INFO + boot_info.kernel_start], -1
+    cld
+.phdr:
+    test r15, r15
+    jz .done
+    cmp dword [rbx], PT_LOAD
+    jne .next
+
+    mov rdi, [rbx + 24]             ; p_paddr
+    cmp rdi, [BOOT_INFO + boot_info.kernel_start]
+    jae .copy
+    mov [BOOT_INFO + boot_info.kernel_start], rdi
+.copy:
+    mov rsi, r13
+    add rsi, [rbx + 8]              ; p_offset
+    mov rcx, [rbx + 32]             ; p_filesz
+    rep movsb
+
+    mov rcx, [rbx + 40]             ; p_memsz
+    sub rcx, [rbx + 32]             ; BSS bytes
+    xor eax, eax
+.bss_head:
+    test rcx, rcx
+    jz .bss_done
+    test rdi, 7
+    jz .bss_body
+    stosb
+    dec rcx
+    jmp .bss_head
+.bss_body:
+    mov rdx, rcx
+    shr rcx, 3
+    rep stosq
+    mov rcx, rdx
+    and rcx, 7
+    rep stosb
+.bss_done:
+    cmp rdi, [BOOT_INFO + boot_info.kernel_end]
+    jbe .protect
+    mov [BOOT_INFO + boot_info.kernel_end], rdi
+.protect:
+    call map_segment
+.next:
+    add rbx, r14
+    dec r15
+    jmp .phdr
+.done:
+    mov rax, [r13 + 24]             ; e_entry
+    ret
+
+; Rewrites the PTEs of the segment at RBX with its p_flags
+map_segment:
+    mov r8, 0x01                    ; PRESENT
+    mov eax, [rbx + 4]              ; p_flags
+    test eax, PF_W
+    jz .no_write
+    or r8, 0x02                     ; READWRITE
+.no_write:
+    test eax, PF_X
+    jnz .exec
+    cmp byte [nxSupported], 0
+    je .exec
+    bts r8, 63                      ; NX
+.exec:
+    mov rax, [rbx + 24]             ; first page
+    mov rcx, rax
+    add rcx, [rbx + 40]
+    add rcx, 0xFFF                  ; one past the last page
+    shr rax, 12
+    shr rcx, 12
+.page:
+    cmp rax, rcx
+    jae .done
+    mov rdx, rax
+    shl rdx, 12
+    or rdx, r8
+    mov [KERNEL_PT_BASE + rax * 8], rdx
+    inc rax
+    jmp .page
+.done:
+    ret
 
 [BITS 16]
 print_16bit:
@@ -192,6 +781,12 @@ print_long_mode:
     pop rax
     ret
 
+elf_error:
+    mov rsi, elfErrorMessage
+    call print_long_mode
+    cli
+    hlt
+
 [BITS 16]
 disk_error:
     mov si, diskErrorMessage
@@ -203,6 +798,34 @@ stage2Message db 'Jumped to stage 2', 13, 10, 0
 diskErrorMessage db 'Disk error in stage 2', 13, 10, 0
 longModeMessage db 'Entered long mode', 0
 protectedModeMessage db 'Entered protected mode', 0
+%ifdef KERNEL_COMPRESSED
+lz4ErrorMessage db 'Bad LZ4 kernel image', 0
+lz4Flags db 0
+%endif
+elfErrorMessage db 'Bad kernel ELF', 0
+bootDrive db 0
+nxSupported db 0
+
+align 4
+kernelDest dd 0
+kernelSectorsLeft dd 0
+%ifdef VBE_WIDTH
+vbeBestArea dd 0
+vbeBestMode dw 0
+%endif
+
+; INT 13h extensions disk address packet
+dap:
+    db 0x10                         ; packet size
+    db 0                            ; reserved
+.count:
+    dw 0                            ; sectors to transfer
+.offset:
+    dw 0                            ; destination offset
+.segment:
+    dw 0                            ; destination segment
+.lba:
+    dq 0                            ; starting LBA
 
 align 16
 gdt_start:
@@ -225,6 +848,9 @@ gdt64_descriptor:
     dw gdt64_end - gdt64_start - 1
     dq gdt64_start
 
+; keep stage 2 inside the sectors stage 1 loads
+times STAGE2_SECTORS * 512 - ($ - $$) db 0
+
 section .bss
 align 16
 stack_bottom:
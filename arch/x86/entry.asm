@@ -8,8 +8,70 @@
 section .text
 extern kernel_main
 
+; RDI = boot info from stage 2, passed straight to kernel_main
+; RSI = TSC at kernel_start for the boot timeline
 kernel_start:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov rsi, rax
     call kernel_main
 .halt:
     hlt
-    jmp .halt
\ No newline at end of file
+    jmp .halt
+; Device interrupt entry. Every vector from IRQ_FIRST_VECTOR up has a
+; stub that pushes its number and joins irq_common, which saves the
+; registers the C calling convention doesn't preserve and hands the
+; vector and the CPU's frame to irq_dispatch. None of these vectors
+; push an error code
+IRQ_FIRST_VECTOR equ 32
+
+[GLOBAL irq_stubs]
+extern irq_dispatch
+
+%assign vector IRQ_FIRST_VECTOR
+%rep 256 - IRQ_FIRST_VECTOR
+irq_stub_%+vector:
+    push qword vector
+    jmp irq_common
+%assign vector vector + 1
+%endrep
+
+; The CPU aligned RSP to 16 before pushing its 5 word frame, the vector
+; and the 9 saved registers leave it 8 off, which the sub puts right
+irq_common:
+    cld
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    mov rdi, [rsp + 9 * 8]          ; vector
+    lea rsi, [rsp + 10 * 8]         ; interrupt_frame_t
+    sub rsp, 8
+    call irq_dispatch
+    add rsp, 8
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    add rsp, 8                      ; drop the vector
+    iretq
+
+section .rodata
+align 8
+irq_stubs:
+%assign vector IRQ_FIRST_VECTOR
+%rep 256 - IRQ_FIRST_VECTOR
+    dq irq_stub_%+vector
+%assign vector vector + 1
+%endrep
@@ -0,0 +1,97 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KACPI_H__
+#define __KACPI_H__
+
+#include "../libk/kdef.h"
+
+#define ACPI_EBDA_PTR 0x40E             // BDA word holding the EBDA segment
+#define ACPI_BIOS_START 0xE0000         // The RSDP is in the EBDA's first KB or here
+#define ACPI_BIOS_END 0x100000
+
+#define ACPI_VIRT_BASE 0xFFFFFFFFFE000000ULL  // Tables outside the physmap
+#define ACPI_WINDOW_SIZE 0x800000ULL
+#define ACPI_WINDOWS 32
+
+#define ACPI_MADT_LAPIC 0
+#define ACPI_MADT_IOAPIC 1
+#define ACPI_MADT_OVERRIDE 2
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+
+// MPS INTI flags of an interrupt source override
+#define ACPI_POLARITY_MASK 0x3
+#define ACPI_POLARITY_HIGH 0x1
+#define ACPI_POLARITY_LOW 0x3
+#define ACPI_TRIGGER_MASK 0xC
+#define ACPI_TRIGGER_EDGE 0x4
+#define ACPI_TRIGGER_LEVEL 0xC
+
+struct acpi_rsdp
+{
+    char signature[8];              // "RSD PTR "
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;               // 2 and up has the XSDT
+    uint32_t rsdt;
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header
+{
+    char signature[4];
+    uint32_t length;                // Header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt
+{
+    struct acpi_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;                 // Bit 0: 8259s are present
+    uint8_t entries[];              // Type, length, then the body
+} __attribute__((packed));
+
+struct acpi_madt_lapic
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_ioapic
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct acpi_madt_override
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t bus;                    // 0, ISA
+    uint8_t source;                 // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+bool init_acpi();
+const struct acpi_header* acpi_find(const char* signature);
+
+#endif
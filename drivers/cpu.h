@@ -11,12 +11,14 @@
 #define CPUID_FEATURES           0x1
 #define CPUID_TLB               0x2
 #define CPUID_SERIAL            0x3
+#define CPUID_CACHE_PARAMS      0x4
 #define CPUID_EXT_FEATURES      0x7
 #define CPUID_HIGHEST_EXT      0x80000000
 #define CPUID_EXT_FEATURES_2   0x80000001
 #define CPUID_BRAND_STRING     0x80000002
 #define CPUID_BRAND_STRING_2   0x80000003
 #define CPUID_BRAND_STRING_3   0x80000004
+#define CPUID_L2_CACHE         0x80000006
 
 #define CPU_FEATURE_FPU    (1 << 0)  // Floating-point unit
 #define CPU_FEATURE_VME    (1 << 1)  // Virtual Mode Extension
@@ -49,7 +51,30 @@
 #define CPU_FEATURE_SSE41  (1 << 19) // SSE4.1 Extensions
 #define CPU_FEATURE_SSE42  (1 << 20) // SSE4.2 Extensions
 #define CPU_FEATURE_AES    (1 << 25) // AES Instructions
+#define CPU_FEATURE_XSAVE  (1 << 26) // XSAVE/XSETBV, ECX only
+#define CPU_FEATURE_OSXSAVE (1 << 27) // CR4.OSXSAVE is set, ECX only
 #define CPU_FEATURE_AVX    (1 << 28) // Advanced Vector Extensions
+#define CPU_FEATURE_PCID   (1 << 17) // Process-context identifiers, ECX only
+
+// CPUID_EXT_FEATURES (0x7) EBX
+#define CPU_FEATURE_AVX2     (1 << 5)  // AVX2 Instructions
+#define CPU_FEATURE_ERMS     (1 << 9)  // Enhanced REP MOVSB/STOSB
+#define CPU_FEATURE_INVPCID  (1 << 10) // INVPCID Instruction
+
+// CPUID_EXT_FEATURES (0x7) EDX
+#define CPU_FEATURE_FSRM     (1 << 4)  // Fast short REP MOVSB
+
+// CPUID_EXT_FEATURES_2 (0x80000001) EDX
+#define CPU_FEATURE_NX       (1 << 20) // No-Execute pages
+#define CPU_FEATURE_PDPE1GB  (1 << 26) // 1GB pages
+#define CPU_FEATURE_RDTSCP   (1 << 27) // RDTSCP Instruction
+#define CPU_FEATURE_LM       (1 << 29) // Long Mode
+
+#define MAX_CPUS 8
+
+#define MSR_PAT      0x277
+#define MSR_EFER     0xC0000080
+#define EFER_NXE     (1 << 11)
 
 typedef struct
 {
@@ -63,5 +88,14 @@ void cpuid(uint32_t code, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
 __attribute__((used)) void cpu_get_vendor(char* vendor);
 cpuid_registers_t cpu_get_features();
 __attribute__((used)) int cpu_has_feature(uint32_t feature);
+int cpu_has_ext_feature(uint32_t feature);
+int cpu_has_ecx_feature(uint32_t feature);
+int cpu_has_leaf7_feature(uint32_t feature);
+int cpu_has_leaf7_edx_feature(uint32_t feature);
+uint64_t cpu_cache_size();
+uint64_t rdtsc();
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+uint32_t cpu_id();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KFB_H__
+#define __KFB_H__
+
+#include "../libk/kdef.h"
+#include "../kernel/boot.h"
+
+#define FB_VIRT_BASE 0xFFFFC70000000000ULL  // Below vmalloc, 1 TB of room
+
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 16
+#define FONT_GLYPHS 256
+
+#define FB_HISTORY 256                  // Rows kept for the console, power of two
+#define FB_MAX_COLS 256                 // Widest grid, 2048 pixels
+#define FB_GLYPH_CACHES 4               // Attributes with rasterized glyphs
+#define FB_GLYPH_ORDER 5                // 256 glyphs of 8x16 32-bit pixels, 128 KB
+
+bool init_fb(const struct boot_info* boot_info);
+bool fb_active();
+void fb_select(uint32_t features);
+const char* fb_variant();
+
+uint32_t fb_rgb(uint8_t r, uint8_t g, uint8_t b);
+uint32_t fb_width();
+uint32_t fb_height();
+uint32_t fb_cols();
+uint32_t fb_rows();
+void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel);
+void fb_draw_text(uint32_t col, uint32_t row, const char* text, size_t len, uint8_t attr);
+
+void fb_write(const char* data, size_t len);
+void fb_flush();
+void fb_redraw();
+
+#endif
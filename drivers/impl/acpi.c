@@ -0,0 +1,140 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../acpi.h"
+#include "../paging.h"
+#include "../../libk/memory.h"
+
+// Root table, an XSDT holds 64-bit pointers and an RSDT 32-bit ones
+static const struct acpi_header* root = NULL;
+static size_t root_entry_size = 0;
+
+static bool checksum_ok(const void* table, size_t len)
+{
+    const uint8_t* bytes = table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+// Ranges mapped into the ACPI window so far
+static struct
+{
+    uint64_t phys;
+    uint64_t size;
+    uint64_t virt;
+} windows[ACPI_WINDOWS];
+static int window_count = 0;
+static uint64_t window_used = 0;
+
+// Tables are read through the physmap, which covers the ACPI regions of
+// the E820 map along with RAM. Some firmware keeps them in reserved
+// memory instead, that gets a read-only WB mapping in the ACPI window
+static const void* acpi_map(uint64_t phys, size_t len)
+{
+    if (!phys)
+        return NULL;
+    if (physmap_covers(phys, len))
+        return PHYS_TO_VIRT(phys);
+
+    for (int i = 0; i < window_count; i++)
+    {
+        if (phys >= windows[i].phys && phys + len <= windows[i].phys + windows[i].size)
+            return (const void*)(windows[i].virt + (phys - windows[i].phys));
+    }
+
+    uint64_t start = phys & ~(PAGE_SIZE_4K - 1);
+    uint64_t size = ((phys + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1)) - start;
+    if (window_count == ACPI_WINDOWS || window_used + size > ACPI_WINDOW_SIZE)
+        return NULL;
+    uint64_t virt = ACPI_VIRT_BASE + window_used;
+    if (!vmm_map(&kernel_space, virt, start, size, PAGE_GLOBAL | page_nx(), MEM_WB))
+        return NULL;
+
+    windows[window_count].phys = start;
+    windows[window_count].size = size;
+    windows[window_count].virt = virt;
+    window_count++;
+    window_used += size;
+    return (const void*)(virt + (phys - start));
+}
+
+static const struct acpi_header* acpi_table(uint64_t phys)
+{
+    const struct acpi_header* header = acpi_map(phys, sizeof(struct acpi_header));
+    if (!header)
+        return NULL;
+    // Mapped again as a whole, a window mapping may only hold the header
+    uint32_t length = header->length;
+    if (length < sizeof(struct acpi_header))
+        return NULL;
+    header = acpi_map(phys, length);
+    if (!header || !checksum_ok(header, length))
+        return NULL;
+    return header;
+}
+
+static const struct acpi_rsdp* rsdp_scan(uint64_t start, uint64_t end)
+{
+    for (uint64_t phys = start; phys + sizeof(struct acpi_rsdp) <= end; phys += 16)
+    {
+        const struct acpi_rsdp* rsdp = PHYS_TO_VIRT(phys);
+        if (!memcmp(rsdp->signature, "RSD PTR ", 8) && checksum_ok(rsdp, 20))
+            return rsdp;
+    }
+    return NULL;
+}
+
+/**
+ * Find the RSDP the BIOS left in low memory and the root table it names
+ * @return: false without valid ACPI tables
+ */
+bool init_acpi()
+{
+    uint64_t ebda = (uint64_t)*(const uint16_t*)PHYS_TO_VIRT(ACPI_EBDA_PTR) << 4;
+    const struct acpi_rsdp* rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < ACPI_BIOS_START)
+        rsdp = rsdp_scan(ebda, ebda + 1024);
+    if (!rsdp)
+        rsdp = rsdp_scan(ACPI_BIOS_START, ACPI_BIOS_END);
+    if (!rsdp)
+        return false;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt && checksum_ok(rsdp, rsdp->length))
+    {
+        root = acpi_table(rsdp->xsdt);
+        root_entry_size = sizeof(uint64_t);
+    }
+    if (!root)
+    {
+        root = acpi_table(rsdp->rsdt);
+        root_entry_size = sizeof(uint32_t);
+    }
+    return root != NULL;
+}
+
+/**
+ * Look up a table by signature in the root table
+ * @param signature: Four characters, such as "APIC" for the MADT
+ * @return: The table with a valid checksum, NULL if there is none
+ */
+const struct acpi_header* acpi_find(const char* signature)
+{
+    if (!root)
+        return NULL;
+
+    const uint8_t* entries = (const uint8_t*)(root + 1);
+    size_t count = (root->length - sizeof(struct acpi_header)) / root_entry_size;
+    for (size_t i = 0; i < count; i++)
+    {
+        // XSDT entries sit 4 bytes off 8-byte alignment
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * root_entry_size, root_entry_size);
+        const struct acpi_header* header = acpi_map(phys, sizeof(struct acpi_header));
+        if (header && !memcmp(header->signature, signature, 4))
+            return acpi_table(phys);
+    }
+    return NULL;
+}
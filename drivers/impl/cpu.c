@@ -31,3 +31,103 @@ int cpu_has_feature(uint32_t feature)
     cpuid_registers_t regs = cpu_get_features();
     return (regs.edx & feature) || (regs.ecx & feature);
 }
+
+int cpu_has_ext_feature(uint32_t feature)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_HIGHEST_EXT, &eax, &ebx, &ecx, &edx);
+    if (eax < CPUID_EXT_FEATURES_2)
+        return 0;
+    cpuid(CPUID_EXT_FEATURES_2, &eax, &ebx, &ecx, &edx);
+    return (edx & feature) != 0;
+}
+
+// Leaf 1 ECX only, for bits that mean something else in EDX
+int cpu_has_ecx_feature(uint32_t feature)
+{
+    cpuid_registers_t regs = cpu_get_features();
+    return (regs.ecx & feature) != 0;
+}
+
+// CPUID with a subleaf in ECX, false if the leaf is not implemented
+static bool cpuid_subleaf(uint32_t leaf, uint32_t subleaf, cpuid_registers_t* regs)
+{
+    uint32_t max, ebx, ecx, edx;
+    cpuid(leaf & CPUID_HIGHEST_EXT, &max, &ebx, &ecx, &edx);
+    if (max < leaf)
+        return false;
+    __asm__ volatile("cpuid"
+        : "=a"(regs->eax), "=b"(regs->ebx), "=c"(regs->ecx), "=d"(regs->edx)
+        : "a"(leaf), "c"(subleaf));
+    return true;
+}
+
+// Structured extended features, leaf 7 subleaf 0 EBX
+int cpu_has_leaf7_feature(uint32_t feature)
+{
+    cpuid_registers_t regs;
+    return cpuid_subleaf(CPUID_EXT_FEATURES, 0, &regs) && (regs.ebx & feature);
+}
+
+// Structured extended features, leaf 7 subleaf 0 EDX
+int cpu_has_leaf7_edx_feature(uint32_t feature)
+{
+    cpuid_registers_t regs;
+    return cpuid_subleaf(CPUID_EXT_FEATURES, 0, &regs) && (regs.edx & feature);
+}
+
+/**
+ * Size of the largest data or unified cache
+ * @return: Size in bytes, 0 if the CPU does not report it
+ */
+uint64_t cpu_cache_size()
+{
+    uint64_t largest = 0;
+    cpuid_registers_t regs;
+    for (uint32_t i = 0; cpuid_subleaf(CPUID_CACHE_PARAMS, i, &regs); i++)
+    {
+        uint32_t type = regs.eax & 0x1F;
+        if (type == 0)
+            break;
+        if (type == 2)
+            continue;  // Instruction cache
+
+        uint64_t ways = ((regs.ebx >> 22) & 0x3FF) + 1;
+        uint64_t partitions = ((regs.ebx >> 12) & 0x3FF) + 1;
+        uint64_t line = (regs.ebx & 0xFFF) + 1;
+        uint64_t sets = (uint64_t)regs.ecx + 1;
+        uint64_t size = ways * partitions * line * sets;
+        if (size > largest)
+            largest = size;
+    }
+
+    // AMD has no leaf 4 but reports its L2 in KB here
+    if (!largest && cpuid_subleaf(CPUID_L2_CACHE, 0, &regs))
+        largest = (uint64_t)(regs.ecx >> 16) * 1024;
+    return largest;
+}
+
+uint64_t rdtsc()
+{
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Index into per-CPU arrays, below MAX_CPUS
+uint32_t cpu_id()
+{
+    return 0;                         // Only the BSP runs for now
+}
@@ -0,0 +1,561 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../fb.h"
+#include "../init.h"
+#include "../vga.h"
+#include "../paging.h"
+#include "../../libk/io.h"
+#include "../../libk/memory.h"
+#include "../../libk/slab.h"
+#include "../../kernel/components/pmm.h"
+
+#define HISTORY_MASK (FB_HISTORY - 1)
+#define GLYPH_PIXELS (FONT_WIDTH * FONT_HEIGHT)
+#define GLYPH_ROW_BYTES (FONT_WIDTH * sizeof(uint32_t))
+
+typedef uint64_t __attribute__((aligned(1), may_alias)) u64_unaligned_t;
+typedef uint32_t __attribute__((aligned(1), may_alias)) u32_unaligned_t;
+
+// Vector types, only usable inside functions built for SSE2 or AVX2
+typedef long long vec128_unaligned_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint32_t pixels128_t __attribute__((vector_size(16)));
+typedef long long vec256_unaligned_t __attribute__((vector_size(32), aligned(1), may_alias));
+typedef uint32_t pixels256_t __attribute__((vector_size(32)));
+
+typedef struct
+{
+    const char* name;
+    // Scanline row of n glyphs side by side, 32 contiguous bytes each
+    void (*glyph_row)(uint8_t* dst, const uint32_t* const* glyphs, size_t row, size_t n);
+    void (*fill)(uint8_t* dst, uint32_t pixel, size_t n);
+} fb_kernels_t;
+
+// Every glyph of the font in one attribute's colours, rasterized the
+// first time it is drawn, so a cell is a 16 row copy with no bit tests
+typedef struct
+{
+    uint32_t* pixels;                   // FONT_GLYPHS glyphs of GLYPH_PIXELS
+    uint64_t ready[FONT_GLYPHS / 64];
+    uint64_t used;                      // Lookup clock, the oldest is evicted
+    uint8_t attr;
+    bool valid;
+} glyph_cache_t;
+
+typedef struct
+{
+    uint8_t* base;                      // Write-combined mapping of the LFB
+    uint32_t pitch;
+    uint32_t width;
+    uint32_t height;
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t palette[16];               // VGA colours in the mode's pixel format
+    uint8_t red_size, red_pos;
+    uint8_t green_size, green_pos;
+    uint8_t blue_size, blue_pos;
+} fb_t;
+
+static fb_t fb;
+static uint8_t font[FONT_GLYPHS * FONT_HEIGHT];
+static glyph_cache_t caches[FB_GLYPH_CACHES];
+static uint64_t cache_clock = 0;
+
+// The console keeps the same ring of rows as the text mode driver, and
+// shown holds the cells last drawn. A flush renders only the cells
+// that differ, in runs of one attribute, within the rows that changed
+static uint16_t* history = NULL;
+static uint16_t* shown = NULL;
+static uint64_t line = 0;
+static size_t col = 0;
+static uint8_t color = VGA_COLOR(VGA_WHITE, VGA_BLACK);
+static bool dirty = false;
+static uint64_t dirty_from = 0;
+static bool redraw = false;
+static uint64_t shown_top = 0;
+
+static const uint8_t vga_rgb[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xAA }, { 0x00, 0xAA, 0x00 }, { 0x00, 0xAA, 0xAA },
+    { 0xAA, 0x00, 0x00 }, { 0xAA, 0x00, 0xAA }, { 0xAA, 0x55, 0x00 }, { 0xAA, 0xAA, 0xAA },
+    { 0x55, 0x55, 0x55 }, { 0x55, 0x55, 0xFF }, { 0x55, 0xFF, 0x55 }, { 0x55, 0xFF, 0xFF },
+    { 0xFF, 0x55, 0x55 }, { 0xFF, 0x55, 0xFF }, { 0xFF, 0xFF, 0x55 }, { 0xFF, 0xFF, 0xFF },
+};
+
+static void words_glyph_row(uint8_t* dst, const uint32_t* const* glyphs, size_t row, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const uint64_t* src = (const uint64_t*)(glyphs[i] + row * FONT_WIDTH);
+        u64_unaligned_t* out = (u64_unaligned_t*)(dst + i * GLYPH_ROW_BYTES);
+        out[0] = src[0];
+        out[1] = src[1];
+        out[2] = src[2];
+        out[3] = src[3];
+    }
+}
+
+static void words_fill(uint8_t* dst, uint32_t pixel, size_t n)
+{
+    uint64_t pair = (uint64_t)pixel << 32 | pixel;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        *(u64_unaligned_t*)(dst + i * 4) = pair;
+    if (i < n)
+        *(u32_unaligned_t*)(dst + i * 4) = pixel;
+}
+
+__attribute__((target("sse2")))
+static void sse2_glyph_row(uint8_t* dst, const uint32_t* const* glyphs, size_t row, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const vec128_unaligned_t* src = (const vec128_unaligned_t*)(glyphs[i] + row * FONT_WIDTH);
+        vec128_unaligned_t* out = (vec128_unaligned_t*)(dst + i * GLYPH_ROW_BYTES);
+        out[0] = src[0];
+        out[1] = src[1];
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_fill(uint8_t* dst, uint32_t pixel, size_t n)
+{
+    vec128_unaligned_t v = (vec128_unaligned_t)((pixels128_t){ 0 } + pixel);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        *(vec128_unaligned_t*)(dst + i * 4) = v;
+        *(vec128_unaligned_t*)(dst + i * 4 + 16) = v;
+        *(vec128_unaligned_t*)(dst + i * 4 + 32) = v;
+        *(vec128_unaligned_t*)(dst + i * 4 + 48) = v;
+    }
+    for (; i + 4 <= n; i += 4)
+        *(vec128_unaligned_t*)(dst + i * 4) = v;
+    for (; i < n; i++)
+        *(u32_unaligned_t*)(dst + i * 4) = pixel;
+}
+
+__attribute__((target("avx2")))
+static void avx2_glyph_row(uint8_t* dst, const uint32_t* const* glyphs, size_t row, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        *(vec256_unaligned_t*)(dst + i * GLYPH_ROW_BYTES) =
+            *(const vec256_unaligned_t*)(glyphs[i] + row * FONT_WIDTH);
+}
+
+__attribute__((target("avx2")))
+static void avx2_fill(uint8_t* dst, uint32_t pixel, size_t n)
+{
+    vec256_unaligned_t v = (vec256_unaligned_t)((pixels256_t){ 0 } + pixel);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        *(vec256_unaligned_t*)(dst + i * 4) = v;
+        *(vec256_unaligned_t*)(dst + i * 4 + 32) = v;
+        *(vec256_unaligned_t*)(dst + i * 4 + 64) = v;
+        *(vec256_unaligned_t*)(dst + i * 4 + 96) = v;
+    }
+    for (; i + 8 <= n; i += 8)
+        *(vec256_unaligned_t*)(dst + i * 4) = v;
+    for (; i < n; i++)
+        *(u32_unaligned_t*)(dst + i * 4) = pixel;
+}
+
+static const fb_kernels_t words_kernels = { "words", words_glyph_row, words_fill };
+static const fb_kernels_t sse2_kernels = { "sse2", sse2_glyph_row, sse2_fill };
+static const fb_kernels_t avx2_kernels = { "avx2", avx2_glyph_row, avx2_fill };
+
+// Chosen by fb_select(), handlers run with IF clear and keep to words
+static const fb_kernels_t* fb_vector = NULL;
+
+static inline const fb_kernels_t* kernels()
+{
+    return fb_vector && simd_usable() ? fb_vector : &words_kernels;
+}
+
+static void fb_format_sink(format_sink_t* sink, const char* data, size_t len)
+{
+    (void)sink;
+    fb_write(data, len);
+}
+
+static format_sink_t fb_sink = { fb_format_sink };
+
+static inline uint16_t* row_at(uint64_t row)
+{
+    return history + (row & HISTORY_MASK) * fb.cols;
+}
+
+static inline uint32_t channel(uint8_t value, uint8_t size, uint8_t pos)
+{
+    return size ? (uint32_t)(value >> (8 - size)) << pos : 0;
+}
+
+/**
+ * Pack a colour in the framebuffer's pixel format
+ * @return: Pixel for fb_fill_rect
+ */
+uint32_t fb_rgb(uint8_t r, uint8_t g, uint8_t b)
+{
+    return channel(r, fb.red_size, fb.red_pos) | channel(g, fb.green_size, fb.green_pos) |
+           channel(b, fb.blue_size, fb.blue_pos);
+}
+
+static glyph_cache_t* cache_for(uint8_t attr)
+{
+    glyph_cache_t* victim = &caches[0];
+    cache_clock++;
+    for (int i = 0; i < FB_GLYPH_CACHES; i++)
+    {
+        glyph_cache_t* cache = &caches[i];
+        if (cache->valid && cache->attr == attr)
+        {
+            cache->used = cache_clock;
+            return cache;
+        }
+        if (cache->used < victim->used)
+            victim = cache;
+    }
+
+    victim->attr = attr;
+    victim->valid = true;
+    victim->used = cache_clock;
+    memset(victim->ready, 0, sizeof(victim->ready));
+    return victim;
+}
+
+static const uint32_t* glyph(glyph_cache_t* cache, uint8_t c)
+{
+    uint32_t* pixels = cache->pixels + c * GLYPH_PIXELS;
+    uint64_t bit = 1ULL << (c & 63);
+    if (cache->ready[c >> 6] & bit)
+        return pixels;
+
+    uint32_t fg = fb.palette[cache->attr & 0x0F];
+    uint32_t bg = fb.palette[cache->attr >> 4];
+    const uint8_t* bits = font + c * FONT_HEIGHT;
+    for (int y = 0; y < FONT_HEIGHT; y++)
+        for (int x = 0; x < FONT_WIDTH; x++)
+            pixels[y * FONT_WIDTH + x] = bits[y] & (0x80 >> x) ? fg : bg;
+    cache->ready[c >> 6] |= bit;
+    return pixels;
+}
+
+// Draws cells of one attribute, scanline by scanline so each store
+// stream to the write-combined LFB is a contiguous run
+static void render_run(uint32_t x, uint32_t y, const uint16_t* cells, size_t n)
+{
+    const uint32_t* glyphs[FB_MAX_COLS];
+    glyph_cache_t* cache = cache_for(cells[0] >> 8);
+    for (size_t i = 0; i < n; i++)
+        glyphs[i] = glyph(cache, cells[i] & 0xFF);
+
+    const fb_kernels_t* k = kernels();
+    uint8_t* dst = fb.base + (uint64_t)y * FONT_HEIGHT * fb.pitch + x * GLYPH_ROW_BYTES;
+    for (size_t row = 0; row < FONT_HEIGHT; row++)
+        k->glyph_row(dst + row * fb.pitch, glyphs, row, n);
+}
+
+// Undoes whatever a failed init_fb got done
+static void fb_release(uint64_t size)
+{
+    for (int i = 0; i < FB_GLYPH_CACHES; i++)
+    {
+        if (caches[i].pixels)
+            free_frames(VIRT_TO_PHYS(caches[i].pixels), FB_GLYPH_ORDER);
+        caches[i].pixels = NULL;
+    }
+    kfree(history);
+    kfree(shown);
+    history = NULL;
+    shown = NULL;
+    vmm_unmap(&kernel_space, FB_VIRT_BASE, size);
+}
+
+/**
+ * Take over the console from text mode on the framebuffer stage 2 set up
+ * @param boot_info: Mode geometry and the font copied from the BIOS
+ * @return: false if there is no 32 bpp framebuffer or it can't be mapped
+ */
+bool init_fb(const struct boot_info* boot_info)
+{
+    if (!boot_info->fb_addr || boot_info->fb_bpp != 32 || !boot_info->font)
+        return false;
+
+    uint32_t cols = boot_info->fb_width / FONT_WIDTH;
+    uint32_t rows = boot_info->fb_height / FONT_HEIGHT;
+    if (!cols || !rows)
+        return false;
+    if (cols > FB_MAX_COLS)
+        cols = FB_MAX_COLS;
+
+    uint64_t phys = boot_info->fb_addr & ~(PAGE_SIZE_4K - 1);
+    uint64_t offset = boot_info->fb_addr - phys;
+    uint64_t size = (offset + (uint64_t)boot_info->fb_pitch * boot_info->fb_height + PAGE_SIZE_4K - 1) &
+                    ~(PAGE_SIZE_4K - 1);
+    if (!vmm_map(&kernel_space, FB_VIRT_BASE, phys, size, PAGE_WRITE | PAGE_GLOBAL | page_nx(), MEM_WC))
+    {
+        vmm_unmap(&kernel_space, FB_VIRT_BASE, size);
+        return false;
+    }
+
+    history = kmalloc(FB_HISTORY * cols * sizeof(uint16_t));
+    shown = kmalloc(rows * cols * sizeof(uint16_t));
+    if (!history || !shown)
+    {
+        fb_release(size);
+        return false;
+    }
+    for (int i = 0; i < FB_GLYPH_CACHES; i++)
+    {
+        uint64_t frames = alloc_frames(FB_GLYPH_ORDER, ZONE_NORMAL);
+        if (!frames)
+        {
+            fb_release(size);
+            return false;
+        }
+        caches[i].pixels = PHYS_TO_VIRT(frames);
+    }
+
+    fb_select(cpu_mem_features());
+    fb.base = (uint8_t*)FB_VIRT_BASE + offset;
+    fb.pitch = boot_info->fb_pitch;
+    fb.width = boot_info->fb_width;
+    fb.height = boot_info->fb_height;
+    fb.cols = cols;
+    fb.rows = rows;
+    fb.red_size = boot_info->fb_red_size;
+    fb.red_pos = boot_info->fb_red_pos;
+    fb.green_size = boot_info->fb_green_size;
+    fb.green_pos = boot_info->fb_green_pos;
+    fb.blue_size = boot_info->fb_blue_size;
+    fb.blue_pos = boot_info->fb_blue_pos;
+    for (int i = 0; i < 16; i++)
+        fb.palette[i] = fb_rgb(vga_rgb[i][0], vga_rgb[i][1], vga_rgb[i][2]);
+    memcpy(font, PHYS_TO_VIRT(boot_info->font), sizeof(font));
+
+    for (size_t i = 0; i < FB_HISTORY * cols; i++)
+        history[i] = VGA_ENTRY(' ', color);
+    for (size_t i = 0; i < rows * cols; i++)
+        shown[i] = VGA_ENTRY(' ', color);
+    fb_fill_rect(0, 0, fb.width, fb.height, fb.palette[color >> 4]);
+
+    console_register(CONSOLE_VGA, &fb_sink);
+    return true;
+}
+
+bool fb_active()
+{
+    return fb.base != NULL;
+}
+
+/**
+ * Pick the blitter variant for this CPU, once its vector state is enabled
+ * @param features: MEM_* flags, 0 for the general purpose registers only
+ */
+void fb_select(uint32_t features)
+{
+    if (features & MEM_AVX2)
+        fb_vector = &avx2_kernels;
+    else if (features & MEM_SSE2)
+        fb_vector = &sse2_kernels;
+    else
+        fb_vector = NULL;
+}
+
+const char* fb_variant()
+{
+    return fb_vector ? fb_vector->name : words_kernels.name;
+}
+
+uint32_t fb_width()
+{
+    return fb.width;
+}
+
+uint32_t fb_height()
+{
+    return fb.height;
+}
+
+uint32_t fb_cols()
+{
+    return fb.cols;
+}
+
+uint32_t fb_rows()
+{
+    return fb.rows;
+}
+
+/**
+ * Fill a rectangle of pixels, clipped to the screen
+ * @param pixel: Colour from fb_rgb
+ */
+void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel)
+{
+    if (!fb.base || x >= fb.width || y >= fb.height)
+        return;
+    if (w > fb.width - x)
+        w = fb.width - x;
+    if (h > fb.height - y)
+        h = fb.height - y;
+
+    const fb_kernels_t* k = kernels();
+    uint8_t* dst = fb.base + (uint64_t)y * fb.pitch + x * sizeof(uint32_t);
+    for (uint32_t row = 0; row < h; row++)
+        k->fill(dst + (uint64_t)row * fb.pitch, pixel, w);
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+/**
+ * Draw text at a cell position, outside the console. The console paints
+ * over it on its next fb_redraw
+ * @param attr: VGA colour attribute
+ */
+void fb_draw_text(uint32_t x, uint32_t y, const char* text, size_t len, uint8_t attr)
+{
+    if (!fb.base || x >= fb.cols || y >= fb.rows)
+        return;
+    if (len > fb.cols - x)
+        len = fb.cols - x;
+
+    uint16_t cells[FB_MAX_COLS];
+    for (size_t i = 0; i < len; i++)
+        cells[i] = VGA_ENTRY((uint8_t)text[i], attr);
+    if (len)
+        render_run(x, y, cells, len);
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+static void newline()
+{
+    col = 0;
+    line++;
+    uint16_t* cells = row_at(line);
+    for (size_t x = 0; x < fb.cols; x++)
+        cells[x] = VGA_ENTRY(' ', color);
+}
+
+/**
+ * Draw the cells that changed since the last call. A scroll moves every
+ * row, but only cells whose character or colour differ from what is on
+ * screen get rendered, and the LFB is never read back
+ */
+void fb_flush()
+{
+    if (!fb.base)
+        return;
+    uint64_t top = line >= fb.rows - 1 ? line - (fb.rows - 1) : 0;
+    if (!dirty && !redraw && top == shown_top)
+        return;
+
+    // Without a scroll the damage is the rows from dirty_from down
+    uint32_t first = 0;
+    uint32_t last = fb.rows - 1;
+    if (!redraw && top == shown_top)
+    {
+        first = dirty_from > top ? dirty_from - top : 0;
+        last = line - top;
+    }
+
+    for (uint32_t y = first; y <= last; y++)
+    {
+        const uint16_t* cells = row_at(top + y);
+        uint16_t* seen = shown + y * fb.cols;
+        uint32_t x = 0;
+        while (x < fb.cols)
+        {
+            if (!redraw && cells[x] == seen[x])
+            {
+                x++;
+                continue;
+            }
+            uint32_t start = x;
+            uint16_t attr = cells[x] & 0xFF00;
+            while (x < fb.cols && (redraw || cells[x] != seen[x]) && (cells[x] & 0xFF00) == attr)
+            {
+                seen[x] = cells[x];
+                x++;
+            }
+            render_run(start, y, cells + start, x - start);
+        }
+    }
+
+    __asm__ volatile("sfence" ::: "memory");
+    shown_top = top;
+    dirty = false;
+    redraw = false;
+}
+
+/**
+ * Render every console cell again, after something drew over them
+ */
+void fb_redraw()
+{
+    redraw = true;
+    fb_flush();
+}
+
+static void fb_control(char c)
+{
+    switch (c)
+    {
+        case '\n':
+            newline();
+            return;
+        case '\r':
+            col = 0;
+            return;
+        case '\t':
+            col = (col + 8) & ~7;
+            break;
+        case '\b':
+            if (col > 0)
+                col--;
+            break;
+        default:
+            row_at(line)[col++] = VGA_ENTRY((uint8_t)c, color);
+            break;
+    }
+
+    if (col >= fb.cols)
+        newline();
+}
+
+/**
+ * Write a run of text into the console rows and flush once
+ * @param data: Text to write
+ * @param len: Number of bytes
+ */
+void fb_write(const char* data, size_t len)
+{
+    if (!fb.base)
+        return;
+    if (!dirty)
+    {
+        dirty = true;
+        dirty_from = line;
+    }
+
+    size_t i = 0;
+    while (i < len)
+    {
+        if ((uint8_t)data[i] < ' ')
+        {
+            fb_control(data[i++]);
+            continue;
+        }
+
+        uint16_t* cell = row_at(line) + col;
+        size_t room = fb.cols - col;
+        size_t n = 0;
+        while (n < room && i < len && (uint8_t)data[i] >= ' ')
+            cell[n++] = VGA_ENTRY((uint8_t)data[i++], color);
+
+        col += n;
+        if (col >= fb.cols)
+            newline();
+    }
+    fb_flush();
+}
@@ -7,12 +7,16 @@
 #include "../port.h"
 #include "../paging.h"
 #include "../../libk/io.h"
+#include "../../libk/memory.h"
+#include "../../libk/string.h"
+#include "../../kernel/components/interrupt_handler.h"
 
 static struct gdt_entry gdt[GDT_ENTRIES];
 static struct tss_entry tss;
 static struct idt_entry idt[IDT_ENTRIES];
 static struct gdt_ptr gdtp;
 static struct idt_ptr idtp;
+static uint32_t mem_features = 0;
 
 static void gdt_set_gate(int num, uint64_t base, uint32_t limit, uint8_t access, uint8_t gran)
 {
@@ -112,7 +116,61 @@ void init_cpu()
     __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
     cr4 |= (1 << 5);  // Enable PAE
     cr4 |= (1 << 7);  // Enable PGE
+    if (cpu_has_ecx_feature(CPU_FEATURE_PCID))
+        cr4 |= (1 << 17);  // Enable PCIDE, CR3 still has PCID 0 here
+    cr4 |= (1 << 9);   // Enable OSFXSR, SSE2 is architectural on x86_64
+    cr4 |= (1 << 10);  // Enable OSXMMEXCPT
+    bool avx = cpu_has_ecx_feature(CPU_FEATURE_XSAVE) && cpu_has_ecx_feature(CPU_FEATURE_AVX);
+    if (avx)
+        cr4 |= (1 << 18);  // Enable OSXSAVE
     __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
+
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(1ULL << 2);  // Clear EM
+    cr0 |= (1 << 1);      // Set MP
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    // Only libk's memory and string routines and the framebuffer
+    // blitter use vector registers
+    mem_features = MEM_SSE2;
+    if (avx)
+    {
+        uint32_t xcr0_low, xcr0_high;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+        xcr0_low |= 0x7;  // x87, SSE and AVX state
+        __asm__ volatile("xsetbv" :: "a"(xcr0_low), "d"(xcr0_high), "c"(0));
+        if (cpu_has_leaf7_feature(CPU_FEATURE_AVX2))
+            mem_features |= MEM_AVX2;
+    }
+    if (cpu_has_leaf7_feature(CPU_FEATURE_ERMS))
+        mem_features |= MEM_ERMS;
+    if (cpu_has_leaf7_edx_feature(CPU_FEATURE_FSRM))
+        mem_features |= MEM_FSRM;
+    if (cpu_has_ecx_feature(CPU_FEATURE_SSE42))
+        mem_features |= MEM_SSE42;
+    memory_select(mem_features, cpu_cache_size());
+    string_select(mem_features);
+
+    // Every mapping so far selects PAT entry 0, which stays WB, so only
+    // the caches need writing back before the new types take effect
+    if (cpu_has_feature(CPU_FEATURE_PAT))
+    {
+        wrmsr(MSR_PAT, PAT_LAYOUT);
+        __asm__ volatile("wbinvd" ::: "memory");
+        uint64_t cr3;
+        __asm__ volatile("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r"(cr3) : : "memory");
+    }
+}
+
+/**
+ * Vector and string features init_cpu enabled, for code that picks
+ * its own variants the way memory_select does
+ * @return: MEM_* flags
+ */
+uint32_t cpu_mem_features()
+{
+    return mem_features;
 }
 
 void apic_write(uint32_t reg, uint32_t value) 
@@ -138,7 +196,8 @@ void init_apic()
 
     uint32_t id = apic_read(APIC_ID_REG);
     uint32_t svr = apic_read(APIC_SPURIOUS_REG);
-    apic_write(APIC_SPURIOUS_REG, svr | 0x100);
+    // Software enable, spurious interrupts on the vector irq_dispatch won't EOI
+    apic_write(APIC_SPURIOUS_REG, (svr & ~0xFF) | 0x100 | SPURIOUS_VECTOR);
 
     svr = apic_read(APIC_SPURIOUS_REG);
 }
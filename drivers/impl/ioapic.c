@@ -0,0 +1,268 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../ioapic.h"
+#include "../acpi.h"
+#include "../init.h"
+#include "../cpu.h"
+#include "../port.h"
+#include "../paging.h"
+#include "../../libk/spinlock.h"
+#include "../../kernel/components/interrupt_handler.h"
+
+typedef struct
+{
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t pins;
+} ioapic_t;
+
+static ioapic_t ioapics[IOAPIC_MAX];
+static int ioapic_count = 0;
+static bool active = false;
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+// Where each ISA IRQ lands, identity, edge and active high unless the
+// MADT overrides it, as it usually does for the PIT and the SCI
+static uint32_t isa_gsi[ISA_IRQS];
+static uint32_t isa_flags[ISA_IRQS];
+static bool isa_overridden[ISA_IRQS];
+
+// APIC IDs from the MADT, the BSP is CPU 0. Only CPUs that run can take
+// interrupts, an AP still waiting for its startup IPI would drop them
+static uint8_t cpu_apic_ids[MAX_CPUS];
+static uint32_t cpu_count = 0;
+static uint32_t online_cpus = 1 << 0;
+
+static uint32_t ioapic_read(ioapic_t* io, uint32_t reg)
+{
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(ioapic_t* io, uint32_t reg, uint32_t value)
+{
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static ioapic_t* ioapic_for(uint32_t gsi)
+{
+    for (int i = 0; i < ioapic_count; i++)
+    {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].pins)
+            return &ioapics[i];
+    }
+    return NULL;
+}
+
+static uint32_t override_flags(uint16_t inti)
+{
+    uint32_t flags = 0;
+    if ((inti & ACPI_POLARITY_MASK) == ACPI_POLARITY_LOW)
+        flags |= IOAPIC_ACTIVE_LOW;
+    if ((inti & ACPI_TRIGGER_MASK) == ACPI_TRIGGER_LEVEL)
+        flags |= IOAPIC_LEVEL;
+    return flags;
+}
+
+static bool parse_madt()
+{
+    const struct acpi_madt* madt = (const struct acpi_madt*)acpi_find("APIC");
+    if (!madt)
+        return false;
+
+    uint8_t bsp = apic_read(APIC_ID_REG) >> 24;
+    cpu_apic_ids[cpu_count++] = bsp;
+
+    const uint8_t* entry = madt->entries;
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end)
+    {
+        if (entry[0] == ACPI_MADT_LAPIC)
+        {
+            const struct acpi_madt_lapic* lapic = (const void*)entry;
+            if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) && lapic->apic_id != bsp && cpu_count < MAX_CPUS)
+                cpu_apic_ids[cpu_count++] = lapic->apic_id;
+        }
+        else if (entry[0] == ACPI_MADT_IOAPIC && ioapic_count < IOAPIC_MAX)
+        {
+            const struct acpi_madt_ioapic* info = (const void*)entry;
+            uint64_t virt = IOAPIC_VIRT_BASE + ioapic_count * PAGE_SIZE_4K;
+            uint64_t phys = info->addr & ~(PAGE_SIZE_4K - 1);
+            if (vmm_map(&kernel_space, virt, phys, PAGE_SIZE_4K, PAGE_WRITE | PAGE_GLOBAL | page_nx(), MEM_UC))
+            {
+                ioapic_t* io = &ioapics[ioapic_count++];
+                io->regs = (volatile uint32_t*)(virt + (info->addr & (PAGE_SIZE_4K - 1)));
+                io->gsi_base = info->gsi_base;
+                io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+            }
+        }
+        else if (entry[0] == ACPI_MADT_OVERRIDE)
+        {
+            const struct acpi_madt_override* over = (const void*)entry;
+            if (over->bus == 0 && over->source < ISA_IRQS)
+            {
+                isa_gsi[over->source] = over->gsi;
+                isa_flags[over->source] = override_flags(over->flags);
+                isa_overridden[over->source] = true;
+            }
+        }
+        entry += entry[1];
+    }
+    return ioapic_count > 0;
+}
+
+/**
+ * Take interrupt routing over from the 8259s. Every ISA IRQ gets a
+ * redirection entry to the BSP on the vector the PIC used, so handlers
+ * requested so far keep working, the lines they unmasked on the PIC are
+ * unmasked here and the PIC is masked for good
+ * @return: false without a MADT or an I/O APIC, the PIC stays in charge
+ */
+bool init_ioapic()
+{
+    for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+        isa_gsi[irq] = irq;
+    if (!parse_madt())
+        return false;
+
+    for (int i = 0; i < ioapic_count; i++)
+        for (uint32_t pin = 0; pin < ioapics[i].pins; pin++)
+            ioapic_write(&ioapics[i], IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+
+    // An IRQ whose own GSI an override hands to another IRQ, as the PIT's
+    // usually takes the cascade's, has no line here. Routing it by identity
+    // would overwrite the other IRQ's entry
+    for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+    {
+        for (uint8_t other = 0; other < ISA_IRQS; other++)
+        {
+            if (other != irq && isa_overridden[other] && !isa_overridden[irq] && isa_gsi[other] == irq)
+                isa_gsi[irq] = ISA_NO_GSI;
+        }
+    }
+
+    // The cascade has no device behind it
+    for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+    {
+        if (irq != PIC_CASCADE && isa_gsi[irq] != ISA_NO_GSI)
+            ioapic_route(isa_gsi[irq], IRQ_VECTOR(irq), 0, isa_flags[irq] | IOAPIC_MASKED);
+    }
+
+    uint64_t flags = irq_save();
+    uint16_t unmasked = ~(inb(PIC1_DATA) | inb(PIC2_DATA) << 8) & ~(1 << PIC_CASCADE);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    active = true;
+    for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+    {
+        if ((unmasked & (1 << irq)) && isa_gsi[irq] != ISA_NO_GSI)
+            ioapic_unmask(isa_gsi[irq]);
+    }
+    irq_restore(flags);
+    return true;
+}
+
+/**
+ * Whether the I/O APIC routes device interrupts, and so whether a
+ * single local APIC EOI acknowledges them
+ */
+bool ioapic_active()
+{
+    return active;
+}
+
+static bool cpu_online(uint32_t cpu)
+{
+    return cpu < cpu_count && (online_cpus & (1 << cpu));
+}
+
+// Called with ioapic_lock held. Masked while the destination changes,
+// so nothing is sent half way
+static void ioapic_set_entry(ioapic_t* io, uint32_t pin, uint32_t cpu, uint32_t low)
+{
+    ioapic_write(io, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    ioapic_write(io, IOAPIC_REDTBL(pin) + 1, (uint32_t)cpu_apic_ids[cpu] << IOAPIC_DEST_SHIFT);
+    ioapic_write(io, IOAPIC_REDTBL(pin), low);
+}
+
+/**
+ * Program a redirection entry
+ * @param gsi: Global system interrupt, isa_irq_gsi() for ISA IRQs
+ * @param vector: Vector to raise on the CPU
+ * @param cpu: CPU to deliver to, must be running
+ * @param flags: IOAPIC_ACTIVE_LOW, IOAPIC_LEVEL, IOAPIC_MASKED
+ * @return: false if no I/O APIC has the GSI or the CPU isn't online
+ */
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags)
+{
+    ioapic_t* io = ioapic_for(gsi);
+    if (!io || !cpu_online(cpu))
+        return false;
+
+    uint32_t low = vector | (flags & (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL | IOAPIC_MASKED));
+    uint64_t rflags = irq_save();
+    spin_lock(&ioapic_lock);
+    ioapic_set_entry(io, gsi - io->gsi_base, cpu, low);
+    spin_unlock(&ioapic_lock);
+    irq_restore(rflags);
+    return true;
+}
+
+static void ioapic_set_mask(uint32_t gsi, bool masked)
+{
+    ioapic_t* io = ioapic_for(gsi);
+    if (!io)
+        return;
+
+    uint32_t reg = IOAPIC_REDTBL(gsi - io->gsi_base);
+    uint64_t flags = irq_save();
+    spin_lock(&ioapic_lock);
+    uint32_t low = ioapic_read(io, reg);
+    ioapic_write(io, reg, masked ? low | IOAPIC_MASKED : low & ~IOAPIC_MASKED);
+    spin_unlock(&ioapic_lock);
+    irq_restore(flags);
+}
+
+void ioapic_mask(uint32_t gsi)
+{
+    ioapic_set_mask(gsi, true);
+}
+
+void ioapic_unmask(uint32_t gsi)
+{
+    ioapic_set_mask(gsi, false);
+}
+
+uint32_t isa_irq_gsi(uint8_t irq)
+{
+    return irq < ISA_IRQS ? isa_gsi[irq] : irq;
+}
+
+/**
+ * Deliver an ISA IRQ to another CPU, keeping its vector, trigger and mask
+ * @param irq: ISA IRQ line
+ * @param cpu: CPU to deliver to
+ * @return: false without an I/O APIC or if the CPU isn't online
+ */
+bool irq_set_affinity(uint8_t irq, uint32_t cpu)
+{
+    if (!active || irq >= ISA_IRQS || !cpu_online(cpu))
+        return false;
+    uint32_t gsi = isa_gsi[irq];
+    ioapic_t* io = ioapic_for(gsi);
+    if (!io)
+        return false;
+
+    // Read and rewritten under the lock, or a mask change in between is lost
+    uint32_t pin = gsi - io->gsi_base;
+    uint64_t flags = irq_save();
+    spin_lock(&ioapic_lock);
+    uint32_t low = ioapic_read(io, IOAPIC_REDTBL(pin));
+    ioapic_set_entry(io, pin, cpu, low & (0xFF | IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL | IOAPIC_MASKED));
+    spin_unlock(&ioapic_lock);
+    irq_restore(flags);
+    return true;
+}
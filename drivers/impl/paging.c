@@ -5,27 +5,780 @@
 // NO PRINTF SHOULD BE BETWEEN THE CODE
 
 #include "../paging.h"
+#include "../cpu.h"
 #include "../libk/io.h"
+#include "../libk/memory.h"
+#include "../libk/slab.h"
+#include "../libk/spinlock.h"
+#include "../../kernel/components/pmm.h"
 
-void map_page(uint64_t virt, uint64_t phys, uint64_t flags)
+static page_tb_t physmap_pdp __attribute__((aligned(4096)));
+static page_tb_t physmap_pds[PHYSMAP_MAX_PDS] __attribute__((aligned(4096)));
+static page_tb_t physmap_pts[PHYSMAP_MAX_PTS] __attribute__((aligned(4096)));
+static uint32_t physmap_pd_count = 0;
+static uint32_t physmap_pt_count = 0;
+static uint64_t physmap_bytes = 0;
+
+// Physical ranges the physmap covers, the E820 ones plus the low MB
+static struct
+{
+   uint64_t start;
+   uint64_t end;
+} physmap_ranges[PHYSMAP_RANGES];
+static uint32_t physmap_range_count = 0;
+
+static bool huge_1g = false;
+static bool pat_enabled = false;
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+
+addr_space_t kernel_space;
+static addr_space_t* active_space[MAX_CPUS];
+static spinlock_t space_list_lock = SPINLOCK_INIT;
+
+// Per-CPU PCID allocator, a tag is valid while its generation matches
+static uint64_t asid_generation[MAX_CPUS];
+static uint32_t asid_next[MAX_CPUS];
+
+// Size mapped by one entry at a level, PT = 1 .. PML4 = 4
+static inline uint64_t level_size(int level)
 {
-   page_tb_t *pdp = (page_tb_t*)0x4000;   // Bootloader's PDPT
-   page_tb_t *pd = (page_tb_t*)0x5000;    // Bootloader's PD
-   
-   size_t pdp_idx = (virt >> 30) & 0x1FF;
-   size_t pd_idx = (virt >> 21) & 0x1FF;
+   return PAGE_SIZE_4K << (9 * (level - 1));
+}
 
-   pdp->entries[pdp_idx] = ((uint64_t)pd) | PAGE_PRESENT | PAGE_WRITE; // Set up PDPT entry to point to PD
-   pd->entries[pd_idx] = phys | flags; // Map the APIC in PD
+static inline uint64_t* level_entry(page_tb_t* table, int level, uint64_t virt)
+{
+   return &table->entries[(virt >> (12 + 9 * (level - 1))) & 0x1FF];
 }
 
-void init_paging()
+static inline page_tb_t* table_at(uint64_t entry)
+{
+   return PHYS_TO_VIRT(entry & PAGE_ADDR_MASK);
+}
+
+static inline bool can_be_leaf(int level)
+{
+   return level == 1 || level == 2 || (level == 3 && huge_1g);
+}
+
+static inline uint64_t read_cr3()
 {
-   uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE | PAGE_CACHE_DISABLE;
-   map_page(APIC_VIRT_BASE, APIC_PHYS_BASE, flags);
-    
-   // Flush TLB
    uint64_t cr3;
    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+   return cr3;
+}
+
+// Drops every translation, globals included when CR4.PGE is on
+static void flush_tlb_all()
+{
+   uint64_t cr4;
+   __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+   if (cr4 & CR4_PGE)
+   {
+      __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+      __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+   }
+   else
+   {
+      uint64_t cr3 = read_cr3();
+      __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+   }
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr)
+{
+   struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+   __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+static inline bool asid_valid(addr_space_t* space, uint32_t cpu)
+{
+   uint64_t asid = space->asid[cpu];
+   return asid && (asid >> PCID_BITS) == asid_generation[cpu];
+}
+
+// Hands out the next PCID, starting a new generation when they run out.
+// A fresh tag is always loaded with a flushing CR3 write so whatever an
+// older generation left under it is dropped then
+static uint64_t asid_alloc(uint32_t cpu)
+{
+   if (asid_next[cpu] >= PCID_COUNT)
+   {
+      asid_generation[cpu]++;
+      asid_next[cpu] = 1;
+   }
+   return (asid_generation[cpu] << PCID_BITS) | asid_next[cpu]++;
+}
+
+static void tlb_batch_add(tlb_batch_t* batch, uint64_t virt)
+{
+   if (batch->count < TLB_BATCH_MAX)
+      batch->addrs[batch->count] = virt;
+   batch->count++;
+   if (virt >= KERNEL_HALF_BASE)
+      batch->kernel_half = true;
+}
+
+// Kernel half changes and changes to the live space get one invlpg per
+// touched entry, or a full flush once that would cost more. Another
+// space's stale entries are dropped by tag with INVPCID, or by retiring
+// its PCID so the next switch to it starts clean
+static void tlb_batch_flush(tlb_batch_t* batch, addr_space_t* space)
+{
+   if (!batch->count)
+      return;
+
+   uint32_t cpu = cpu_id();
+   if (space == active_space[cpu] || batch->kernel_half)
+   {
+      if (batch->count > TLB_BATCH_MAX)
+         flush_tlb_all();
+      else
+      {
+         for (uint32_t i = 0; i < batch->count; i++)
+            __asm__ volatile("invlpg (%0)" : : "r"(batch->addrs[i]) : "memory");
+      }
+   }
+   else if (pcid_enabled && asid_valid(space, cpu))
+   {
+      uint64_t pcid = space->asid[cpu] & PCID_MASK;
+      if (invpcid_supported && batch->count <= TLB_BATCH_MAX)
+      {
+         for (uint32_t i = 0; i < batch->count; i++)
+            invpcid(INVPCID_ADDRESS, pcid, batch->addrs[i]);
+      }
+      else if (invpcid_supported)
+         invpcid(INVPCID_CONTEXT, pcid, 0);
+      else
+         space->asid[cpu] = 0;
+   }
+
+   // Other CPUs pick up a fresh tag on their next switch
+   for (uint32_t i = 0; i < MAX_CPUS; i++)
+   {
+      if (i != cpu && active_space[i] != space)
+         space->asid[i] = 0;
+   }
+   batch->count = 0;
+}
+
+static page_tb_t* alloc_table()
+{
+   uint64_t phys = alloc_frame();
+   if (!phys)
+      return NULL;
+   page_tb_t* table = PHYS_TO_VIRT(phys);
+   memset(table, 0, sizeof(*table));
+   return table;
+}
+
+// Replaces a huge leaf at 'level' with a table of smaller leaves
+// mapping the same range with the same flags
+static page_tb_t* split_huge(uint64_t* entry, int level)
+{
+   page_tb_t* table = alloc_table();
+   if (!table)
+      return NULL;
+
+   uint64_t size = level_size(level);
+   uint64_t child_size = level_size(level - 1);
+   uint64_t base = *entry & PAGE_ADDR_MASK & ~(size - 1);
+   uint64_t flags = *entry & ~PAGE_ADDR_MASK;
+   if (level - 1 == 1)
+      flags = (flags & ~PAGE_HUGE) | ((*entry & PAGE_PAT_HUGE) ? PAGE_PAT : 0);
+   else
+      flags |= *entry & PAGE_PAT_HUGE;
+
+   for (int i = 0; i < 512; i++)
+      table->entries[i] = (base + i * child_size) | flags;
+
+   *entry = VIRT_TO_PHYS(table) | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+   return table;
+}
+
+// 4KB entries take PAT in bit 7, huge ones in bit 12 as bit 7 marks them huge
+static inline uint64_t leaf_bits(uint64_t flags, int level)
+{
+   if (level == 1)
+      return flags;
+   return (flags & ~PAGE_PAT) | ((flags & PAGE_PAT) ? PAGE_PAT_HUGE : 0) | PAGE_HUGE;
+}
+
+// Entry bits selecting a MEM_* type, in 4KB form
+static uint64_t memtype_bits(int mem_type)
+{
+   // Power-on PAT: PWT alone is WT and there's no WC, UC- is closest
+   if (!pat_enabled)
+      mem_type = mem_type == MEM_WT ? 1 : mem_type == MEM_WC ? MEM_UC_MINUS : mem_type & 3;
+
+   return ((mem_type & 1) ? PAGE_WRITETHROUGH : 0) | ((mem_type & 2) ? PAGE_CACHE_DISABLE : 0) |
+          ((mem_type & 4) ? PAGE_PAT : 0);
+}
+
+// Walks [virt, last] in 'table' applying 'op', using the largest leaf
+// that alignment allows on map and splitting huge leaves that are
+// only partly covered on unmap/protect
+static bool walk_range(page_tb_t* table, int level, uint64_t virt, uint64_t last, uint64_t phys,
+                       uint64_t flags, int op, tlb_batch_t* batch)
+{
+   uint64_t size = level_size(level);
+   while (true)
+   {
+      uint64_t* entry = level_entry(table, level, virt);
+      uint64_t stop = virt | (size - 1);
+      if (stop > last)
+         stop = last;
+      bool whole = !(virt & (size - 1)) && stop - virt == size - 1;
+      bool leaf = level == 1 || (*entry & PAGE_HUGE);
+
+      if (op == VMM_OP_MAP)
+      {
+         bool table_below = (*entry & PAGE_PRESENT) && !leaf;
+         if (level == 1 || (can_be_leaf(level) && whole && !(phys & (size - 1)) && !table_below))
+         {
+            if (*entry & PAGE_PRESENT)
+               tlb_batch_add(batch, virt);
+            *entry = phys | leaf_bits(flags, level) | PAGE_PRESENT;
+         }
+         else
+         {
+            page_tb_t* next_table;
+            if (!(*entry & PAGE_PRESENT))
+            {
+               next_table = alloc_table();
+               if (!next_table)
+                  return false;
+               *entry = VIRT_TO_PHYS(next_table) | PAGE_PRESENT | PAGE_WRITE;
+               if (level == 4 && virt >= KERNEL_HALF_BASE)
+                  batch->new_kernel_top = true;
+            }
+            else if (leaf)
+            {
+               next_table = split_huge(entry, level);
+               if (!next_table)
+                  return false;
+               tlb_batch_add(batch, virt);
+            }
+            else
+               next_table = table_at(*entry);
+
+            // Access rights are the AND of every level, keep upper levels open
+            *entry |= flags & PAGE_USER;
+            if (!walk_range(next_table, level - 1, virt, stop, phys, flags, op, batch))
+               return false;
+         }
+      }
+      else if (*entry & PAGE_PRESENT)
+      {
+         if (leaf && !whole)
+         {
+            if (!split_huge(entry, level))
+               return false;
+            tlb_batch_add(batch, virt);
+            leaf = false;
+         }
+
+         if (!leaf)
+         {
+            if (!walk_range(table_at(*entry), level - 1, virt, stop, phys, flags, op, batch))
+               return false;
+         }
+         else
+         {
+            if (op == VMM_OP_UNMAP)
+               *entry = 0;
+            else
+            {
+               // Keeps the memory type. Bit 7 is PAT or the huge bit, kept either
+               // way, and a huge entry's PAT bit sits inside the address bits
+               uint64_t keep = PAGE_ADDR_MASK | PAGE_WRITETHROUGH | PAGE_CACHE_DISABLE | PAGE_PAT;
+               *entry = (*entry & keep) | flags | PAGE_PRESENT;
+            }
+            tlb_batch_add(batch, virt);
+         }
+      }
+
+      if (stop == last)
+         return true;
+      phys += stop - virt + 1;
+      virt = stop + 1;
+   }
+}
+
+// Every space shares the kernel half PML4 entries, a new one made in
+// any of them is copied into the rest
+static void sync_kernel_half(addr_space_t* from)
+{
+   uint64_t flags = irq_save();
+   spin_lock(&space_list_lock);
+   for (addr_space_t* space = &kernel_space; space; space = space->next)
+   {
+      if (space == from)
+         continue;
+      for (int i = PML4_INDEX(KERNEL_HALF_BASE); i < 512; i++)
+      {
+         if (!(space->pml4->entries[i] & PAGE_PRESENT))
+            space->pml4->entries[i] = from->pml4->entries[i];
+      }
+   }
+   spin_unlock(&space_list_lock);
+   irq_restore(flags);
+}
+
+static bool vmm_apply(addr_space_t* space, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags,
+                      int mem_type, int op)
+{
+   if (!size)
+      return true;
+
+   tlb_batch_t batch = { .count = 0 };
+   uint64_t start = virt & ~(PAGE_SIZE_4K - 1);
+   uint64_t last = (virt + size - 1) | (PAGE_SIZE_4K - 1);   // Inclusive, the top page must not wrap
+   flags &= ~(PAGE_ADDR_MASK | PAGE_PRESENT | PAGE_HUGE | PAGE_WRITETHROUGH | PAGE_CACHE_DISABLE);
+   if (op == VMM_OP_MAP)
+      flags |= memtype_bits(mem_type);
+
+   bool ok = walk_range(space->pml4, 4, start, last, phys & ~(PAGE_SIZE_4K - 1), flags, op, &batch);
+   if (batch.new_kernel_top)
+      sync_kernel_half(space);
+   tlb_batch_flush(&batch, space);
+   return ok;
+}
+
+/**
+ * Map a physical range, picking 1GB/2MB/4KB pages by alignment
+ * @space: Address space to change
+ * @virt: Start of the virtual range
+ * @phys: Start of the physical range
+ * @size: Bytes to map, rounded up to 4KB
+ * @flags: PAGE_WRITE, PAGE_USER, PAGE_NX, PAGE_GLOBAL, ...
+ * @mem_type: MEM_WB for RAM, MEM_WC/MEM_UC/... for device memory
+ * @return: false if a page table could not be allocated
+ */
+bool vmm_map(addr_space_t* space, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags, int mem_type)
+{
+   return vmm_apply(space, virt, phys, size, flags, mem_type, VMM_OP_MAP);
+}
+
+/**
+ * Unmap a virtual range, splitting huge pages it only partly covers
+ * @space: Address space to change
+ * @virt: Start of the virtual range
+ * @size: Bytes to unmap, rounded up to 4KB
+ * @return: false if a split could not allocate a page table
+ */
+bool vmm_unmap(addr_space_t* space, uint64_t virt, uint64_t size)
+{
+   return vmm_apply(space, virt, 0, size, 0, MEM_WB, VMM_OP_UNMAP);
+}
+
+/**
+ * Change the flags of the mapped pages in a range, keeping their memory type
+ * @space: Address space to change
+ * @virt: Start of the virtual range
+ * @size: Bytes to change, rounded up to 4KB
+ * @flags: New flags, replacing the old ones
+ * @return: false if a split could not allocate a page table
+ */
+bool vmm_protect(addr_space_t* space, uint64_t virt, uint64_t size, uint64_t flags)
+{
+   return vmm_apply(space, virt, 0, size, flags, MEM_WB, VMM_OP_PROTECT);
+}
+
+static bool walk_leaves(page_tb_t* table, int level, uint64_t virt, uint64_t last, vmm_walk_fn fn, void* ctx)
+{
+   uint64_t size = level_size(level);
+   while (true)
+   {
+      uint64_t* entry = level_entry(table, level, virt);
+      uint64_t stop = virt | (size - 1);
+      if (stop > last)
+         stop = last;
+
+      if (*entry & PAGE_PRESENT)
+      {
+         if (level == 1 || (*entry & PAGE_HUGE))
+         {
+            if (!fn(virt & ~(size - 1), entry, level, ctx))
+               return false;
+         }
+         else if (!walk_leaves(table_at(*entry), level - 1, virt, stop, fn, ctx))
+            return false;
+      }
+
+      if (stop == last)
+         return true;
+      virt = stop + 1;
+   }
+}
+
+/**
+ * Call fn on every leaf entry mapping part of a range, skipping holes
+ * at whatever level they are found. fn may edit the entry, the caller
+ * flushes with vmm_flush afterwards
+ * @space: Address space to walk
+ * @virt: Start of the range
+ * @size: Bytes, rounded up to 4KB
+ * @fn: Gets the leaf's start address, entry and level, false stops the walk
+ * @ctx: Passed to fn
+ * @return: false if fn stopped the walk
+ */
+bool vmm_walk(addr_space_t* space, uint64_t virt, uint64_t size, vmm_walk_fn fn, void* ctx)
+{
+   if (!size)
+      return true;
+   uint64_t start = virt & ~(PAGE_SIZE_4K - 1);
+   uint64_t last = (virt + size - 1) | (PAGE_SIZE_4K - 1);
+   return walk_leaves(space->pml4, 4, start, last, fn, ctx);
+}
+
+// Drops cached translations for a range after entries were edited in place
+void vmm_flush(addr_space_t* space, uint64_t virt, uint64_t size)
+{
+   tlb_batch_t batch = { .count = 0 };
+   uint64_t pages = (size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+   if (pages > TLB_BATCH_MAX)
+   {
+      batch.count = pages > 0xFFFFFFFF ? 0xFFFFFFFF : pages;
+      batch.kernel_half = virt + size > KERNEL_HALF_BASE;
+   }
+   else
+   {
+      for (uint64_t i = 0; i < pages; i++)
+         tlb_batch_add(&batch, virt + i * PAGE_SIZE_4K);
+   }
+   tlb_batch_flush(&batch, space);
+}
+
+/**
+ * Look up the physical address behind a virtual one
+ * @space: Address space to change
+ * @virt: Virtual address
+ * @phys: Receives the physical address
+ * @return: false if it is not mapped
+ */
+bool vmm_translate(addr_space_t* space, uint64_t virt, uint64_t* phys)
+{
+   page_tb_t* table = space->pml4;
+   for (int level = 4; level >= 1; level--)
+   {
+      uint64_t entry = *level_entry(table, level, virt);
+      if (!(entry & PAGE_PRESENT))
+         return false;
+      if (level == 1 || (entry & PAGE_HUGE))
+      {
+         uint64_t size = level_size(level);
+         *phys = (entry & PAGE_ADDR_MASK & ~(size - 1)) | (virt & (size - 1));
+         return true;
+      }
+      table = table_at(entry);
+   }
+   return false;
+}
+
+// PAGE_NX is a reserved bit unless the bootloader turned on EFER.NXE
+uint64_t page_nx()
+{
+   return (rdmsr(MSR_EFER) & EFER_NXE) ? PAGE_NX : 0;
+}
+
+// Frees the page tables under a lower half entry, not the pages they map
+static void free_tables(uint64_t entry, int level)
+{
+   if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE))
+      return;
+   page_tb_t* table = table_at(entry);
+   if (level > 2)
+   {
+      for (int i = 0; i < 512; i++)
+         free_tables(table->entries[i], level - 1);
+   }
+   free_frame(VIRT_TO_PHYS(table));
+}
+
+/**
+ * Create an address space with an empty lower half
+ * @return: The space, NULL when out of memory
+ */
+addr_space_t* create_address_space()
+{
+   addr_space_t* space = kzalloc(sizeof(addr_space_t));
+   if (!space)
+      return NULL;
+   space->pml4 = alloc_table();
+   if (!space->pml4)
+   {
+      kfree(space);
+      return NULL;
+   }
+
+   uint64_t flags = irq_save();
+   spin_lock(&space_list_lock);
+   for (int i = PML4_INDEX(KERNEL_HALF_BASE); i < 512; i++)
+      space->pml4->entries[i] = kernel_space.pml4->entries[i];
+   space->next = kernel_space.next;
+   kernel_space.next = space;
+   spin_unlock(&space_list_lock);
+   irq_restore(flags);
+   return space;
+}
+
+/**
+ * Tear down an address space that no CPU is running on
+ * @space: From create_address_space, the pages it maps stay allocated
+ */
+void destroy_address_space(addr_space_t* space)
+{
+   uint64_t flags = irq_save();
+   spin_lock(&space_list_lock);
+   addr_space_t* prev = &kernel_space;
+   while (prev->next && prev->next != space)
+      prev = prev->next;
+   if (prev->next)
+      prev->next = space->next;
+   spin_unlock(&space_list_lock);
+   irq_restore(flags);
+
+   // Its PCIDs are never handed out again in this generation, so the
+   // stale entries under them can't be hit
+   for (uint64_t i = 0; i < PML4_INDEX(KERNEL_HALF_BASE); i++)
+      free_tables(space->pml4->entries[i], 4);
+   free_frame(VIRT_TO_PHYS(space->pml4));
+   kfree(space);
+}
+
+static void load_space(addr_space_t* space, bool keep_tlb)
+{
+   uint32_t cpu = cpu_id();
+   uint64_t cr3 = VIRT_TO_PHYS(space->pml4);
+
+   if (pcid_enabled)
+   {
+      if (!asid_valid(space, cpu))
+      {
+         space->asid[cpu] = asid_alloc(cpu);
+         keep_tlb = false;
+      }
+      cr3 |= space->asid[cpu] & PCID_MASK;
+      if (keep_tlb)
+         cr3 |= CR3_NOFLUSH;
+   }
+
+   active_space[cpu] = space;
    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
-}
\ No newline at end of file
+}
+
+/**
+ * Run on another address space. With PCIDs its cached translations
+ * survive the switch when its tag is still current
+ * @space: Space to switch to
+ */
+void switch_address_space(addr_space_t* space)
+{
+   uint64_t flags = irq_save();
+   if (active_space[cpu_id()] != space)
+      load_space(space, true);
+   irq_restore(flags);
+}
+
+addr_space_t* current_space()
+{
+   return active_space[cpu_id()];
+}
+
+// Switch and drop the space's cached translations, what every switch
+// costs without PCIDs
+void switch_address_space_flush(addr_space_t* space)
+{
+   uint64_t flags = irq_save();
+   load_space(space, false);
+   irq_restore(flags);
+}
+
+bool pcid_active()
+{
+   return pcid_enabled;
+}
+
+// Needs the physmap and the frame allocator for new page tables
+void init_paging()
+{
+   uint32_t cpu = cpu_id();
+   huge_1g = cpu_has_ext_feature(CPU_FEATURE_PDPE1GB);
+
+   uint64_t cr4;
+   __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+   pcid_enabled = (cr4 & CR4_PCIDE) != 0;
+   invpcid_supported = pcid_enabled && cpu_has_leaf7_feature(CPU_FEATURE_INVPCID);
+
+   // The boot tables become the kernel space, already running as PCID 0
+   kernel_space.pml4 = current_pml4();
+   asid_generation[cpu] = 1;
+   asid_next[cpu] = 1;
+   kernel_space.asid[cpu] = asid_generation[cpu] << PCID_BITS;
+   active_space[cpu] = &kernel_space;
+
+   pat_enabled = rdmsr(MSR_PAT) == PAT_LAYOUT;
+
+   uint64_t flags = PAGE_WRITE | PAGE_GLOBAL | page_nx();
+   vmm_map(&kernel_space, APIC_VIRT_BASE, APIC_PHYS_BASE, PAGE_SIZE_4K, flags, MEM_UC);
+
+   // Console writes get combined into bursts instead of one bus cycle each.
+   // This replaces the kernel window's WB entries for the text buffer, and
+   // the bootloader's identity map loses them too, a second mapping with
+   // another memory type isn't supported
+   vmm_unmap(&kernel_space, VGA_PHYS_BASE, VGA_WINDOW_SIZE);
+   vmm_map(&kernel_space, VGA_VIRT_BASE, VGA_PHYS_BASE, VGA_WINDOW_SIZE, flags, MEM_WC);
+}
+
+page_tb_t* current_pml4()
+{
+   uint64_t cr3 = read_cr3();
+
+   // Before the physmap exists the bootloader tables are only
+   // reachable through the kernel window (first 1GB)
+   if (!physmap_bytes)
+      return (page_tb_t*)((cr3 & PAGE_ADDR_MASK) + KERNEL_OFFSET_HIGH);
+   return PHYS_TO_VIRT(cr3 & PAGE_ADDR_MASK);
+}
+
+// Whether the physmap covers phys: RAM and ACPI memory from the E820
+// map, and below 1MB everything but the legacy video window, so the BDA,
+// EBDA and BIOS stay readable. Device memory is left out, its driver's
+// mapping is then the only one and no two mappings disagree on the
+// memory type. *run_end is where the answer next changes
+static bool physmap_wanted(uint64_t phys, uint64_t* run_end)
+{
+   uint64_t end = phys;
+   bool grew = true;
+   while (grew)
+   {
+      grew = false;
+      for (uint32_t i = 0; i < physmap_range_count; i++)
+      {
+         if (physmap_ranges[i].start <= end && end < physmap_ranges[i].end)
+         {
+            end = physmap_ranges[i].end;
+            grew = true;
+         }
+      }
+   }
+   if (end > phys)
+   {
+      *run_end = end;
+      return true;
+   }
+
+   *run_end = ~0ULL;
+   for (uint32_t i = 0; i < physmap_range_count; i++)
+   {
+      if (physmap_ranges[i].start > phys && physmap_ranges[i].start < *run_end)
+         *run_end = physmap_ranges[i].start;
+   }
+   return false;
+}
+
+static void physmap_add(uint64_t start, uint64_t end)
+{
+   if (start < end && physmap_range_count < PHYSMAP_RANGES)
+   {
+      physmap_ranges[physmap_range_count].start = start;
+      physmap_ranges[physmap_range_count].end = end;
+      physmap_range_count++;
+   }
+}
+
+// Tables below the PDP come from static pools, the PMM needs the physmap
+// before it can hand out frames
+static page_tb_t* physmap_table(int level)
+{
+   if (level == 2 && physmap_pd_count < PHYSMAP_MAX_PDS)
+      return &physmap_pds[physmap_pd_count++];
+   if (level == 1 && physmap_pt_count < PHYSMAP_MAX_PTS)
+      return &physmap_pts[physmap_pt_count++];
+   return NULL;
+}
+
+// Fills 'table' for [base, end) with the largest leaves that only cover
+// wanted memory. A 4KB page is mapped if any of it is wanted. Returns how
+// far it got, short of end once a pool runs dry
+static uint64_t physmap_fill(page_tb_t* table, int level, uint64_t base, uint64_t end)
+{
+   uint64_t size = level_size(level);
+   uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL | page_nx();
+   for (uint64_t phys = base; phys < end; phys += size)
+   {
+      uint64_t run_end;
+      bool wanted = physmap_wanted(phys, &run_end);
+      uint64_t* entry = level_entry(table, level, PHYSMAP_BASE + phys);
+      if (level == 1)
+      {
+         if (wanted || run_end < phys + size)
+            *entry = phys | flags;
+         continue;
+      }
+      if (run_end >= phys + size && !wanted)
+         continue;
+      if (run_end >= phys + size && can_be_leaf(level))
+      {
+         *entry = phys | flags | PAGE_HUGE;
+         continue;
+      }
+
+      page_tb_t* next = physmap_table(level - 1);
+      if (!next)
+         return phys;
+      *entry = KERNEL_TO_PHYS(next) | PAGE_PRESENT | PAGE_WRITE;
+      uint64_t reached = physmap_fill(next, level - 1, phys, phys + size);
+      if (reached < phys + size)
+         return reached;
+   }
+   return end;
+}
+
+// Maps RAM at PHYSMAP_BASE with global 1GB pages, or 2MB pages when the
+// CPU has no PDPE1GB, and 4KB pages around the holes
+void init_physmap(const struct boot_info* boot_info)
+{
+   page_tb_t* pml4 = current_pml4();
+   huge_1g = cpu_has_ext_feature(CPU_FEATURE_PDPE1GB);
+
+   physmap_add(0, LEGACY_VIDEO_START);
+   physmap_add(LEGACY_VIDEO_END, LOW_MEMORY_END);
+   uint64_t phys_end = LOW_MEMORY_END;
+   for (uint32_t i = 0; i < boot_info->mmap_count; i++)
+   {
+      const struct e820_entry* entry = &boot_info->mmap[i];
+      if (entry->type != E820_USABLE && entry->type != E820_ACPI_RECLAIMABLE &&
+          entry->type != E820_ACPI_NVS)
+         continue;
+      physmap_add(entry->base, entry->base + entry->length);
+      if (entry->base + entry->length > phys_end)
+         phys_end = entry->base + entry->length;
+   }
+
+   uint64_t gigs = (phys_end + PAGE_SIZE_1G - 1) / PAGE_SIZE_1G;
+   if (gigs > 512)
+      gigs = 512;
+   uint64_t reached = physmap_fill(&physmap_pdp, 3, 0, gigs * PAGE_SIZE_1G);
+   physmap_bytes = reached < phys_end ? reached : phys_end;
+
+   pml4->entries[PML4_INDEX(PHYSMAP_BASE)] = KERNEL_TO_PHYS(&physmap_pdp) | PAGE_PRESENT | PAGE_WRITE;
+}
+
+/**
+ * Whether a physical range can be reached through PHYS_TO_VIRT
+ * @phys: Start of the range
+ * @size: Bytes
+ * @return: false if any of it is past the physmap or in a hole of it
+ */
+bool physmap_covers(uint64_t phys, uint64_t size)
+{
+   uint64_t run_end;
+   return phys + size <= physmap_bytes && physmap_wanted(phys, &run_end) && run_end >= phys + size;
+}
+
+uint64_t physmap_size()
+{
+   return physmap_bytes;
+}
@@ -0,0 +1,339 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../serial.h"
+#include "../port.h"
+#include "../../libk/io.h"
+#include "../../libk/string.h"
+#include "../../libk/spinlock.h"
+#include "../../kernel/components/interrupt_handler.h"
+
+#define TX_MASK (SERIAL_TX_RING - 1)
+#define RX_MASK (SERIAL_RX_RING - 1)
+
+// Writers fill tx under tx_lock, the IRQ handler alone empties it, so
+// head and tail each have a single owner. The handler and every writer
+// touch ier with interrupts off on the BSP, which is what routes the PIC
+typedef struct
+{
+    const char* name;
+    uint16_t base;
+    uint8_t irq;
+    bool present;
+    bool polled;                     // No IRQ yet, writers drain tx themselves
+    bool panic;                      // Crash path, ignore tx_lock
+    uint8_t fifo;                    // Bytes per THRE, 1 without a 16550A
+    uint8_t ier;
+    spinlock_t tx_lock;
+    volatile uint32_t tx_head;
+    volatile uint32_t tx_tail;
+    volatile uint32_t rx_head;
+    volatile uint32_t rx_tail;
+    volatile uint64_t rx_dropped;    // Ring full or FIFO overrun
+    char tx[SERIAL_TX_RING];
+    char rx[SERIAL_RX_RING];
+} serial_port_t;
+
+static serial_port_t ports[SERIAL_PORTS] = {
+    { .name = "COM1", .base = COM1_PORT, .irq = COM1_IRQ, .polled = true },
+    { .name = "COM2", .base = COM2_PORT, .irq = COM2_IRQ, .polled = true },
+};
+
+static bool serial_irq(uint8_t vector, void* data);
+
+static void serial_sink_write(format_sink_t* sink, const char* data, size_t len)
+{
+    (void)sink;
+    serial_write_span(data, len);
+}
+
+static format_sink_t serial_sink = { serial_sink_write };
+
+/**
+ * Program a UART and check that one answers at its address
+ * @param index: SERIAL_COM1 or SERIAL_COM2
+ * @param baud: Line rate, UART_CLOCK over a 16-bit divisor
+ * @return: false if the rate can't be set or nothing is there
+ */
+bool serial_open(int index, uint32_t baud)
+{
+    serial_port_t* port = &ports[index];
+    uint16_t base = port->base;
+    if (!baud || baud > UART_CLOCK || UART_CLOCK / baud > 0xFFFF)
+        return false;
+    uint16_t divisor = UART_CLOCK / baud;
+
+    outb(base + UART_IER, 0x00);
+    outb(base + UART_LCR, 0x80);    // DLAB on
+    outb(base + UART_DLL, divisor & 0xFF);
+    outb(base + UART_DLH, divisor >> 8);
+    outb(base + UART_LCR, 0x03);    // 8N1, DLAB off
+    outb(base + UART_FCR, 0xC7);    // Enable and clear FIFOs, 14-byte threshold
+
+    // A missing port reads back 0xFF, a present one echoes in loopback
+    outb(base + UART_MCR, UART_MCR_LOOP);
+    outb(base + UART_DATA, 0xAE);
+    if (inb(base + UART_DATA) != 0xAE)
+    {
+        port->present = false;
+        return false;
+    }
+
+    port->fifo = (inb(base + UART_IIR) & UART_IIR_FIFO) == UART_IIR_FIFO ? UART_FIFO_SIZE : 1;
+    port->ier = 0;
+    outb(base + UART_MCR, UART_MCR_RUN);
+    port->present = true;
+    return true;
+}
+
+/**
+ * Bring up COM1 and COM2 at full rate. Output is polled until
+ * init_serial_irq, so this can run before the IDT exists
+ */
+void init_serial()
+{
+    serial_open(SERIAL_COM1, UART_CLOCK);
+    serial_open(SERIAL_COM2, UART_CLOCK);
+    console_register(CONSOLE_SERIAL, &serial_sink);
+}
+
+/**
+ * Send printf to serial as well, for when there is no screen to show it.
+ * A screen console registering later takes CONSOLE_VGA back
+ */
+void serial_take_console()
+{
+    console_register(CONSOLE_VGA, &serial_sink);
+}
+
+/**
+ * Switch the ports over to interrupts, once the PIC is remapped. A
+ * port whose line can't be had stays polled. Receive interrupts stay
+ * on, transmit ones only while tx has data
+ */
+void init_serial_irq()
+{
+    for (int i = 0; i < SERIAL_PORTS; i++)
+    {
+        serial_port_t* port = &ports[i];
+        if (!port->present)
+            continue;
+        // COM3 and COM4 share these lines on real boards
+        if (!request_irq(IRQ_VECTOR(port->irq), serial_irq, port, port->name, IRQF_SHARED))
+            continue;
+        uint64_t flags = irq_save();
+        port->ier = UART_IER_RDI | UART_IER_RLSI;
+        outb(port->base + UART_IER, port->ier);
+        port->polled = false;
+        irq_restore(flags);
+    }
+}
+
+/**
+ * Queue bytes on tx, \n becoming \r\n, as far as there is room
+ * @return: Bytes of data consumed
+ */
+static size_t tx_fill(serial_port_t* port, const char* data, size_t len)
+{
+    uint32_t head = port->tx_head;
+    uint32_t tail = __atomic_load_n(&port->tx_tail, __ATOMIC_ACQUIRE);
+    size_t i = 0;
+    while (i < len)
+    {
+        uint32_t room = SERIAL_TX_RING - (head - tail);
+        if (data[i] == '\n')
+        {
+            if (room < 2)
+                break;
+            port->tx[head++ & TX_MASK] = '\r';
+        }
+        else if (!room)
+            break;
+        port->tx[head++ & TX_MASK] = data[i++];
+    }
+    __atomic_store_n(&port->tx_head, head, __ATOMIC_RELEASE);
+    return i;
+}
+
+// Hand the transmit FIFO as much of tx as it holds, the caller saw THRE
+static void tx_push(serial_port_t* port)
+{
+    uint32_t tail = port->tx_tail;
+    uint32_t head = __atomic_load_n(&port->tx_head, __ATOMIC_ACQUIRE);
+    for (int slot = 0; slot < port->fifo && tail != head; slot++)
+        outb(port->base + UART_DATA, port->tx[tail++ & TX_MASK]);
+    __atomic_store_n(&port->tx_tail, tail, __ATOMIC_RELEASE);
+}
+
+// Empty tx by polling, for when the IRQ handler can't run
+static void tx_drain_polled(serial_port_t* port)
+{
+    while (port->tx_tail != __atomic_load_n(&port->tx_head, __ATOMIC_ACQUIRE))
+    {
+        while (!(inb(port->base + UART_LSR) & UART_LSR_THRE))
+            __asm__ volatile("pause");
+        tx_push(port);
+    }
+}
+
+static void rx_drain(serial_port_t* port)
+{
+    uint32_t head = port->rx_head;
+    uint32_t tail = __atomic_load_n(&port->rx_tail, __ATOMIC_ACQUIRE);
+    uint8_t lsr;
+    while ((lsr = inb(port->base + UART_LSR)) & UART_LSR_DR)
+    {
+        char c = inb(port->base + UART_DATA);
+        if (lsr & UART_LSR_OE)
+            port->rx_dropped++;
+        if (head - tail == SERIAL_RX_RING)
+            port->rx_dropped++;
+        else
+            port->rx[head++ & RX_MASK] = c;
+    }
+    __atomic_store_n(&port->rx_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Service every condition the UART has pending, from irq3/irq4
+ * @param vector: Vector of the port's line
+ * @param data: The port
+ * @return: false if the UART had nothing pending, the line is shared
+ */
+static bool serial_irq(uint8_t vector, void* data)
+{
+    (void)vector;
+    serial_port_t* port = data;
+    if (!port->present || port->panic)
+        return false;
+
+    bool handled = false;
+    uint8_t iir;
+    while (!((iir = inb(port->base + UART_IIR)) & UART_IIR_NO_INT))
+    {
+        handled = true;
+        switch (iir & UART_IIR_ID_MASK)
+        {
+            case UART_IIR_THRI:
+                tx_push(port);
+                // Nothing left, stop the interrupt until a writer queues more
+                if (port->tx_tail == __atomic_load_n(&port->tx_head, __ATOMIC_ACQUIRE))
+                {
+                    port->ier &= ~UART_IER_THRI;
+                    outb(port->base + UART_IER, port->ier);
+                }
+                break;
+            case UART_IIR_RLSI:
+            case UART_IIR_RDI:
+            case UART_IIR_TIMEOUT:
+                rx_drain(port);
+                break;
+            default:
+                inb(port->base + UART_MSR);
+                break;
+        }
+    }
+    return handled;
+}
+
+/**
+ * Queue bytes for a port. Writers only wait for room in tx, never on
+ * the line status, except before interrupts are up or with them off,
+ * where the bytes are pushed out before returning
+ * @param index: SERIAL_COM1 or SERIAL_COM2
+ * @param data: Bytes to send, \n goes out as \r\n
+ * @param len: Number of bytes
+ * @return: len, 0 if the port isn't there
+ */
+size_t serial_port_write(int index, const char* data, size_t len)
+{
+    serial_port_t* port = &ports[index];
+    if (!port->present)
+        return 0;
+
+    size_t done = 0;
+    if (port->panic)
+    {
+        // Whatever held tx_lock was interrupted and won't finish
+        while (done < len)
+        {
+            done += tx_fill(port, data + done, len - done);
+            tx_drain_polled(port);
+        }
+        return len;
+    }
+
+    while (done < len)
+    {
+        uint64_t flags = irq_save();
+        spin_lock(&port->tx_lock);
+        done += tx_fill(port, data + done, len - done);
+        if (port->polled || !(flags & RFLAGS_IF))
+            tx_drain_polled(port);
+        else if (!(port->ier & UART_IER_THRI))
+        {
+            // An empty THR raises the interrupt as soon as it is enabled
+            port->ier |= UART_IER_THRI;
+            outb(port->base + UART_IER, port->ier);
+        }
+        spin_unlock(&port->tx_lock);
+        irq_restore(flags);
+
+        if (done < len)
+            __asm__ volatile("pause");
+    }
+    return len;
+}
+
+/**
+ * Take received bytes without waiting
+ * @param index: SERIAL_COM1 or SERIAL_COM2
+ * @param buf: Destination
+ * @param len: Most bytes to take
+ * @return: Bytes copied, 0 if nothing has arrived
+ */
+size_t serial_read(int index, char* buf, size_t len)
+{
+    serial_port_t* port = &ports[index];
+    uint32_t tail = port->rx_tail;
+    uint32_t head = __atomic_load_n(&port->rx_head, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (n < len && tail != head)
+        buf[n++] = port->rx[tail++ & RX_MASK];
+    __atomic_store_n(&port->rx_tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * Drop to polled output for good, from a fault handler that won't
+ * return. Queued bytes go out first so the crash report follows them
+ */
+void serial_panic()
+{
+    for (int i = 0; i < SERIAL_PORTS; i++)
+    {
+        serial_port_t* port = &ports[i];
+        if (!port->present)
+            continue;
+        port->panic = true;
+        port->ier = 0;
+        outb(port->base + UART_IER, 0);
+        tx_drain_polled(port);
+    }
+}
+
+void serial_putc(char c)
+{
+    serial_port_write(SERIAL_COM1, &c, 1);
+}
+
+void serial_write(const char* str)
+{
+    serial_port_write(SERIAL_COM1, str, strlen(str));
+}
+
+void serial_write_span(const char* data, size_t len)
+{
+    serial_port_write(SERIAL_COM1, data, len);
+}
@@ -4,23 +4,67 @@
 
 #include "../timer.h"
 #include "../init.h"
+#include "../cpu.h"
+#include "../port.h"
 #include "../../libk/io.h"
+#include "../../kernel/components/interrupt_handler.h"
 
 static volatile uint64_t timer_ticks = 0;
+static uint64_t tsc_khz = 0;
+
+static bool timer_irq(uint8_t vector, void* data)
+{
+    (void)vector;
+    (void)data;
+    timer_ticks++;
+    return true;
+}
 
 void init_timer(uint32_t frequency)
 {
+    request_irq(TIMER_VECTOR, timer_irq, NULL, "timer", 0);
     apic_write(APIC_TIMER_DIV, 0x3);
     apic_write(APIC_TIMER_INIT, 0x100000);
-    apic_write(APIC_LVT_TIMER, (1 << 17) | 32);
+    apic_write(APIC_LVT_TIMER, (1 << 17) | TIMER_VECTOR);
 }
 
-void timer_tick()
+uint64_t get_ticks()
 {
-    apic_write(APIC_EOI, 0);
+    return timer_ticks;
 }
 
-uint64_t get_ticks()
+uint64_t calibrate_tsc()
 {
-    return timer_ticks;
-}
\ No newline at end of file
+    uint32_t max_leaf, ebx, ecx, edx;
+    cpuid(CPUID_VENDOR_ID, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf >= CPUID_TSC_CRYSTAL)
+    {
+        // Only exact when the crystal is listed, many parts leave ECX 0.
+        // Leaf 0x16 is the base frequency, which need not be the TSC's
+        uint32_t denominator, numerator, crystal_hz;
+        cpuid(CPUID_TSC_CRYSTAL, &denominator, &numerator, &crystal_hz, &edx);
+        if (denominator && numerator && crystal_hz)
+            return tsc_khz = (uint64_t)crystal_hz * numerator / denominator / 1000;
+    }
+
+    // Count TSC cycles across 10ms of PIT channel 2 (one-shot, mode 0)
+    uint16_t count = PIT_FREQUENCY / 100;
+    uint8_t gate = inb(PIT_GATE) & ~0x03;       // Speaker off, gate low
+    outb(PIT_GATE, gate);
+    outb(PIT_COMMAND, 0xB0);                    // Channel 2, lo/hi byte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+    outb(PIT_GATE, gate | 0x01);                // Gate high starts the count
+
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE) & 0x20));            // OUT2 goes high at terminal count
+    uint64_t end = rdtsc();
+
+    outb(PIT_GATE, gate);
+    return tsc_khz = (end - start) / 10;
+}
+
+uint64_t get_tsc_khz()
+{
+    return tsc_khz;
+}
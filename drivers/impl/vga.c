@@ -0,0 +1,250 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../vga.h"
+#include "../port.h"
+#include "../paging.h"
+#include "../../libk/io.h"
+#include "../../libk/memory.h"
+
+#define HISTORY_MASK (VGA_HISTORY - 1)
+#define ROW_BYTES (VGA_WIDTH * sizeof(uint16_t))
+
+// Text is rendered into history, a ring of rows in normal RAM, and
+// line counts rows from boot so line & HISTORY_MASK is its slot. A
+// newline only clears the next slot, nothing is moved. vga_flush copies
+// the rows that changed into the text window and scrolls by moving the
+// CRTC start address down it, copying the screen back to the top only
+// when the window runs out
+static uint16_t history[VGA_HISTORY][VGA_WIDTH];
+static uint64_t line = 0;               // Row the cursor is on
+static size_t col = 0;
+static uint8_t color = VGA_COLOR(VGA_WHITE, VGA_BLACK);
+static uint64_t view = 0;               // Rows scrolled back from the bottom
+
+// Rows from dirty_from down to line changed since the last flush, a
+// cursor only ever writes its own row or opens new ones below it
+static bool dirty = false;
+static uint64_t dirty_from = 0;
+static bool redraw = true;
+
+static uint16_t* const vram = (uint16_t*)VGA_VIRT_BASE;
+static uint64_t shown_top = 0;          // Row at the CRTC start address
+static uint32_t window_row = 0;         // Where that row sits in the window
+
+static void vga_format_sink(format_sink_t* sink, const char* data, size_t len)
+{
+    (void)sink;
+    vga_write(data, len);
+}
+
+static format_sink_t vga_sink = { vga_format_sink };
+
+static inline uint16_t* row_at(uint64_t row)
+{
+    return history[row & HISTORY_MASK];
+}
+
+static inline void touch()
+{
+    if (!dirty)
+    {
+        dirty = true;
+        dirty_from = line;
+    }
+}
+
+static void clear_row(uint64_t row)
+{
+    uint16_t* cells = row_at(row);
+    for (size_t x = 0; x < VGA_WIDTH; x++)
+        cells[x] = VGA_ENTRY(' ', color);
+}
+
+static void crtc_write(uint8_t reg, uint16_t value)
+{
+    outb(VGA_CRTC_INDEX, reg);
+    outb(VGA_CRTC_DATA, value >> 8);
+    outb(VGA_CRTC_INDEX, reg + 1);
+    outb(VGA_CRTC_DATA, value & 0xFF);
+}
+
+// Row in screen row 0, the live bottom minus any scrollback
+static uint64_t view_top()
+{
+    uint64_t top = line >= VGA_HEIGHT - 1 ? line - (VGA_HEIGHT - 1) : 0;
+    return top - view;
+}
+
+/**
+ * Clear the screen and take over the console from the BIOS
+ * @param attr: Colour attribute for text and blanks
+ */
+void init_vga(uint8_t attr)
+{
+    color = attr;
+    for (uint64_t row = 0; row < VGA_HISTORY; row++)
+        clear_row(row);
+    line = 0;
+    col = 0;
+    view = 0;
+    window_row = 0;
+    shown_top = 0;
+    redraw = true;
+    crtc_write(VGA_CRTC_START_HIGH, 0);
+    // The BIOS cursor stays put in the window while the text scrolls past it
+    outb(VGA_CRTC_INDEX, VGA_CRTC_CURSOR_START);
+    outb(VGA_CRTC_DATA, VGA_CURSOR_OFF);
+    vga_flush();
+    console_register(CONSOLE_VGA, &vga_sink);
+}
+
+static void newline()
+{
+    col = 0;
+    line++;
+    clear_row(line);
+}
+
+/**
+ * Copy what changed since the last call to the screen. Scrolling costs
+ * a CRTC write plus the rows that came into view, the whole screen is
+ * copied only after a jump, a scrollback or once the window runs out
+ */
+void vga_flush()
+{
+    uint64_t top = view_top();
+    if (!dirty && !redraw && top == shown_top)
+        return;
+
+    // Scrolling forward by less than a screen keeps what is already in
+    // the window, the rows that came into view are all past dirty_from
+    uint64_t first = dirty ? dirty_from : line + 1;
+    uint64_t last = line < top + VGA_HEIGHT - 1 ? line : top + VGA_HEIGHT - 1;
+    bool moved = redraw || top != shown_top;
+    if (moved)
+    {
+        uint64_t delta = top - shown_top;
+        if (!redraw && top > shown_top && delta < VGA_HEIGHT &&
+            window_row + delta + VGA_HEIGHT <= VGA_WINDOW_ROWS)
+            window_row += delta;
+        else
+        {
+            window_row = 0;
+            first = top;
+            last = top + VGA_HEIGHT - 1;
+        }
+    }
+    if (first < top)
+        first = top;
+
+    for (uint64_t row = first; row <= last; row++)
+        memcpy(vram + (window_row + row - top) * VGA_WIDTH, row_at(row), ROW_BYTES);
+
+    // Stores to the write-combined window land before the CRTC moves
+    __asm__ volatile("sfence" ::: "memory");
+    if (moved)
+        crtc_write(VGA_CRTC_START_HIGH, window_row * VGA_WIDTH);
+
+    shown_top = top;
+    dirty = false;
+    redraw = false;
+}
+
+static void vga_control(char c)
+{
+    switch (c)
+    {
+        case '\n':
+            newline();
+            return;
+        case '\r':
+            col = 0;
+            return;
+        case '\t':
+            col = (col + 8) & ~7;
+            break;
+        case '\b':
+            if (col > 0)
+                col--;
+            break;
+        default:
+            row_at(line)[col++] = VGA_ENTRY((uint8_t)c, color);
+            break;
+    }
+
+    if (col >= VGA_WIDTH)
+        newline();
+}
+
+static void vga_render(const char* data, size_t len)
+{
+    if (view)
+    {
+        // New output brings the view back to the bottom
+        view = 0;
+        redraw = true;
+    }
+    touch();
+
+    size_t i = 0;
+    while (i < len)
+    {
+        if ((uint8_t)data[i] < ' ')
+        {
+            vga_control(data[i++]);
+            continue;
+        }
+
+        uint16_t* cell = row_at(line) + col;
+        size_t room = VGA_WIDTH - col;
+        size_t n = 0;
+        while (n < room && i < len && (uint8_t)data[i] >= ' ')
+            cell[n++] = VGA_ENTRY((uint8_t)data[i++], color);
+
+        col += n;
+        if (col >= VGA_WIDTH)
+            newline();
+    }
+}
+
+void vga_putchar(const char c)
+{
+    vga_render(&c, 1);
+    vga_flush();
+}
+
+/**
+ * Write a run of text into the shadow rows, then flush once, so a
+ * burst that scrolls the screen many times only copies the rows that
+ * are still visible at the end
+ * @param data: Text to write
+ * @param len: Number of bytes
+ */
+void vga_write(const char* data, size_t len)
+{
+    vga_render(data, len);
+    vga_flush();
+}
+
+/**
+ * Move the view through the rows kept in history
+ * @param rows: Rows to go back, negative to go forward
+ */
+void vga_scrollback(int rows)
+{
+    uint64_t live = line >= VGA_HEIGHT - 1 ? line - (VGA_HEIGHT - 1) : 0;
+    uint64_t oldest = line >= VGA_HISTORY - 1 ? line - (VGA_HISTORY - 1) : 0;
+    int64_t target = (int64_t)view + rows;
+    if (target < 0)
+        target = 0;
+    if ((uint64_t)target > live - oldest)
+        target = live - oldest;
+    if ((uint64_t)target == view)
+        return;
+
+    view = target;
+    redraw = true;
+    vga_flush();
+}
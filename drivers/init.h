@@ -63,6 +63,7 @@ struct idt_ptr
 void init_gdt();
 void init_idt();
 void init_cpu();
+uint32_t cpu_mem_features();
 void apic_write(uint32_t reg, uint32_t value);
 uint32_t apic_read(uint32_t reg);
 void init_apic();
@@ -0,0 +1,34 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KIOAPIC_H__
+#define __KIOAPIC_H__
+
+#include "../libk/kdef.h"
+
+#define IOAPIC_VIRT_BASE 0xFFFFFFFFFEC00000ULL  // One 4KB page per I/O APIC
+#define IOAPIC_MAX 4
+#define ISA_IRQS 16
+#define ISA_NO_GSI 0xFFFFFFFF            // IRQ with no line, its GSI went to another
+
+#define IOAPIC_REGSEL 0x00              // Register index
+#define IOAPIC_WINDOW 0x10              // Its value
+#define IOAPIC_REG_VER 0x01             // Bits 16-23: last redirection entry
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+
+// Redirection entry, low dword
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+#define IOAPIC_DEST_SHIFT 24            // High dword: physical APIC ID
+
+bool init_ioapic();
+bool ioapic_active();
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t cpu, uint32_t flags);
+void ioapic_mask(uint32_t gsi);
+void ioapic_unmask(uint32_t gsi);
+uint32_t isa_irq_gsi(uint8_t irq);
+bool irq_set_affinity(uint8_t irq, uint32_t cpu);
+
+#endif
@@ -6,25 +6,138 @@
 #define __KPAGING_H__
 
 #include "../libk/kdef.h"
+#include "../libk/spinlock.h"
+#include "cpu.h"
+
+struct boot_info;
 
 #define KERNEL_OFFSET_HIGH 0xFFFFFFFF80000000ULL
 #define APIC_PHYS_BASE 0xFEE00000ULL
 #define APIC_VIRT_BASE 0xFFFFFFFFFEE00000ULL
 
+// Direct map of all physical RAM (PML4 slot 273)
+#define PHYSMAP_BASE 0xFFFF888000000000ULL
+#define PHYSMAP_MAX_PDS 32 // 2MB fallback covers this many GB
+#define PHYSMAP_MAX_PTS 16 // 2MB pages only partly RAM, split to 4KB
+#define PHYSMAP_RANGES 66  // BOOT_MMAP_MAX E820 entries and the low MB
+
+// Below 1MB the physmap skips the VGA window, the rest is firmware data
+#define LEGACY_VIDEO_START 0xA0000ULL
+#define LEGACY_VIDEO_END 0xC0000ULL
+#define LOW_MEMORY_END 0x100000ULL
+
+#define PHYS_TO_VIRT(p) ((void*)((uint64_t)(p) + PHYSMAP_BASE))
+#define VIRT_TO_PHYS(v) ((uint64_t)(v) - PHYSMAP_BASE)
+#define KERNEL_TO_PHYS(v) ((uint64_t)(v) - KERNEL_OFFSET_HIGH)
+
+#define PAGE_SIZE_4K 0x1000ULL
 #define PAGE_SIZE 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
 #define PAGE_PRESENT (1ULL << 0)
 #define PAGE_WRITE (1ULL << 1)
 #define PAGE_USER (1ULL << 2) 
 #define PAGE_WRITETHROUGH (1ULL << 3)
 #define PAGE_CACHE_DISABLE (1ULL << 4)
 #define PAGE_HUGE (1ULL << 7)
+#define PAGE_PAT (1ULL << 7)          // 4KB entries only, bit 7 means huge above
+#define PAGE_PAT_HUGE (1ULL << 12)
+#define PAGE_GLOBAL (1ULL << 8)
+#define PAGE_NX (1ULL << 63)
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define PML4_INDEX(v) (((v) >> 39) & 0x1FF)
+#define PDP_INDEX(v) (((v) >> 30) & 0x1FF)
+#define PD_INDEX(v) (((v) >> 21) & 0x1FF)
+#define PT_INDEX(v) (((v) >> 12) & 0x1FF)
+
+#define KERNEL_HALF_BASE 0xFFFF800000000000ULL
+
+#define VGA_PHYS_BASE 0xB8000ULL
+#define VGA_VIRT_BASE (KERNEL_OFFSET_HIGH + VGA_PHYS_BASE)
+#define VGA_WINDOW_SIZE 0x8000ULL     // B8000-BFFFF
+
+// Memory types for vmm_map, each is the PAT index its entry selects
+// through PWT (bit 0), PCD (bit 1) and PAT (bit 2)
+#define MEM_WB 0
+#define MEM_WC 1
+#define MEM_UC_MINUS 2
+#define MEM_UC 3
+#define MEM_WT 7
+
+// IA32_PAT layout behind those indexes: WB, WC, UC-, UC, WB, WP, UC-, WT
+#define PAT_TYPE_UC 0x00ULL
+#define PAT_TYPE_WC 0x01ULL
+#define PAT_TYPE_WT 0x04ULL
+#define PAT_TYPE_WP 0x05ULL
+#define PAT_TYPE_WB 0x06ULL
+#define PAT_TYPE_UC_MINUS 0x07ULL
+#define PAT_LAYOUT (PAT_TYPE_WB | PAT_TYPE_WC << 8 | PAT_TYPE_UC_MINUS << 16 | PAT_TYPE_UC << 24 | \
+                    PAT_TYPE_WB << 32 | PAT_TYPE_WP << 40 | PAT_TYPE_UC_MINUS << 48 | PAT_TYPE_WT << 56)
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)      // Keep the new PCID's cached entries
+
+#define PCID_BITS 12
+#define PCID_COUNT (1 << PCID_BITS)
+#define PCID_MASK (PCID_COUNT - 1ULL)
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+
+// Past this many pages a full flush is cheaper than invlpg each
+#define TLB_BATCH_MAX 32
+
+#define VMM_OP_MAP 0
+#define VMM_OP_UNMAP 1
+#define VMM_OP_PROTECT 2
 
 typedef struct 
 {
    uint64_t entries[512];
 } page_tb_t;
 
+typedef struct
+{
+   uint64_t addrs[TLB_BATCH_MAX];
+   uint32_t count;                  // May exceed TLB_BATCH_MAX, then flush all
+   bool kernel_half;                // Touched mappings every space shares
+   bool new_kernel_top;             // Added a kernel half PML4 entry
+} tlb_batch_t;
+
+typedef struct addr_space
+{
+   page_tb_t* pml4;                 // Through the physmap
+   uint64_t asid[MAX_CPUS];         // Generation << PCID_BITS | PCID, 0 = none
+   struct addr_space* next;         // All spaces, kernel_space first
+
+   spinlock_t vma_lock;
+   struct vma* vmas;                // Sorted by address
+   struct vma* vma_hint;            // Last lookup hit
+} addr_space_t;
+
+extern addr_space_t kernel_space;
+
+// Leaf visitor for vmm_walk, level 1 is a 4KB entry
+typedef bool (*vmm_walk_fn)(uint64_t virt, uint64_t* entry, int level, void* ctx);
+
 void init_paging();
-void map_page(uint64_t virt, uint64_t phys, uint64_t flags);
+bool vmm_map(addr_space_t* space, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags, int mem_type);
+bool vmm_unmap(addr_space_t* space, uint64_t virt, uint64_t size);
+bool vmm_protect(addr_space_t* space, uint64_t virt, uint64_t size, uint64_t flags);
+bool vmm_translate(addr_space_t* space, uint64_t virt, uint64_t* phys);
+bool vmm_walk(addr_space_t* space, uint64_t virt, uint64_t size, vmm_walk_fn fn, void* ctx);
+void vmm_flush(addr_space_t* space, uint64_t virt, uint64_t size);
+addr_space_t* create_address_space();
+void destroy_address_space(addr_space_t* space);
+void switch_address_space(addr_space_t* space);
+addr_space_t* current_space();
+void switch_address_space_flush(addr_space_t* space);
+bool pcid_active();
+uint64_t page_nx();
+void init_physmap(const struct boot_info* boot_info);
+uint64_t physmap_size();
+bool physmap_covers(uint64_t phys, uint64_t size);
+page_tb_t* current_pml4();
 
 #endif
\ No newline at end of file
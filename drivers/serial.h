@@ -0,0 +1,69 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KSERIAL_H__
+#define __KSERIAL_H__
+
+#include "../libk/kdef.h"
+
+#define COM1_PORT 0x3F8
+#define COM2_PORT 0x2F8
+#define COM1_IRQ  4
+#define COM2_IRQ  3
+
+#define SERIAL_COM1  0
+#define SERIAL_COM2  1
+#define SERIAL_PORTS 2
+
+#define UART_DATA 0         // Data register (DLAB=0)
+#define UART_IER  1         // Interrupt enable (DLAB=0)
+#define UART_DLL  0         // Divisor latch low (DLAB=1)
+#define UART_DLH  1         // Divisor latch high (DLAB=1)
+#define UART_IIR  2         // Interrupt identification (read)
+#define UART_FCR  2         // FIFO control (write)
+#define UART_LCR  3         // Line control
+#define UART_MCR  4         // Modem control
+#define UART_LSR  5         // Line status
+#define UART_MSR  6         // Modem status
+
+#define UART_IER_RDI  (1 << 0) // Received data available
+#define UART_IER_THRI (1 << 1) // Transmit holding register empty
+#define UART_IER_RLSI (1 << 2) // Receiver line status
+
+#define UART_IIR_NO_INT  0x01  // No interrupt pending
+#define UART_IIR_ID_MASK 0x0E
+#define UART_IIR_MSI     0x00  // Modem status change
+#define UART_IIR_THRI    0x02  // Transmit holding register empty
+#define UART_IIR_RDI     0x04  // Received data past the trigger level
+#define UART_IIR_RLSI    0x06  // Receiver line status
+#define UART_IIR_TIMEOUT 0x0C  // Data waiting below the trigger level
+#define UART_IIR_FIFO    0xC0  // Both set once a 16550A enables its FIFOs
+
+#define UART_LSR_DR   (1 << 0) // Data ready
+#define UART_LSR_OE   (1 << 1) // Receiver overrun
+#define UART_LSR_THRE (1 << 5) // Transmit holding register empty
+
+#define UART_MCR_LOOP 0x1E     // Loopback with RTS, OUT1 and OUT2, for probing
+#define UART_MCR_RUN  0x0B     // DTR, RTS, OUT2 gates the IRQ line
+
+#define UART_FIFO_SIZE 16      // 16550A transmit FIFO
+#define UART_CLOCK     115200  // 1.8432 MHz crystal over 16, divisor 1
+
+#define SERIAL_TX_RING 4096    // Bytes, power of two
+#define SERIAL_RX_RING 256
+
+void init_serial();
+void init_serial_irq();
+bool serial_open(int port, uint32_t baud);
+void serial_panic();
+void serial_take_console();
+
+size_t serial_port_write(int port, const char* data, size_t len);
+size_t serial_read(int port, char* buf, size_t len);
+
+void serial_putc(char c);
+void serial_write(const char* str);
+void serial_write_span(const char* data, size_t len);
+
+#endif
@@ -8,8 +8,16 @@
 #define APIC_LVT_TIMER  0x320
 #define APIC_EOI        0xB0
 
+#define PIT_FREQUENCY   1193182
+#define PIT_CHANNEL2    0x42
+#define PIT_COMMAND     0x43
+#define PIT_GATE        0x61
+
+#define CPUID_TSC_CRYSTAL 0x15 // TSC/crystal ratio in EBX/EAX, crystal Hz in ECX
+
 void init_timer(uint32_t frequency);
 uint64_t get_ticks();
-void timer_tick();
+uint64_t calibrate_tsc();
+uint64_t get_tsc_khz();
 
 #endif
\ No newline at end of file
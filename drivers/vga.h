@@ -0,0 +1,35 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KVGA_H__
+#define __KVGA_H__
+
+#include "../libk/kdef.h"
+
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define VGA_HISTORY 256                 // Rows kept for scrollback, power of two
+#define VGA_WINDOW_ROWS 204             // Whole rows in the 32 KB text window
+
+#define VGA_BLACK 0
+#define VGA_LIGHT_GREY 7
+#define VGA_WHITE 15
+
+#define VGA_COLOR(fg, bg) ((bg << 4) | fg)
+#define VGA_ENTRY(c, color) ((uint16_t)(c) | ((uint16_t)(color) << 8))
+
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA 0x3D5
+#define VGA_CRTC_CURSOR_START 0x0A
+#define VGA_CRTC_START_HIGH 0x0C        // First cell displayed, in cells
+#define VGA_CRTC_START_LOW 0x0D
+#define VGA_CURSOR_OFF 0x20             // Cursor start register, disable bit
+
+void init_vga(uint8_t color);
+void vga_putchar(char c);
+void vga_write(const char* data, size_t len);
+void vga_flush();
+void vga_scrollback(int rows);
+
+#endif
@@ -0,0 +1,78 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KBOOT_H__
+#define __KBOOT_H__
+
+#include "../libk/kdef.h"
+
+// Must match the boot_info struc in arch/x86/boot/second.asm
+#define BOOT_INFO_MAGIC 0x42534F76 // 'vOSB'
+#define BOOT_MMAP_MAX 64
+
+// Page tables stage 2 leaves live: PML4/PDPs/PDs and the 4 KB
+// tables for the higher half kernel image
+#define BOOT_PAGE_TABLES_START 0x1000
+#define BOOT_PAGE_TABLES_END   0x6000
+#define BOOT_KERNEL_PT_START   0x10000
+#define BOOT_KERNEL_PT_END     0x20000
+
+// VGA BIOS 8x16 font stage 2 copies out before leaving real mode
+#define BOOT_FONT       0x6000
+#define BOOT_FONT_SIZE  4096
+
+// Slots in boot_info.tsc, in boot order
+#define BOOT_TSC_STAGE1     0
+#define BOOT_TSC_STAGE2     1
+#define BOOT_TSC_E820       2
+#define BOOT_TSC_A20        3
+#define BOOT_TSC_LOADED     4
+#define BOOT_TSC_PROTECTED  5
+#define BOOT_TSC_DECOMPRESS 6  // Only stamped for LZ4 kernels
+#define BOOT_TSC_LONG_MODE  7
+#define BOOT_TSC_HANDOFF    8
+#define BOOT_TSC_COUNT      9
+
+#define E820_USABLE           1
+#define E820_RESERVED         2
+#define E820_ACPI_RECLAIMABLE 3
+#define E820_ACPI_NVS         4
+#define E820_BAD              5
+
+struct e820_entry
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed));
+
+struct boot_info
+{
+    uint32_t magic;
+    uint8_t  boot_drive;
+    uint8_t  reserved0[3];
+    uint64_t kernel_start;   // Physical extent of the kernel's segments, BSS included
+    uint64_t kernel_end;
+    uint64_t tsc[BOOT_TSC_COUNT]; // Bootloader timeline stamps
+    uint32_t mmap_count;
+    uint32_t reserved1;
+    struct e820_entry mmap[BOOT_MMAP_MAX];
+    uint64_t fb_addr;        // VBE linear framebuffer, 0 when still in text mode
+    uint32_t fb_pitch;       // Bytes per scanline
+    uint16_t fb_width;
+    uint16_t fb_height;
+    uint8_t  fb_bpp;
+    uint8_t  fb_red_size;    // Channel widths and bit positions
+    uint8_t  fb_red_pos;
+    uint8_t  fb_green_size;
+    uint8_t  fb_green_pos;
+    uint8_t  fb_blue_size;
+    uint8_t  fb_blue_pos;
+    uint8_t  reserved2;
+    uint32_t font;           // Physical address of the 8x16 font, 0 if none
+    uint32_t reserved3;
+} __attribute__((packed));
+
+#endif
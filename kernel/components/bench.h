@@ -0,0 +1,24 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KBENCH_H__
+#define __KBENCH_H__
+
+#include "../../libk/kdef.h"
+
+// Boot-time microbenchmarks, only run in BENCH=1 builds
+void bench_pmm();
+void bench_slab();
+void bench_pcid();
+void bench_vga();
+void bench_fault();
+void bench_cow();
+void bench_format();
+void bench_console();
+void bench_fb();
+void bench_irq();
+void bench_softirq();
+void run_benchmarks();
+
+#endif
@@ -0,0 +1,737 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../bench.h"
+#include "../pmm.h"
+#include "../interrupt_handler.h"
+#include "../softirq.h"
+#include "../vma.h"
+#include "../../../libk/io.h"
+#include "../../../libk/slab.h"
+#include "../../../libk/spinlock.h"
+#include "../../../drivers/paging.h"
+#include "../../../drivers/cpu.h"
+#include "../../../drivers/serial.h"
+#include "../../../drivers/timer.h"
+#include "../../../drivers/vga.h"
+#include "../../../drivers/fb.h"
+#include "../../../drivers/init.h"
+
+#define BENCH_PMM_FRAMES 4096
+#define BENCH_PMM_SLOTS 1024
+#define BENCH_PMM_STEPS 100000
+#define BENCH_PMM_MAX_ORDER 9
+
+#define BENCH_SLAB_OBJECT 64
+#define BENCH_SLAB_BATCH 1024
+#define BENCH_SLAB_ROUNDS 16
+
+#define BENCH_TLB_BASE 0x0000100000000000ULL
+#define BENCH_TLB_PAGES 64
+#define BENCH_TLB_SWITCHES 4096
+
+#define BENCH_VGA_WORDS (80 * 25 * 2 / 8)
+#define BENCH_VGA_FRAMES 256
+
+#define BENCH_FAULT_BASE 0x0000300000000000ULL
+#define BENCH_FAULT_PAGES 4096
+
+#define BENCH_COW_BASE 0x0000400000000000ULL
+#define BENCH_COW_SIZE (32ULL << 20)
+#define BENCH_COW_WRITE_STRIDE 8      // Child writes every 8th page
+
+#define BENCH_FORMAT_LINES 4096
+#define BENCH_FORMAT_VGA_LINES 64     // Scrolls the screen, keep it short
+#define BENCH_FORMAT_RING (16 * 1024)
+
+#define BENCH_CONSOLE_LINES 512
+#define BENCH_CONSOLE_BATCH 2048      // What the klog flusher hands a console
+
+#define BENCH_IRQ_VECTOR 0xF0         // Unused, raised with int
+#define BENCH_IRQ_ROUNDS 10000
+
+#define BENCH_SOFTIRQ_INLINE 0xF1     // Does its work before the EOI
+#define BENCH_SOFTIRQ_DEFERRED 0xF2   // Leaves it to a tasklet
+#define BENCH_SOFTIRQ_ROUNDS 1000
+#define BENCH_SOFTIRQ_LINES 8         // Log lines formatted per interrupt
+
+#define BENCH_FB_TEXT_PASSES 16       // Full screens of text per variant
+#define BENCH_FB_FILL_PASSES 16       // Full screen fills per variant
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_random()
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+// Results go to the screen and to COM1 for headless runs
+static void bench_emit(const char* line)
+{
+    printf("%s", line);
+    // Without a screen printf already went to serial
+    if (console_sink(CONSOLE_SERIAL) != console_sink(CONSOLE_VGA))
+        serial_write(line);
+}
+
+void bench_pmm()
+{
+    char line[128];
+    static uint64_t frames[BENCH_PMM_FRAMES];
+    static uint64_t slots[BENCH_PMM_SLOTS];
+    static uint8_t slot_orders[BENCH_PMM_SLOTS];
+    uint64_t free_before = pmm_free_frames();
+
+    // Straight order-0 alloc then free, the page table / stack pattern
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_PMM_FRAMES; i++)
+        frames[i] = alloc_frame();
+    uint64_t mid = rdtsc();
+    for (int i = 0; i < BENCH_PMM_FRAMES; i++)
+        free_frame(frames[i]);
+    uint64_t end = rdtsc();
+
+    snprintf(line, sizeof(line), "pmm: order 0 alloc %llu cycles/op, free %llu cycles/op\n",
+             (mid - start) / BENCH_PMM_FRAMES, (end - mid) / BENCH_PMM_FRAMES);
+    bench_emit(line);
+
+    // Random mix of orders 0-9, exercising splits and coalescing
+    uint64_t ops = 0;
+    start = rdtsc();
+    for (int i = 0; i < BENCH_PMM_STEPS; i++)
+    {
+        uint64_t r = bench_random();
+        int slot = r % BENCH_PMM_SLOTS;
+        if (slots[slot])
+        {
+            free_frames(slots[slot], slot_orders[slot]);
+            slots[slot] = 0;
+        }
+        else
+        {
+            slot_orders[slot] = (r >> 32) % (BENCH_PMM_MAX_ORDER + 1);
+            slots[slot] = alloc_frames(slot_orders[slot], ZONE_NORMAL);
+        }
+        ops++;
+    }
+    end = rdtsc();
+
+    for (int i = 0; i < BENCH_PMM_SLOTS; i++)
+    {
+        if (slots[i])
+            free_frames(slots[i], slot_orders[i]);
+        slots[i] = 0;
+    }
+
+    snprintf(line, sizeof(line), "pmm: mixed orders 0-%d %llu cycles/op over %llu ops\n",
+             BENCH_PMM_MAX_ORDER, (end - start) / ops, ops);
+    bench_emit(line);
+    if (pmm_free_frames() != free_before)
+    {
+        snprintf(line, sizeof(line), "pmm: LEAK %llu frames\n", free_before - pmm_free_frames());
+        bench_emit(line);
+    }
+}
+
+// Baseline for bench_slab: one global lock around one free list
+typedef struct locked_node
+{
+    struct locked_node* next;
+} locked_node_t;
+
+static spinlock_t locked_lock = SPINLOCK_INIT;
+static locked_node_t* locked_free = NULL;
+
+static void* locked_alloc()
+{
+    uint64_t flags = irq_save();
+    spin_lock(&locked_lock);
+    if (!locked_free)
+    {
+        uint64_t phys = alloc_frame();
+        if (phys)
+        {
+            uint8_t* page = PHYS_TO_VIRT(phys);
+            for (uint64_t off = 0; off < FRAME_SIZE; off += BENCH_SLAB_OBJECT)
+            {
+                locked_node_t* node = (locked_node_t*)(page + off);
+                node->next = locked_free;
+                locked_free = node;
+            }
+        }
+    }
+    locked_node_t* node = locked_free;
+    if (node)
+        locked_free = node->next;
+    spin_unlock(&locked_lock);
+    irq_restore(flags);
+    return node;
+}
+
+static void locked_release(void* ptr)
+{
+    uint64_t flags = irq_save();
+    spin_lock(&locked_lock);
+    locked_node_t* node = ptr;
+    node->next = locked_free;
+    locked_free = node;
+    spin_unlock(&locked_lock);
+    irq_restore(flags);
+}
+
+void bench_slab()
+{
+    char line[128];
+    static void* objects[BENCH_SLAB_BATCH];
+
+    // Batches of BENCH_SLAB_BATCH allocations then frees, warm after the first round
+    uint64_t start = rdtsc();
+    for (int r = 0; r < BENCH_SLAB_ROUNDS; r++)
+    {
+        for (int i = 0; i < BENCH_SLAB_BATCH; i++)
+            objects[i] = kmalloc(BENCH_SLAB_OBJECT);
+        for (int i = 0; i < BENCH_SLAB_BATCH; i++)
+            kfree(objects[i]);
+    }
+    uint64_t slab_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int r = 0; r < BENCH_SLAB_ROUNDS; r++)
+    {
+        for (int i = 0; i < BENCH_SLAB_BATCH; i++)
+            objects[i] = locked_alloc();
+        for (int i = 0; i < BENCH_SLAB_BATCH; i++)
+            locked_release(objects[i]);
+    }
+    uint64_t locked_cycles = rdtsc() - start;
+
+    uint64_t ops = 2ULL * BENCH_SLAB_BATCH * BENCH_SLAB_ROUNDS;
+    snprintf(line, sizeof(line), "slab: batch kmalloc/kfree %llu cycles/op, locked list %llu cycles/op\n",
+             slab_cycles / ops, locked_cycles / ops);
+    bench_emit(line);
+
+    // Alloc/free pairs, the common short-lived object pattern
+    start = rdtsc();
+    for (int i = 0; i < BENCH_SLAB_BATCH * BENCH_SLAB_ROUNDS; i++)
+        kfree(kmalloc(BENCH_SLAB_OBJECT));
+    slab_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_SLAB_BATCH * BENCH_SLAB_ROUNDS; i++)
+        locked_release(locked_alloc());
+    locked_cycles = rdtsc() - start;
+
+    snprintf(line, sizeof(line), "slab: pair kmalloc/kfree %llu cycles/op, locked list %llu cycles/op\n",
+             slab_cycles / ops, locked_cycles / ops);
+    bench_emit(line);
+    kmem_print_stats();
+}
+
+// Reads one word from every page, refilling the TLB for the range
+static uint64_t bench_touch(uint64_t base)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < BENCH_TLB_PAGES; i++)
+        sum += *(volatile uint64_t*)(base + i * FRAME_SIZE);
+    return sum;
+}
+
+static uint64_t bench_switches(addr_space_t* a, addr_space_t* b, bool keep_tlb)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_TLB_SWITCHES; i++)
+    {
+        addr_space_t* space = i & 1 ? b : a;
+        if (keep_tlb)
+            switch_address_space(space);
+        else
+            switch_address_space_flush(space);
+        bench_touch(BENCH_TLB_BASE);
+    }
+    uint64_t cycles = rdtsc() - start;
+    switch_address_space(&kernel_space);
+    return cycles / BENCH_TLB_SWITCHES;
+}
+
+void bench_pcid()
+{
+    char line[128];
+    static uint64_t frames[BENCH_TLB_PAGES];
+    addr_space_t* a = create_address_space();
+    addr_space_t* b = create_address_space();
+    if (!a || !b)
+    {
+        bench_emit("pcid: no memory for address spaces\n");
+        return;
+    }
+
+    // Same frames in both spaces, one 4KB TLB entry per page
+    for (int i = 0; i < BENCH_TLB_PAGES; i++)
+    {
+        frames[i] = alloc_frame();
+        vmm_map(a, BENCH_TLB_BASE + i * FRAME_SIZE, frames[i], FRAME_SIZE, page_nx(), MEM_WB);
+        vmm_map(b, BENCH_TLB_BASE + i * FRAME_SIZE, frames[i], FRAME_SIZE, page_nx(), MEM_WB);
+    }
+
+    uint64_t flushed = bench_switches(a, b, false);
+    uint64_t tagged = bench_switches(a, b, true);
+    snprintf(line, sizeof(line), "pcid: switch + %d page refill %llu cycles flushing, %llu cycles %s\n",
+             BENCH_TLB_PAGES, flushed, tagged, pcid_active() ? "with PCID" : "(no PCID)");
+    bench_emit(line);
+
+    for (int i = 0; i < BENCH_TLB_PAGES; i++)
+    {
+        vmm_unmap(a, BENCH_TLB_BASE + i * FRAME_SIZE, FRAME_SIZE);
+        vmm_unmap(b, BENCH_TLB_BASE + i * FRAME_SIZE, FRAME_SIZE);
+        free_frame(frames[i]);
+    }
+    destroy_address_space(a);
+    destroy_address_space(b);
+}
+
+// Rewrites the whole text screen with what's already on it
+static uint64_t bench_redraw(uint64_t base, const uint64_t* screen)
+{
+    volatile uint64_t* vga = (volatile uint64_t*)base;
+    uint64_t start = rdtsc();
+    for (int f = 0; f < BENCH_VGA_FRAMES; f++)
+    {
+        for (int i = 0; i < BENCH_VGA_WORDS; i++)
+            vga[i] = screen[i];
+    }
+    __asm__ volatile("sfence" ::: "memory");   // Drain the WC buffers
+    return (rdtsc() - start) / BENCH_VGA_FRAMES;
+}
+
+// Gives the text buffer mapping another memory type. Two mappings of it
+// with different types must never exist at once, so the old one goes
+// first and the caches are written back before the new one is made
+static bool vga_remap(int mem_type)
+{
+    vmm_unmap(&kernel_space, VGA_VIRT_BASE, VGA_WINDOW_SIZE);
+    __asm__ volatile("wbinvd" ::: "memory");
+    return vmm_map(&kernel_space, VGA_VIRT_BASE, VGA_PHYS_BASE, VGA_WINDOW_SIZE,
+                   PAGE_WRITE | PAGE_GLOBAL | page_nx(), mem_type);
+}
+
+void bench_vga()
+{
+    char line[128];
+    static uint64_t screen[BENCH_VGA_WORDS];
+    for (int i = 0; i < BENCH_VGA_WORDS; i++)
+        screen[i] = ((volatile uint64_t*)VGA_VIRT_BASE)[i];
+
+    bool mapped = vga_remap(MEM_UC);
+    uint64_t uc = mapped ? bench_redraw(VGA_VIRT_BASE, screen) : 0;
+    // The console's own WC mapping comes back either way
+    if (!vga_remap(MEM_WC) || !mapped)
+    {
+        bench_emit("vga: could not remap the text buffer\n");
+        return;
+    }
+    uint64_t wc = bench_redraw(VGA_VIRT_BASE, screen);
+
+    snprintf(line, sizeof(line), "vga: %d byte redraw UC %llu cycles, WC %llu cycles\n",
+             BENCH_VGA_WORDS * 8, uc, wc);
+    bench_emit(line);
+}
+
+// Writes one word per page of a lazily backed region, returns cycles per page
+static uint64_t bench_touch_region(uint64_t base, bool write)
+{
+    uint64_t sum = 0;
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FAULT_PAGES; i++)
+    {
+        volatile uint64_t* word = (volatile uint64_t*)(base + i * FRAME_SIZE);
+        if (write)
+            *word = i;
+        else
+            sum += *word;
+    }
+    (void)sum;
+    return (rdtsc() - start) / BENCH_FAULT_PAGES;
+}
+
+static void bench_emit_faults(const char* name, uint64_t per_page, fault_stats_t before)
+{
+    char line[128];
+    const fault_stats_t* after = vma_fault_stats();
+    uint64_t faults = after->faults - before.faults;
+    snprintf(line, sizeof(line), "fault: %s %llu cycles/page, %llu faults, %llu cycles/fault in handler\n",
+             name, per_page, faults, faults ? (after->cycles - before.cycles) / faults : 0ULL);
+    bench_emit(line);
+}
+
+void bench_fault()
+{
+    uint64_t size = BENCH_FAULT_PAGES * FRAME_SIZE;
+
+    // Plain demand-zero, one trap per page
+    fault_stats_t before = *vma_fault_stats();
+    if (!vma_reserve(&kernel_space, BENCH_FAULT_BASE, size, VMA_WRITE))
+    {
+        bench_emit("fault: could not reserve the test region\n");
+        return;
+    }
+    uint64_t per_page = bench_touch_region(BENCH_FAULT_BASE, true);
+    bench_emit_faults("write", per_page, before);
+    vma_release(&kernel_space, BENCH_FAULT_BASE);
+
+    // vzalloc regions fault around, one trap per window
+    void* lazy = vzalloc(size);
+    if (!lazy)
+        return;
+    before = *vma_fault_stats();
+    per_page = bench_touch_region((uint64_t)lazy, true);
+    bench_emit_faults("write fault-around", per_page, before);
+    vfree(lazy);
+
+    // Reads only map the shared zero page
+    lazy = vzalloc(size);
+    if (!lazy)
+        return;
+    before = *vma_fault_stats();
+    per_page = bench_touch_region((uint64_t)lazy, false);
+    bench_emit_faults("read zero page", per_page, before);
+    vfree(lazy);
+
+    char line[64];
+    snprintf(line, sizeof(line), "fault: worst %llu cycles in handler\n", vma_fault_stats()->max_cycles);
+    bench_emit(line);
+}
+
+// Writes one word every stride pages of [base, base + size), returns cycles
+static uint64_t bench_write_pages(uint64_t base, uint64_t size, uint64_t stride)
+{
+    uint64_t start = rdtsc();
+    for (uint64_t off = 0; off < size; off += stride * FRAME_SIZE)
+        *(volatile uint64_t*)(base + off) = off;
+    return rdtsc() - start;
+}
+
+// Clones a fully populated region, then dirties part of it in the child
+static void bench_cow_run(const char* name, uint32_t flags, uint64_t stride)
+{
+    char line[128];
+    uint64_t free_start = pmm_free_frames();
+    addr_space_t* parent = create_address_space();
+    if (!parent || !vma_reserve(parent, BENCH_COW_BASE, BENCH_COW_SIZE, flags))
+    {
+        bench_emit("cow: could not set up the parent space\n");
+        if (parent)
+            destroy_address_space(parent);
+        return;
+    }
+    switch_address_space(parent);
+    bench_write_pages(BENCH_COW_BASE, BENCH_COW_SIZE, 1);
+
+    uint64_t free_before = pmm_free_frames();
+    uint64_t start = rdtsc();
+    addr_space_t* child = clone_address_space(parent);
+    uint64_t clone_cycles = rdtsc() - start;
+    if (child)
+    {
+        uint64_t used = free_before - pmm_free_frames();
+        snprintf(line, sizeof(line), "cow: %s clone of %llu MB %llu cycles, %llu KB of tables vs %llu KB eager\n",
+                 name, BENCH_COW_SIZE >> 20, clone_cycles, used * FRAME_SIZE / 1024,
+                 BENCH_COW_SIZE / 1024);
+        bench_emit(line);
+
+        fault_stats_t before = *vma_fault_stats();
+        switch_address_space(child);
+        uint64_t cycles = bench_write_pages(BENCH_COW_BASE, BENCH_COW_SIZE, stride);
+        const fault_stats_t* after = vma_fault_stats();
+        uint64_t faults = after->faults - before.faults;
+        snprintf(line, sizeof(line), "cow: %s child writes %llu faults, %llu copies, %llu splits, %llu cycles/fault\n",
+                 name, faults, after->copies - before.copies, after->splits - before.splits,
+                 faults ? cycles / faults : 0ULL);
+        bench_emit(line);
+        snprintf(line, sizeof(line), "cow: %s after writes %llu KB above the parent\n",
+                 name, (free_before - pmm_free_frames()) * FRAME_SIZE / 1024);
+        bench_emit(line);
+
+        switch_address_space(&kernel_space);
+        vma_release_all(child);
+        destroy_address_space(child);
+    }
+    else
+        bench_emit("cow: clone failed\n");
+
+    switch_address_space(&kernel_space);
+    vma_release_all(parent);
+    destroy_address_space(parent);
+    if (pmm_free_frames() != free_start)
+    {
+        snprintf(line, sizeof(line), "cow: %s %lld frames not returned\n",
+                 name, (long long)(free_start - pmm_free_frames()));
+        bench_emit(line);
+    }
+}
+
+void bench_cow()
+{
+    bench_cow_run("4K", VMA_WRITE | VMA_FAULT_AROUND, BENCH_COW_WRITE_STRIDE);
+    // One write per huge page, each one splits its block
+    bench_cow_run("2M", VMA_WRITE | VMA_HUGE, PAGE_SIZE / FRAME_SIZE);
+}
+
+// A typical log line, mixing padded decimals, hex, strings and sizes
+#define BENCH_LOG_FORMAT "[%5llu.%06llu] cpu%u %-8s pid %d addr 0x%016llx len %zu: %s\n"
+#define BENCH_LOG_ARGS(i) (i) >> 20, (i) & 0xFFFFF, (unsigned)((i) & 3), "vmm", (int)((i) % 4096), \
+    0xFFFF800000000000ULL + (i) * PAGE_SIZE, (size_t)(i) * 64, "mapped"
+
+static int bench_format_to(format_sink_t* sink, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int ret = vformat(sink, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+void bench_format()
+{
+    char line[128];
+    char buf[160];
+    static char ring_buf[BENCH_FORMAT_RING];
+    ring_sink_t ring;
+    ring_sink_init(&ring, ring_buf, sizeof(ring_buf));
+    uint64_t bytes = 0;
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FORMAT_LINES; i++)
+        bytes += snprintf(buf, sizeof(buf), BENCH_LOG_FORMAT, BENCH_LOG_ARGS(i));
+    uint64_t string_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FORMAT_LINES; i++)
+        bench_format_to(&ring.sink, BENCH_LOG_FORMAT, BENCH_LOG_ARGS(i));
+    uint64_t ring_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FORMAT_VGA_LINES; i++)
+        printf(BENCH_LOG_FORMAT, BENCH_LOG_ARGS(i));
+    uint64_t vga_cycles = rdtsc() - start;
+
+    snprintf(line, sizeof(line), "format: %llu byte log line, snprintf %llu cycles, ring %llu cycles, VGA %llu cycles\n",
+             bytes / BENCH_FORMAT_LINES, string_cycles / BENCH_FORMAT_LINES,
+             ring_cycles / BENCH_FORMAT_LINES, vga_cycles / BENCH_FORMAT_VGA_LINES);
+    bench_emit(line);
+}
+
+// Characters per second through the console for a flood of log lines,
+// written a line at a time as printf does or in batches of up to batch
+static uint64_t bench_flood(const char* text, size_t len, size_t batch)
+{
+    uint64_t start = rdtsc();
+    for (size_t off = 0; off < len; )
+    {
+        size_t end = off;
+        if (batch)
+            end = len - off < batch ? len : off + batch;
+        else
+            while (text[end++] != '\n');
+        console_write(CONSOLE_VGA, text + off, end - off);
+        off = end;
+    }
+    uint64_t cycles = rdtsc() - start;
+    return cycles ? len * get_tsc_khz() * 1000 / cycles : 0;
+}
+
+void bench_console()
+{
+    char line[128];
+    static char text[BENCH_CONSOLE_LINES * 128];
+    size_t len = 0;
+    for (uint64_t i = 0; i < BENCH_CONSOLE_LINES; i++)
+        len += snprintf(text + len, sizeof(text) - len, BENCH_LOG_FORMAT, BENCH_LOG_ARGS(i));
+
+    uint64_t per_line = bench_flood(text, len, 0);
+    uint64_t batched = bench_flood(text, len, BENCH_CONSOLE_BATCH);
+    snprintf(line, sizeof(line), "console: %d line flood %llu chars/s per line, %llu chars/s in %d byte batches\n",
+             BENCH_CONSOLE_LINES, per_line, batched, BENCH_CONSOLE_BATCH);
+    bench_emit(line);
+}
+
+// Glyphs/s drawing full screens of text and MB/s filling the whole
+// framebuffer, with the blitter variant currently selected. The text
+// cycles through as many colours as there are glyph caches
+static void bench_fb_variant(uint64_t* glyphs, uint64_t* fill)
+{
+    char text[FB_MAX_COLS];
+    uint32_t cols = fb_cols();
+    uint32_t rows = fb_rows();
+    for (uint32_t i = 0; i < cols; i++)
+        text[i] = ' ' + i % 95;
+
+    uint64_t start = rdtsc();
+    for (int pass = 0; pass < BENCH_FB_TEXT_PASSES; pass++)
+    {
+        uint8_t fg = 1 + pass % FB_GLYPH_CACHES;
+        for (uint32_t y = 0; y < rows; y++)
+            fb_draw_text(0, y, text, cols, VGA_COLOR(fg, VGA_BLACK));
+    }
+    uint64_t cycles = rdtsc() - start;
+    uint64_t drawn = (uint64_t)BENCH_FB_TEXT_PASSES * rows * cols;
+    *glyphs = cycles ? drawn * get_tsc_khz() * 1000 / cycles : 0;
+
+    start = rdtsc();
+    for (int pass = 0; pass < BENCH_FB_FILL_PASSES; pass++)
+        fb_fill_rect(0, 0, fb_width(), fb_height(), fb_rgb(pass * 16, 0, 255 - pass * 16));
+    cycles = rdtsc() - start;
+    uint64_t bytes = (uint64_t)BENCH_FB_FILL_PASSES * fb_width() * fb_height() * 4;
+    *fill = cycles ? (bytes >> 20) * get_tsc_khz() * 1000 / cycles : 0;
+}
+
+void bench_fb()
+{
+    char line[128];
+    if (!fb_active())
+    {
+        bench_emit("fb: no framebuffer, boot a VBE=1 image\n");
+        return;
+    }
+
+    uint64_t words_glyphs, words_fill, glyphs, fill;
+    fb_select(0);
+    bench_fb_variant(&words_glyphs, &words_fill);
+    fb_select(cpu_mem_features());
+    bench_fb_variant(&glyphs, &fill);
+    fb_fill_rect(0, 0, fb_width(), fb_height(), fb_rgb(0, 0, 0));
+    fb_redraw();
+
+    snprintf(line, sizeof(line), "fb: %ux%u words %llu glyphs/s %llu MB/s fill, %s %llu glyphs/s %llu MB/s fill\n",
+             fb_width(), fb_height(), words_glyphs, words_fill, fb_variant(), glyphs, fill);
+    bench_emit(line);
+}
+
+static bool bench_irq_handler(uint8_t vector, void* data)
+{
+    (void)vector;
+    (*(uint64_t*)data)++;
+    return true;
+}
+
+// Round trip of a software interrupt through the stub, irq_dispatch and
+// a one line handler, which is the floor under every device interrupt
+void bench_irq()
+{
+    char line[128];
+    static uint64_t hits = 0;
+    if (!request_irq(BENCH_IRQ_VECTOR, bench_irq_handler, &hits, "bench", 0))
+    {
+        bench_emit("irq: bench vector is taken\n");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_IRQ_ROUNDS; i++)
+        __asm__ volatile("int %0" : : "i"(BENCH_IRQ_VECTOR) : "memory");
+    uint64_t cycles = rdtsc() - start;
+    free_irq(BENCH_IRQ_VECTOR, &hits);
+
+    const irq_stats_t* stats = irq_stats(cpu_id());
+    snprintf(line, sizeof(line), "irq: %llu of %d dispatched, %llu cycles round trip, %llu cycles in the handler\n",
+             hits, BENCH_IRQ_ROUNDS, cycles / BENCH_IRQ_ROUNDS,
+             hits ? stats->cycles[BENCH_IRQ_VECTOR] / hits : 0);
+    bench_emit(line);
+    irq_print_stats();
+}
+
+// Stands in for a driver's real work, what a keyboard or NIC handler
+// would do with its data once it is off the device
+static void bench_softirq_work(void* data)
+{
+    char buf[160];
+    uint64_t* done = data;
+    for (int i = 0; i < BENCH_SOFTIRQ_LINES; i++)
+        snprintf(buf, sizeof(buf), BENCH_LOG_FORMAT, BENCH_LOG_ARGS(*done + i));
+    (*done)++;
+}
+
+static tasklet_t bench_tasklet = TASKLET_INIT(bench_softirq_work, NULL);
+
+static bool bench_softirq_inline(uint8_t vector, void* data)
+{
+    (void)vector;
+    bench_softirq_work(data);
+    return true;
+}
+
+static bool bench_softirq_deferred(uint8_t vector, void* data)
+{
+    (void)vector;
+    (void)data;
+    tasklet_schedule(&bench_tasklet);
+    return true;
+}
+
+static uint64_t bench_softirq_raise(uint8_t vector)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SOFTIRQ_ROUNDS; i++)
+    {
+        if (vector == BENCH_SOFTIRQ_INLINE)
+            __asm__ volatile("int %0" : : "i"(BENCH_SOFTIRQ_INLINE) : "memory");
+        else
+            __asm__ volatile("int %0" : : "i"(BENCH_SOFTIRQ_DEFERRED) : "memory");
+    }
+    return (rdtsc() - start) / BENCH_SOFTIRQ_ROUNDS;
+}
+
+// Longest stretch with interrupts off for the same work done in the
+// handler or in a tasklet after the EOI. Interrupts are turned on for
+// the run, softirqs only follow interrupts that arrived with them on
+void bench_softirq()
+{
+    char line[160];
+    static uint64_t inline_done = 0, deferred_done = 0;
+    bench_tasklet.data = &deferred_done;
+    if (!request_irq(BENCH_SOFTIRQ_INLINE, bench_softirq_inline, &inline_done, "bench-inline", 0) ||
+        !request_irq(BENCH_SOFTIRQ_DEFERRED, bench_softirq_deferred, &deferred_done, "bench-deferred", 0))
+    {
+        free_irq(BENCH_SOFTIRQ_INLINE, &inline_done);
+        bench_emit("softirq: bench vectors are taken\n");
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    __asm__ volatile("sti");
+    uint64_t inline_cycles = bench_softirq_raise(BENCH_SOFTIRQ_INLINE);
+    uint64_t deferred_cycles = bench_softirq_raise(BENCH_SOFTIRQ_DEFERRED);
+    // irq_restore only ever turns interrupts on, boot expects them off again
+    __asm__ volatile("cli" ::: "memory");
+    irq_restore(flags);
+    free_irq(BENCH_SOFTIRQ_INLINE, &inline_done);
+    free_irq(BENCH_SOFTIRQ_DEFERRED, &deferred_done);
+
+    const irq_stats_t* stats = irq_stats(cpu_id());
+    const softirq_cpu_t* soft = softirq_stats(cpu_id());
+    snprintf(line, sizeof(line), "softirq: irqs-off max %llu cycles inline, %llu deferred; round trip %llu vs %llu cycles\n",
+             stats->max[BENCH_SOFTIRQ_INLINE], stats->max[BENCH_SOFTIRQ_DEFERRED], inline_cycles, deferred_cycles);
+    bench_emit(line);
+    snprintf(line, sizeof(line), "softirq: %llu of %d tasklets ran, %llu tasklet passes, %llu cycles max, %llu left for idle\n",
+             deferred_done, BENCH_SOFTIRQ_ROUNDS, soft->runs[SOFTIRQ_TASKLET], soft->max[SOFTIRQ_TASKLET],
+             soft->deferred);
+    bench_emit(line);
+}
+
+void run_benchmarks()
+{
+    bench_pmm();
+    bench_slab();
+    bench_pcid();
+    bench_vga();
+    bench_fault();
+    bench_cow();
+    bench_format();
+    bench_console();
+    bench_fb();
+    bench_irq();
+    bench_softirq();
+}
@@ -1,9 +1,22 @@
 #include "../interrupt_handler.h"
 #include "../../../libk/io.h"
+#include "../../../libk/slab.h"
+#include "../../../libk/spinlock.h"
 #include "../../../drivers/port.h"
 #include "../../../drivers/init.h"
 #include "../../../drivers/timer.h"
 #include "../../../drivers/paging.h"
+#include "../../../drivers/cpu.h"
+#include "../../../drivers/ioapic.h"
+#include "../stack.h"
+#include "../vma.h"
+#include "../klog.h"
+#include "../softirq.h"
+
+// Scancodes go from keyboard_irq to keyboard_bottom through a ring
+#define KBD_DATA_PORT 0x60
+#define KBD_RING 64
+#define KBD_RING_MASK (KBD_RING - 1)
 
 static const char scancode_to_ascii[] = {
     0,   // 0x00 - Error or NULL
@@ -93,12 +106,13 @@ static const char* exception_messages[] = {
 // Common exception handler
 static void exception_handler(const char* message, interrupt_frame_t* frame)
 {
-    printf("EXCEPTION: %s\n", message);
-    printf("RIP: 0x%llx\n", frame->ip);
-    printf("CS:  0x%llx\n", frame->cs);
-    printf("RFLAGS: 0x%llx\n", frame->flags);
-    printf("RSP: 0x%llx\n", frame->sp);
-    printf("SS:  0x%llx\n", frame->ss);
+    klog(KLOG_EMERG, "EXCEPTION: %s\n", message);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog(KLOG_EMERG, "CS:  0x%016llx\n", frame->cs);
+    klog(KLOG_EMERG, "RFLAGS: 0x%016llx\n", frame->flags);
+    klog(KLOG_EMERG, "RSP: 0x%016llx\n", frame->sp);
+    klog(KLOG_EMERG, "SS:  0x%016llx\n", frame->ss);
+    klog_panic_flush();
     for(;;) __asm__("hlt");
 }
 
@@ -114,7 +128,7 @@ void exception_debug(interrupt_frame_t* frame)
 
 void exception_nmi(interrupt_frame_t* frame) 
 {
-    printf("NMI Interrupt\n");
+    klog(KLOG_CRIT, "NMI Interrupt\n");
 }
 
 void exception_breakpoint(interrupt_frame_t* frame) 
@@ -144,8 +158,15 @@ void exception_device_not_available(interrupt_frame_t* frame)
 
 void exception_double_fault(interrupt_frame_t* frame, uint64_t error) 
 {
-    printf("EXCEPTION: Double Fault (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    uint64_t fault_addr;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(fault_addr));
+
+    klog(KLOG_EMERG, "EXCEPTION: Double Fault (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    // A #PF on a guard page can't push its frame and escalates here
+    if (stack_guard_hit(fault_addr))
+        klog(KLOG_EMERG, "Kernel stack overflow at 0x%016llx\n", fault_addr);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
@@ -157,32 +178,36 @@ void exception_coprocessor_segment(interrupt_frame_t* frame)
 
 void exception_invalid_tss(interrupt_frame_t* frame, uint64_t error)
 {
-    printf("EXCEPTION: Invalid TSS (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: Invalid TSS (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
 
 void exception_segment_not_present(interrupt_frame_t* frame, uint64_t error)
 {
-    printf("EXCEPTION: Segment Not Present (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: Segment Not Present (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
 
 void exception_stack_segment(interrupt_frame_t* frame, uint64_t error)
 {
-    printf("EXCEPTION: Stack Segment Fault (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: Stack Segment Fault (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
 
 void exception_general_protection(interrupt_frame_t* frame, uint64_t error)
 {
-    printf("EXCEPTION: General Protection Fault (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: General Protection Fault (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
@@ -191,34 +216,56 @@ void exception_page_fault(interrupt_frame_t* frame, uint64_t error)
 {
     uint64_t fault_addr;
     __asm__ volatile("mov %%cr2, %0" : "=r"(fault_addr));
+
+    // Demand-zero and zero page faults are resolved and retried
+    if (vma_handle_fault(fault_addr, error))
+        return;
     
-    printf("PAGE FAULT\n");
-    printf("Error code: %llx\n", error);
-    printf("Fault address: %llx\n", fault_addr);
-    printf("RIP: %llx\n", frame->ip);
+    klog(KLOG_EMERG, "PAGE FAULT\n");
+    klog(KLOG_EMERG, "Error code: 0x%016llx\n", error);
+    klog(KLOG_EMERG, "Fault address: 0x%016llx\n", fault_addr);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
     
-    printf("Fault details:\n");
+    klog(KLOG_EMERG, "Fault details:\n");
     if (!(error & 0x1)) 
+        klog(KLOG_EMERG, "- Page not present\n");
+    if (stack_guard_hit(fault_addr))
+        klog(KLOG_EMERG, "- Kernel stack guard page, stack overflow\n");
+
+    // Walk the tables through the physmap, stopping at huge pages
+    uint64_t pml4_idx = PML4_INDEX(fault_addr);
+    uint64_t pdp_idx = PDP_INDEX(fault_addr);
+    uint64_t pd_idx = PD_INDEX(fault_addr);
+    uint64_t pt_idx = PT_INDEX(fault_addr);
+
+    page_tb_t* pml4 = current_pml4();
+    uint64_t entry = pml4->entries[pml4_idx];
+    klog(KLOG_EMERG, "PML4[%d] = 0x%016llx\n", (int)pml4_idx, entry);
+    
+    if (entry & PAGE_PRESENT)
     {
-        printf("- Page not present\n");
-        
-        uint64_t pml4_idx = (fault_addr >> 39) & 0x1FF;
-        uint64_t pdp_idx = (fault_addr >> 30) & 0x1FF;
-        uint64_t pd_idx = (fault_addr >> 21) & 0x1FF;
-        
-        page_tb_t* pml4 = (page_tb_t*)0x1000;
-        printf("PML4[%d] = %llx\n", pml4_idx, pml4->entries[pml4_idx]);
-        
-        if (pml4->entries[pml4_idx] & PAGE_PRESENT)
+        page_tb_t* pdp = PHYS_TO_VIRT(entry & PAGE_ADDR_MASK);
+        entry = pdp->entries[pdp_idx];
+        klog(KLOG_EMERG, "PDP[%d] = 0x%016llx\n", (int)pdp_idx, entry);
+
+        if ((entry & PAGE_PRESENT) && !(entry & PAGE_HUGE))
         {
-            page_tb_t* pdp = (page_tb_t*)(pml4->entries[pml4_idx] & ~0xFFF);
-            printf("PDP[%d] = %llx\n", pdp_idx, pdp->entries[pdp_idx]);
+            page_tb_t* pd = PHYS_TO_VIRT(entry & PAGE_ADDR_MASK);
+            entry = pd->entries[pd_idx];
+            klog(KLOG_EMERG, "PD[%d] = 0x%016llx\n", (int)pd_idx, entry);
+
+            if ((entry & PAGE_PRESENT) && !(entry & PAGE_HUGE))
+            {
+                page_tb_t* pt = PHYS_TO_VIRT(entry & PAGE_ADDR_MASK);
+                klog(KLOG_EMERG, "PT[%d] = 0x%016llx\n", (int)pt_idx, pt->entries[pt_idx]);
+            }
         }
     }
-    printf("\nAttempted access near:\n");
-    printf("Page aligned address: %llx\n", fault_addr & ~0xFFF);
-    printf("Offset in page: %x\n", fault_addr & 0xFFF);
+    klog(KLOG_EMERG, "Attempted access near:\n");
+    klog(KLOG_EMERG, "Page aligned address: 0x%016llx\n", fault_addr & ~0xFFF);
+    klog(KLOG_EMERG, "Offset in page: 0x%llx\n", fault_addr & 0xFFF);
     
+    klog_panic_flush();
     while(1) 
         __asm__("hlt");
 }
@@ -230,8 +277,9 @@ void exception_x87_float(interrupt_frame_t* frame)
 
 void exception_alignment_check(interrupt_frame_t* frame, uint64_t error)
 {
-    printf("EXCEPTION: Alignment Check (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: Alignment Check (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
@@ -253,24 +301,97 @@ void exception_virtualization(interrupt_frame_t* frame)
 
 void exception_security(interrupt_frame_t* frame, uint64_t error) 
 {
-    printf("EXCEPTION: Security Exception (Error: %llx)\n", error);
-    printf("RIP: 0x%llx\n", frame->ip);
+    klog(KLOG_EMERG, "EXCEPTION: Security Exception (Error: 0x%016llx)\n", error);
+    klog(KLOG_EMERG, "RIP: 0x%016llx\n", frame->ip);
+    klog_panic_flush();
     while (true) 
         __asm__("hlt");
 }
 
+// Exceptions keep their own entry points, some push an error code and
+// the ones that must run on a known good stack switch to an IST stack
+static const struct
+{
+    uint8_t vector;
+    void* handler;
+    uint8_t ist;
+} exception_gates[] = {
+    { 0, exception_div_by_zero, IST_NONE },
+    { 1, exception_debug, IST_NONE },
+    { 2, exception_nmi, IST_NMI },
+    { 3, exception_breakpoint, IST_NONE },
+    { 4, exception_overflow, IST_NONE },
+    { 5, exception_bound_range, IST_NONE },
+    { 6, exception_invalid_opcode, IST_NONE },
+    { 7, exception_device_not_available, IST_NONE },
+    { 8, exception_double_fault, IST_DOUBLE_FAULT },
+    { 9, exception_coprocessor_segment, IST_NONE },
+    { 10, exception_invalid_tss, IST_NONE },
+    { 11, exception_segment_not_present, IST_NONE },
+    { 12, exception_stack_segment, IST_STACK_FAULT },
+    { 13, exception_general_protection, IST_NONE },
+    { 14, exception_page_fault, IST_NONE },
+    { 16, exception_x87_float, IST_NONE },
+    { 17, exception_alignment_check, IST_NONE },
+    { 18, exception_machine_check, IST_NONE },
+    { 19, exception_simd_float, IST_NONE },
+    { 20, exception_virtualization, IST_NONE },
+    { 30, exception_security, IST_NONE },
+};
+
+// Entry stubs for IRQ_FIRST_VECTOR and up, from entry.asm
+extern const uint64_t irq_stubs[IRQ_VECTORS - IRQ_FIRST_VECTOR];
+
+static uint8_t kbd_ring[KBD_RING];
+static volatile uint32_t kbd_head = 0;
+static volatile uint32_t kbd_tail = 0;
+
+static irq_action_t* irq_actions[IRQ_VECTORS];
+static irq_stats_t irq_cpu_stats[MAX_CPUS];
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
 static inline void pic_send_eoi(unsigned char irq) 
 {
     if(irq >= 8)
-        outb(0xA0, 0x20);    // Send EOI to slave PIC
-    outb(0x20, 0x20);        // Send EOI to master PIC
-}
-
+        outb(PIC2_CMD, PIC_EOI);    // Send EOI to slave PIC
+    outb(PIC1_CMD, PIC_EOI);        // Send EOI to master PIC
+}
+
+// The BIOS leaves the 8259s on vectors 8-15, over the exceptions. Move
+// them past those and mask every line, drivers unmask theirs
+static void init_pic()
+{
+    outb(PIC1_CMD, 0x11);                   // ICW1: init, ICW4 follows
+    io_wait();
+    outb(PIC2_CMD, 0x11);
+    io_wait();
+    outb(PIC1_DATA, PIC_IRQ_BASE);          // ICW2: vector offsets
+    io_wait();
+    outb(PIC2_DATA, PIC_IRQ_BASE + 8);
+    io_wait();
+    outb(PIC1_DATA, 1 << PIC_CASCADE);      // ICW3: slave on IRQ 2
+    io_wait();
+    outb(PIC2_DATA, PIC_CASCADE);
+    io_wait();
+    outb(PIC1_DATA, 0x01);                  // ICW4: 8086 mode
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+    outb(PIC1_DATA, 0xFF & ~(1 << PIC_CASCADE));
+    outb(PIC2_DATA, 0xFF);
+}
+
+// Once the I/O APIC has taken over, the legacy lines are its ISA pins
 void enable_irq(uint8_t irq) 
 {
     uint16_t port;
     uint8_t value;
     
+    if (ioapic_active())
+    {
+        ioapic_unmask(isa_irq_gsi(irq));
+        return;
+    }
     if(irq < 8) 
     {
         port = PIC1_DATA;
@@ -289,6 +410,11 @@ void disable_irq(uint8_t irq)
     uint16_t port;
     uint8_t value;
     
+    if (ioapic_active())
+    {
+        ioapic_mask(isa_irq_gsi(irq));
+        return;
+    }
     if(irq < 8) 
     {
         port = PIC1_DATA;
@@ -302,173 +428,268 @@ void disable_irq(uint8_t irq)
     outb(port, value);
 }
 
-// IRQ Handlers
-void irq0_handler(interrupt_frame_t* frame)
-{
-    timer_tick();
-    pic_send_eoi(0);
-}
-
-void irq1_handler(interrupt_frame_t* frame)
-{
-    uint8_t scancode = inb(0x60);
-    
-    // Check if it's a key press (not a release)
-    if (!(scancode & 0x80)) 
+/**
+ * Chain a handler on a vector. Legacy lines are unmasked with the first
+ * handler, on the PIC or the I/O APIC, other vectors are the caller's
+ * to program
+ * @param vector: IRQ_VECTOR(line), TIMER_VECTOR or another device vector
+ * @param handler: Called with interrupts off on every hit of the vector
+ * @param data: Passed to handler, and what free_irq matches on
+ * @param name: For irq_print_stats
+ * @param flags: IRQF_SHARED if other handlers may chain on the vector
+ * @return: false if the vector is taken without IRQF_SHARED on both sides
+ */
+bool request_irq(uint8_t vector, irq_handler_t handler, void* data, const char* name, uint32_t flags)
+{
+    if (vector < IRQ_FIRST_VECTOR || vector == SPURIOUS_VECTOR || !handler)
+        return false;
+    irq_action_t* action = kmalloc(sizeof(irq_action_t));
+    if (!action)
+        return false;
+    action->handler = handler;
+    action->data = data;
+    action->name = name;
+    action->flags = flags;
+    action->next = NULL;
+
+    uint64_t rflags = irq_save();
+    spin_lock(&irq_lock);
+    irq_action_t** link = &irq_actions[vector];
+    bool first = *link == NULL;
+    if (!first && (!(flags & IRQF_SHARED) || !((*link)->flags & IRQF_SHARED)))
     {
-        if (scancode < sizeof(scancode_to_ascii) && scancode_to_ascii[scancode] != 0)
-            printf("%c", scancode_to_ascii[scancode]);
+        spin_unlock(&irq_lock);
+        irq_restore(rflags);
+        kfree(action);
+        return false;
+    }
+    while (*link)
+        link = &(*link)->next;
+    // The dispatcher walks the chain without the lock
+    __atomic_store_n(link, action, __ATOMIC_RELEASE);
+    if (first && vector >= IRQ_VECTOR(0) && vector < IRQ_VECTOR(PIC_IRQS))
+        enable_irq(vector - PIC_IRQ_BASE);
+    spin_unlock(&irq_lock);
+    irq_restore(rflags);
+    return true;
+}
+
+/**
+ * Take a handler off its vector, masking a legacy line once it has none.
+ * Interrupts are only taken on this CPU, and it unlinks with them off,
+ * so no dispatcher can still be walking the action it frees
+ * @param vector: Vector it was requested on
+ * @param data: data it was requested with
+ * @return: false if no such handler
+ */
+bool free_irq(uint8_t vector, void* data)
+{
+    uint64_t rflags = irq_save();
+    spin_lock(&irq_lock);
+    irq_action_t** link = &irq_actions[vector];
+    while (*link && (*link)->data != data)
+        link = &(*link)->next;
+    irq_action_t* action = *link;
+    if (action)
+    {
+        __atomic_store_n(link, action->next, __ATOMIC_RELEASE);
+        if (!irq_actions[vector] && vector >= IRQ_VECTOR(0) && vector < IRQ_VECTOR(PIC_IRQS))
+            disable_irq(vector - PIC_IRQ_BASE);
+    }
+    spin_unlock(&irq_lock);
+    irq_restore(rflags);
+
+    if (!action)
+        return false;
+    kfree(action);
+    return true;
+}
+
+// A line that drops before the 8259 sends its vector shows up as IRQ 7
+// or 15 with nothing in service. The slave's still needs the master's EOI
+static bool pic_spurious(uint8_t irq)
+{
+    if ((irq & 7) != 7)
+        return false;
+    uint16_t cmd = irq < 8 ? PIC1_CMD : PIC2_CMD;
+    outb(cmd, PIC_READ_ISR);
+    if (inb(cmd) & 0x80)
+        return false;
+    if (irq >= 8)
+        outb(PIC1_CMD, PIC_EOI);
+    return true;
+}
+
+static inline uint32_t hist_bucket(uint64_t cycles)
+{
+    int bit = 63 - __builtin_clzll(cycles | 1);
+    if (bit < IRQ_HIST_SHIFT)
+        return 0;
+    if (bit - IRQ_HIST_SHIFT >= IRQ_HIST_BUCKETS)
+        return IRQ_HIST_BUCKETS - 1;
+    return bit - IRQ_HIST_SHIFT;
+}
+
+/**
+ * Run every handler chained on a vector, from irq_common in entry.asm,
+ * acknowledge it with whichever controller raised it, then leave the
+ * deferred work to irq_exit with interrupts back on
+ * @param vector: IRQ_FIRST_VECTOR to 255
+ * @param frame: Where the interrupt came from
+ */
+void irq_dispatch(uint64_t vector, interrupt_frame_t* frame)
+{
+    uint64_t start = rdtsc();
+    irq_stats_t* stats = &irq_cpu_stats[cpu_id()];
+    // Behind the I/O APIC a local APIC EOI acknowledges everything
+    bool pic = !ioapic_active() && vector >= IRQ_VECTOR(0) && vector < IRQ_VECTOR(PIC_IRQS);
+    if (pic && pic_spurious(vector - PIC_IRQ_BASE))
+    {
+        stats->unhandled[vector]++;
+        return;
     }
-    pic_send_eoi(1);
-}
-
-// Default handler for other IRQs
-static void default_irq_handler(int irq, interrupt_frame_t* frame) 
-{
-    pic_send_eoi(irq);
-}
-
-// Generate handlers for remaining IRQs
-void irq2_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(2, frame); 
-}
-
-void irq3_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(3, frame); 
-}
 
-void irq4_handler(interrupt_frame_t* frame) 
-{
-    default_irq_handler(4, frame); 
-}
+    bool handled = false;
+    irq_action_t* action = __atomic_load_n(&irq_actions[vector], __ATOMIC_ACQUIRE);
+    for (; action; action = __atomic_load_n(&action->next, __ATOMIC_ACQUIRE))
+        handled |= action->handler(vector, action->data);
 
-void irq5_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(5, frame); 
-}
+    if (pic)
+        pic_send_eoi(vector - PIC_IRQ_BASE);
+    else if (vector != SPURIOUS_VECTOR)
+        apic_write(APIC_EOI, 0);
 
-void irq6_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(6, frame); 
-}
+    uint64_t cycles = rdtsc() - start;
+    stats->count[vector]++;
+    stats->cycles[vector] += cycles;
+    if (cycles > stats->max[vector])
+        stats->max[vector] = cycles;
+    stats->hist[vector][hist_bucket(cycles)]++;
+    if (!handled)
+        stats->unhandled[vector]++;
 
-void irq7_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(7, frame); 
+    irq_exit(frame->flags & RFLAGS_IF);
 }
 
-void irq8_handler(interrupt_frame_t* frame)
+/**
+ * Hit counts and handler time one CPU has seen, per vector
+ * @param cpu: cpu_id() of the CPU
+ * @return: NULL past MAX_CPUS
+ */
+const irq_stats_t* irq_stats(uint32_t cpu)
 {
-    default_irq_handler(8, frame); 
+    return cpu < MAX_CPUS ? &irq_cpu_stats[cpu] : NULL;
 }
 
-void irq9_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(9, frame); 
-}
-
-void irq10_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(10, frame); 
-}
-
-void irq11_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(11, frame);
-}
-
-void irq12_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(12, frame); 
+/**
+ * Print every vector that fired, summed over the CPUs, with the
+ * handlers chained on it and the mean and worst cycles per call, the
+ * worst also as the histogram bucket it fell in
+ */
+void irq_print_stats()
+{
+    for (int vector = IRQ_FIRST_VECTOR; vector < IRQ_VECTORS; vector++)
+    {
+        uint64_t count = 0, cycles = 0, max = 0, unhandled = 0;
+        int worst = -1;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        {
+            const irq_stats_t* stats = &irq_cpu_stats[cpu];
+            count += stats->count[vector];
+            cycles += stats->cycles[vector];
+            unhandled += stats->unhandled[vector];
+            if (stats->max[vector] > max)
+                max = stats->max[vector];
+            for (int b = IRQ_HIST_BUCKETS - 1; b > worst; b--)
+            {
+                if (stats->hist[vector][b])
+                {
+                    worst = b;
+                    break;
+                }
+            }
+        }
+        if (!count && !unhandled)
+            continue;
+
+        printf("IRQ %3d: %llu hits, %llu unhandled, %llu cycles avg, %llu max", vector, count, unhandled,
+               count ? cycles / count : 0, max);
+        if (worst == IRQ_HIST_BUCKETS - 1)
+            printf(", worst >= %llu cycles", 1ULL << (worst + IRQ_HIST_SHIFT));
+        else if (worst >= 0)
+            printf(", worst < %llu cycles", 1ULL << (worst + IRQ_HIST_SHIFT + 1));
+        for (irq_action_t* action = irq_actions[vector]; action; action = action->next)
+            printf(", %s", action->name);
+        printf("\n");
+    }
 }
 
-void irq13_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(13, frame); 
+// The top half only takes the scancode off the controller, the tasklet
+// translates and logs it with interrupts enabled
+static void keyboard_bottom(void* data)
+{
+    (void)data;
+    uint32_t tail = kbd_tail;
+    uint32_t head = __atomic_load_n(&kbd_head, __ATOMIC_ACQUIRE);
+    while (tail != head)
+    {
+        uint8_t scancode = kbd_ring[tail++ & KBD_RING_MASK];
+        // Check if it's a key press (not a release)
+        if (!(scancode & 0x80) && scancode < sizeof(scancode_to_ascii) && scancode_to_ascii[scancode] != 0)
+            klog_write(KLOG_INFO | KLOG_CONT, &scancode_to_ascii[scancode], 1);
+    }
+    __atomic_store_n(&kbd_tail, tail, __ATOMIC_RELEASE);
 }
 
-void irq14_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(14, frame); 
-}
+static tasklet_t keyboard_tasklet = TASKLET_INIT(keyboard_bottom, NULL);
 
-void irq15_handler(interrupt_frame_t* frame) 
-{ 
-    default_irq_handler(15, frame); 
+static bool keyboard_irq(uint8_t vector, void* data)
+{
+    (void)vector;
+    (void)data;
+    uint8_t scancode = inb(KBD_DATA_PORT);
+    uint32_t head = kbd_head;
+    if (head - __atomic_load_n(&kbd_tail, __ATOMIC_ACQUIRE) < KBD_RING)
+        kbd_ring[head++ & KBD_RING_MASK] = scancode;
+    __atomic_store_n(&kbd_head, head, __ATOMIC_RELEASE);
+    tasklet_schedule(&keyboard_tasklet);
+    return true;
 }
 
-static uint8_t* allocate_stack(size_t size)
+// Without these stacks the first NMI or double fault would run on RSP 0
+// and triple fault, so boot stops here with the reason on the console
+static uint64_t critical_stack(const char* use)
 {
-    // Will replace the static allocation with a dynamic one later
-    static uint8_t stack1[16384];
-    static uint8_t stack2[16384];
-    static uint8_t stack3[16384];
-    static int current_stack = 0;
-    
-    switch(current_stack++)
+    void* top = stack_alloc();
+    if (!top)
     {
-        case 0: 
-            return stack1;
-        case 1: 
-            return stack2;
-        case 2:
-            return stack3;
-        default: 
-            return NULL;
+        klog(KLOG_EMERG, "No stack for %s, halting\n", use);
+        klog_panic_flush();
+        while (true)
+            __asm__("hlt");
     }
+    return (uint64_t)top;
 }
 
 void init_interrupt_handlers() 
 {
-    // Set up CPU exception handlers (0-31)
-    idt_set_gate(0, (uint64_t)exception_div_by_zero, 0x08, 0x8E, 0);
-    idt_set_gate(1, (uint64_t)exception_debug, 0x08, 0x8E, 0);
-    idt_set_gate(2, (uint64_t)exception_nmi, 0x08, 0x8E, IST_NMI);         // Use IST for NMI
-    idt_set_gate(3, (uint64_t)exception_breakpoint, 0x08, 0x8E, 0);
-    idt_set_gate(4, (uint64_t)exception_overflow, 0x08, 0x8E, 0);
-    idt_set_gate(5, (uint64_t)exception_bound_range, 0x08, 0x8E, 0);
-    idt_set_gate(6, (uint64_t)exception_invalid_opcode, 0x08, 0x8E, 0);
-    idt_set_gate(7, (uint64_t)exception_device_not_available, 0x08, 0x8E, 0);
-    idt_set_gate(8, (uint64_t)exception_double_fault, 0x08, 0x8E, IST_DOUBLE_FAULT); // Use IST
-    idt_set_gate(9, (uint64_t)exception_coprocessor_segment, 0x08, 0x8E, 0);
-    idt_set_gate(10, (uint64_t)exception_invalid_tss, 0x08, 0x8E, 0);
-    idt_set_gate(11, (uint64_t)exception_segment_not_present, 0x08, 0x8E, 0);
-    idt_set_gate(12, (uint64_t)exception_stack_segment, 0x08, 0x8E, IST_STACK_FAULT); // Use IST
-    idt_set_gate(13, (uint64_t)exception_general_protection, 0x08, 0x8E, 0);
-    idt_set_gate(14, (uint64_t)exception_page_fault, 0x08, 0x8E, 0);
-    idt_set_gate(16, (uint64_t)exception_x87_float, 0x08, 0x8E, 0);
-    idt_set_gate(17, (uint64_t)exception_alignment_check, 0x08, 0x8E, 0);
-    idt_set_gate(18, (uint64_t)exception_machine_check, 0x08, 0x8E, 0);
-    idt_set_gate(19, (uint64_t)exception_simd_float, 0x08, 0x8E, 0);
-    idt_set_gate(20, (uint64_t)exception_virtualization, 0x08, 0x8E, 0);
-    idt_set_gate(30, (uint64_t)exception_security, 0x08, 0x8E, 0);
-
-    // Set up IRQ handlers (32-47)
-    idt_set_gate(32, (uint64_t)irq0_handler, 0x08, 0x8E, 0);  // Timer
-    idt_set_gate(33, (uint64_t)irq1_handler, 0x08, 0x8E, 0);  // Keyboard
-    idt_set_gate(34, (uint64_t)irq2_handler, 0x08, 0x8E, 0);  // Cascade
-    idt_set_gate(35, (uint64_t)irq3_handler, 0x08, 0x8E, 0);  // COM2
-    idt_set_gate(36, (uint64_t)irq4_handler, 0x08, 0x8E, 0);  // COM1
-    idt_set_gate(37, (uint64_t)irq5_handler, 0x08, 0x8E, 0);  // LPT2
-    idt_set_gate(38, (uint64_t)irq6_handler, 0x08, 0x8E, 0);  // Floppy
-    idt_set_gate(39, (uint64_t)irq7_handler, 0x08, 0x8E, 0);  // LPT1
-    idt_set_gate(40, (uint64_t)irq8_handler, 0x08, 0x8E, 0);  // CMOS RTC
-    idt_set_gate(41, (uint64_t)irq9_handler, 0x08, 0x8E, 0);  // Free
-    idt_set_gate(42, (uint64_t)irq10_handler, 0x08, 0x8E, 0); // Free
-    idt_set_gate(43, (uint64_t)irq11_handler, 0x08, 0x8E, 0); // Free
-    idt_set_gate(44, (uint64_t)irq12_handler, 0x08, 0x8E, 0); // PS/2 Mouse
-    idt_set_gate(45, (uint64_t)irq13_handler, 0x08, 0x8E, 0); // FPU
-    idt_set_gate(46, (uint64_t)irq14_handler, 0x08, 0x8E, 0); // Primary ATA
-    idt_set_gate(47, (uint64_t)irq15_handler, 0x08, 0x8E, 0); // Secondary ATA
-
-    // Set up IST stacks for critical interrupts
-    uint8_t* nmi_stack = allocate_stack(16384);        // 16KB stack
-    uint8_t* df_stack = allocate_stack(16384);         // 16KB stack
-    uint8_t* sf_stack = allocate_stack(16384);         // 16KB stack
-
-    set_ist(IST_NMI, (uint64_t)nmi_stack + 16384);           // Stack grows down
-    set_ist(IST_DOUBLE_FAULT, (uint64_t)df_stack + 16384);
-    set_ist(IST_STACK_FAULT, (uint64_t)sf_stack + 16384);
+    for (size_t i = 0; i < sizeof(exception_gates) / sizeof(exception_gates[0]); i++)
+        idt_set_gate(exception_gates[i].vector, (uint64_t)exception_gates[i].handler, 0x08, 0x8E,
+                     exception_gates[i].ist);
+
+    // Every device vector goes through a stub in entry.asm to irq_dispatch
+    for (int vector = IRQ_FIRST_VECTOR; vector < IRQ_VECTORS; vector++)
+        idt_set_gate(vector, irq_stubs[vector - IRQ_FIRST_VECTOR], 0x08, 0x8E, 0);
+
+    // Guarded IST stacks for critical interrupts, an overflow faults
+    // instead of running into whatever sits below
+    set_ist(IST_NMI, critical_stack("NMI"));
+    set_ist(IST_DOUBLE_FAULT, critical_stack("double fault"));
+    set_ist(IST_STACK_FAULT, critical_stack("stack fault"));
+
+    // This CPU's stack for interrupts arriving from ring 3
+    set_kernel_stack(critical_stack("ring 0 entry"));
+
+    init_pic();
+    request_irq(IRQ_VECTOR(1), keyboard_irq, NULL, "keyboard", 0);
 }
\ No newline at end of file
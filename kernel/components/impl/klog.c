@@ -0,0 +1,361 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../klog.h"
+#include "../../../libk/io.h"
+#include "../../../libk/memory.h"
+#include "../../../libk/spinlock.h"
+#include "../../../drivers/timer.h"
+#include "../../../drivers/serial.h"
+
+#define KLOG_ALIGN 8
+#define KLOG_MASK (KLOG_RING_SIZE - 1)
+#define KLOG_BATCH 2048               // Flusher output per console write
+#define KLOG_LINE_MAX (KLOG_TEXT_MAX + 64)
+
+klog_ring_t klog_rings[MAX_CPUS];
+
+static const char* level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+};
+
+// One record copied out of a ring, safe to format at leisure
+typedef struct
+{
+    klog_record_t header;
+    char text[KLOG_TEXT_MAX];
+} klog_entry_t;
+
+// Flusher state, only one flush runs at a time
+static volatile uint8_t klog_flushing = 0;
+static char klog_batch[KLOG_BATCH];
+static size_t klog_batch_len = 0;
+static klog_entry_t klog_entry;
+
+static inline klog_record_t* record_at(klog_ring_t* ring, uint64_t pos)
+{
+    return (klog_record_t*)&ring->data[pos & KLOG_MASK];
+}
+
+void init_klog()
+{
+    for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        klog_rings[i].magic = KLOG_MAGIC;
+        klog_rings[i].cpu = i;
+    }
+}
+
+/**
+ * Push tail past the oldest records until the ring holds nothing before
+ * need. An unfinished record can't be overwritten, its writer is
+ * interrupted somewhere below us
+ * @param ring: This CPU's ring
+ * @param need: Ring position that has to become free
+ * @return: false if the oldest record is still being written
+ */
+static bool klog_make_room(klog_ring_t* ring, uint64_t need)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while ((int64_t)(need - tail) > 0)
+    {
+        klog_record_t* rec = record_at(ring, tail);
+        uint64_t tag = __atomic_load_n(&rec->tag, __ATOMIC_ACQUIRE);
+        if ((tag & ~(uint64_t)KLOG_STATE_MASK) != tail || (tag & KLOG_STATE_MASK) == KLOG_RESERVED)
+            return false;
+
+        // A nested producer may push it first, then carry on from there
+        uint64_t next = tail + rec->size;
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, next, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            tail = next;
+    }
+    return true;
+}
+
+// Moves head and takes a sequence number in one step. Done apart, an
+// NMI landing in between would get a later slot with an earlier number
+static inline bool klog_claim(klog_ring_t* ring, uint64_t head, uint64_t seq, uint64_t new_head)
+{
+    bool done;
+    __asm__ volatile("lock cmpxchg16b %1"
+                     : "=@ccz"(done), "+m"(ring->claim), "+a"(head), "+d"(seq)
+                     : "b"(new_head), "c"(seq + 1)
+                     : "memory");
+    return done;
+}
+
+/**
+ * Claim size bytes on a ring. Callers have interrupts off, so only an
+ * NMI or an exception can nest here and the head CAS gives each its own
+ * slot. Records never wrap, the end of the ring becomes a pad record
+ * @param ring: This CPU's ring
+ * @param size: Record size, 8-byte aligned
+ * @param seq: Set to the record's sequence number
+ * @return: The reserved record, NULL if the ring could not make room
+ */
+static klog_record_t* klog_reserve(klog_ring_t* ring, size_t size, uint64_t* seq)
+{
+    uint64_t head;
+    uint64_t start;
+    do
+    {
+        // A nested producer between the two loads makes the claim fail
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        *seq = __atomic_load_n(&ring->seq, __ATOMIC_RELAXED);
+        uint64_t pos = head & KLOG_MASK;
+        start = pos + size > KLOG_RING_SIZE ? head + KLOG_RING_SIZE - pos : head;
+        if (!klog_make_room(ring, start + size - KLOG_RING_SIZE))
+        {
+            // Still numbered, the gap tells the flusher a record is missing
+            __atomic_add_fetch(&ring->seq, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    while (!klog_claim(ring, head, *seq, start + size));
+
+    if (start != head)
+    {
+        klog_record_t* pad = record_at(ring, head);
+        pad->size = start - head;
+        __atomic_store_n(&pad->tag, head | KLOG_PAD, __ATOMIC_RELEASE);
+    }
+
+    // Size first, the panic path steps over unfinished records by it
+    klog_record_t* rec = record_at(ring, start);
+    rec->size = size;
+    __atomic_store_n(&rec->tag, start | KLOG_RESERVED, __ATOMIC_RELEASE);
+    return rec;
+}
+
+/**
+ * Log text without formatting it, from any context including interrupt
+ * handlers. Only the reservation runs with interrupts off, the copy and
+ * the console output happen later in the flusher
+ * @param level: KLOG_* level, or'ed with KLOG_CONT to skip the prefix
+ * @param text: Message, usually ending in a newline
+ * @param len: Bytes of text, cut to KLOG_TEXT_MAX
+ */
+void klog_write(int level, const char* text, size_t len)
+{
+    if (len > KLOG_TEXT_MAX)
+        len = KLOG_TEXT_MAX;
+    size_t size = (sizeof(klog_record_t) + len + KLOG_ALIGN - 1) & ~(size_t)(KLOG_ALIGN - 1);
+    uint64_t tsc = rdtsc();
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+    klog_ring_t* ring = &klog_rings[cpu];
+    uint64_t seq;
+    klog_record_t* rec = klog_reserve(ring, size, &seq);
+    irq_restore(flags);
+    if (!rec)
+        return;
+
+    rec->len = len;
+    rec->level = level;
+    rec->cpu = cpu;
+    rec->seq = seq;
+    rec->tsc = tsc;
+    memcpy(rec->text, text, len);
+    __atomic_store_n(&rec->tag, (rec->tag & ~(uint64_t)KLOG_STATE_MASK) | KLOG_COMMITTED,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Format and log a message, see klog_write
+ * @param level: KLOG_* level, or'ed with KLOG_CONT to skip the prefix
+ * @param fmt: Format string
+ */
+void klog(int level, const char* fmt, ...)
+{
+    char text[KLOG_TEXT_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    klog_write(level, text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+}
+
+/**
+ * Find the next record to print on a ring, skipping pad records and
+ * anything overwritten since the last look
+ * @param ring: Ring to look at
+ * @param panic: Also step over records whose writer never finished
+ * @return: The record at ring->read, NULL if there is none or it is
+ *          still being written
+ */
+static klog_record_t* klog_peek(klog_ring_t* ring, bool panic)
+{
+    while (true)
+    {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if ((int64_t)(tail - ring->read) > 0)
+            ring->read = tail;
+        if (ring->read == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        klog_record_t* rec = record_at(ring, ring->read);
+        uint64_t tag = __atomic_load_n(&rec->tag, __ATOMIC_ACQUIRE);
+        // Reserved, but the writer has not got to the tag yet
+        if ((tag & ~(uint64_t)KLOG_STATE_MASK) != ring->read)
+            return NULL;
+
+        switch (tag & KLOG_STATE_MASK)
+        {
+            case KLOG_COMMITTED:
+                return rec;
+            case KLOG_PAD:
+                ring->read += rec->size;
+                break;
+            default:
+                if (!panic)
+                    return NULL;
+                ring->read += rec->size;
+                break;
+        }
+    }
+}
+
+/**
+ * Copy a record out, then make sure no producer overwrote it meanwhile.
+ * Producers push tail past a record before reusing its space
+ * @return: false if the record was overwritten and is gone
+ */
+static bool klog_copy(klog_ring_t* ring, klog_record_t* rec, klog_entry_t* entry)
+{
+    uint64_t pos = ring->read;
+    entry->header = *rec;
+    size_t len = entry->header.len < KLOG_TEXT_MAX ? entry->header.len : KLOG_TEXT_MAX;
+    memcpy(entry->text, rec->text, len);
+    entry->header.len = len;
+    return (int64_t)(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - pos) <= 0;
+}
+
+static void klog_batch_flush()
+{
+    if (!klog_batch_len)
+        return;
+    console_write(CONSOLE_VGA, klog_batch, klog_batch_len);
+    // Without a screen the VGA console is serial already
+    if (console_sink(CONSOLE_SERIAL) != console_sink(CONSOLE_VGA))
+        console_write(CONSOLE_SERIAL, klog_batch, klog_batch_len);
+    klog_batch_len = 0;
+}
+
+static void klog_batch_add(const char* fmt, ...)
+{
+    if (KLOG_BATCH - klog_batch_len < KLOG_LINE_MAX)
+        klog_batch_flush();
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(klog_batch + klog_batch_len, KLOG_BATCH - klog_batch_len, fmt, args);
+    va_end(args);
+    klog_batch_len += (size_t)len < KLOG_BATCH - klog_batch_len ? (size_t)len : KLOG_BATCH - klog_batch_len - 1;
+}
+
+// Uptime prefix, raw cycles until the TSC has been calibrated
+static void klog_batch_prefix(const klog_record_t* header)
+{
+    uint64_t khz = get_tsc_khz();
+    const char* level = level_names[header->level & KLOG_LEVEL_MASK];
+    if (!khz)
+    {
+        klog_batch_add("[%llu] cpu%u %s: ", header->tsc, header->cpu, level);
+        return;
+    }
+
+    uint64_t us = header->tsc / khz * 1000 + header->tsc % khz * 1000 / khz;
+    klog_batch_add("[%5llu.%06llu] cpu%u %s: ", us / 1000000, us % 1000000, header->cpu, level);
+}
+
+/**
+ * Print records from every CPU in timestamp order until the rings are
+ * empty or the budget runs out. Output is collected into batches so each
+ * console sees a few large writes
+ * @param budget: Most records to print, 0 for no limit
+ * @param panic: Crash path, ignore a flush in progress and unfinished records
+ * @return: Number of records printed
+ */
+static size_t klog_drain(size_t budget, bool panic)
+{
+    size_t printed = 0;
+    while (!budget || printed < budget)
+    {
+        klog_ring_t* oldest = NULL;
+        klog_record_t* oldest_rec = NULL;
+        for (uint32_t i = 0; i < MAX_CPUS; i++)
+        {
+            klog_record_t* rec = klog_peek(&klog_rings[i], panic);
+            if (rec && (!oldest_rec || (int64_t)(rec->tsc - oldest_rec->tsc) < 0))
+            {
+                oldest = &klog_rings[i];
+                oldest_rec = rec;
+            }
+        }
+        if (!oldest)
+            break;
+
+        bool intact = klog_copy(oldest, oldest_rec, &klog_entry);
+        if (!intact)
+            continue;
+        oldest->read += klog_entry.header.size;
+
+        klog_record_t* header = &klog_entry.header;
+        if ((int64_t)(header->seq - oldest->read_seq) > 0)
+            klog_batch_add("klog: %llu records lost on cpu%u\n", header->seq - oldest->read_seq, oldest->cpu);
+        oldest->read_seq = header->seq + 1;
+
+        if (!(header->level & KLOG_CONT))
+            klog_batch_prefix(header);
+        klog_batch_add("%.*s", (int)header->len, klog_entry.text);
+        printed++;
+    }
+
+    klog_batch_flush();
+    return printed;
+}
+
+/**
+ * Whether any CPU has records left to print, lets the idle loop sleep
+ */
+bool klog_pending()
+{
+    for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        if (klog_rings[i].read != __atomic_load_n(&klog_rings[i].head, __ATOMIC_ACQUIRE))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Deferred output of the log, called from the idle loop. Producers
+ * never wait on it, a flusher that falls a whole ring behind reports
+ * the records it lost instead
+ * @param budget: Most records to print, 0 for no limit
+ * @return: Number of records printed, 0 if another flush is running
+ */
+size_t klog_flush(size_t budget)
+{
+    if (__atomic_test_and_set(&klog_flushing, __ATOMIC_ACQUIRE))
+        return 0;
+    size_t printed = klog_drain(budget, false);
+    __atomic_clear(&klog_flushing, __ATOMIC_RELEASE);
+    return printed;
+}
+
+/**
+ * Print everything still in the rings from a fault handler that won't
+ * return. Doesn't wait for a flush it interrupted, whose finished lines
+ * still in the batch go out first, and steps over records whose writers
+ * never finished. Serial output goes polled from here on
+ */
+void klog_panic_flush()
+{
+    serial_panic();
+    klog_drain(0, true);
+}
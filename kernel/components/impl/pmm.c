@@ -0,0 +1,374 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../pmm.h"
+#include "../../../libk/io.h"
+#include "../../../libk/memory.h"
+#include "../../../libk/slab.h"
+#include "../../../drivers/paging.h"
+#include "../../../drivers/cpu.h"
+
+// Everything below LOW_MEMORY_END stays with the bootloader: boot
+// info, page tables at 0x1000-0x5FFF and 0x10000, the boot stack, BIOS
+
+static zone_t zones[ZONE_COUNT] = {
+    { .name = "DMA", .lock = SPINLOCK_INIT },
+    { .name = "DMA32", .lock = SPINLOCK_INIT },
+    { .name = "Normal", .lock = SPINLOCK_INIT },
+};
+
+static frame_t* frames = NULL;        // One entry per frame up to max_pfn
+static uint64_t max_pfn = 0;
+
+static inline int zone_of(uint64_t pfn)
+{
+    uint64_t phys = pfn << FRAME_SHIFT;
+    if (phys < ZONE_DMA_END)
+        return ZONE_DMA;
+    if (phys < ZONE_DMA32_END)
+        return ZONE_DMA32;
+    return ZONE_NORMAL;
+}
+
+static inline free_block_t* block_of(uint64_t pfn)
+{
+    return PHYS_TO_VIRT(pfn << FRAME_SHIFT);
+}
+
+static inline uint64_t pfn_of(free_block_t* block)
+{
+    return VIRT_TO_PHYS(block) >> FRAME_SHIFT;
+}
+
+static void list_push(zone_t* zone, uint64_t pfn, uint32_t order)
+{
+    free_block_t* block = block_of(pfn);
+    block->prev = NULL;
+    block->next = zone->free_lists[order];
+    if (block->next)
+        block->next->prev = block;
+    zone->free_lists[order] = block;
+    zone->nonempty |= 1U << order;
+
+    frames[pfn].order = order;
+    frames[pfn].flags |= FRAME_FREE;
+}
+
+static void list_remove(zone_t* zone, uint64_t pfn, uint32_t order)
+{
+    free_block_t* block = block_of(pfn);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        zone->free_lists[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    if (!zone->free_lists[order])
+        zone->nonempty &= ~(1U << order);
+
+    frames[pfn].flags &= ~FRAME_FREE;
+}
+
+// Gives a block back and merges it with its buddy for as long as
+// the buddy is a free block of the same order in the same zone.
+// Called with the zone locked once allocations can happen
+static void release_block(uint64_t pfn, uint32_t order)
+{
+    int zone_idx = zone_of(pfn);
+    zone_t* zone = &zones[zone_idx];
+    zone->free_frames += 1ULL << order;
+
+    while (order < PMM_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy >= max_pfn || zone_of(buddy) != zone_idx)
+            break;
+        if (!(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order)
+            break;
+
+        list_remove(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    list_push(zone, pfn, order);
+}
+
+// Seeds [start, end) as the largest aligned blocks that fit
+static void add_range(uint64_t start, uint64_t end)
+{
+    uint64_t pfn = (start + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    uint64_t end_pfn = end >> FRAME_SHIFT;
+    if (end_pfn > max_pfn)
+        end_pfn = max_pfn;
+
+    while (pfn < end_pfn)
+    {
+        uint32_t order = pfn ? __builtin_ctzll(pfn) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER)
+            order = PMM_MAX_ORDER;
+        while (pfn + (1ULL << order) > end_pfn)
+            order--;
+
+        zones[zone_of(pfn)].total_frames += 1ULL << order;
+        release_block(pfn, order);
+        pfn += 1ULL << order;
+    }
+}
+
+// Adds a usable region minus the ranges that are already taken
+static void add_usable(uint64_t start, uint64_t end, uint64_t reserved[][2], int reserved_count)
+{
+    for (int i = 0; i < reserved_count; i++)
+    {
+        uint64_t res_start = reserved[i][0];
+        uint64_t res_end = reserved[i][1];
+        if (res_end <= start || res_start >= end)
+            continue;
+        if (res_start > start)
+            add_usable(start, res_start, reserved, reserved_count);
+        start = res_end;
+        if (start >= end)
+            return;
+    }
+    add_range(start, end);
+}
+
+// First usable spot of 'size' bytes above low memory that
+// doesn't overlap the kernel image
+static uint64_t find_free_range(const struct boot_info* boot_info, uint64_t size)
+{
+    for (uint32_t i = 0; i < boot_info->mmap_count; i++)
+    {
+        const struct e820_entry* entry = &boot_info->mmap[i];
+        if (entry->type != E820_USABLE)
+            continue;
+
+        uint64_t start = entry->base < LOW_MEMORY_END ? LOW_MEMORY_END : entry->base;
+        uint64_t end = entry->base + entry->length;
+        start = (start + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+        if (start < boot_info->kernel_end && start + size > boot_info->kernel_start)
+            start = (boot_info->kernel_end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+        if (start + size <= end)
+            return start;
+    }
+    return 0;
+}
+
+void init_pmm(const struct boot_info* boot_info)
+{
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < boot_info->mmap_count; i++)
+    {
+        const struct e820_entry* entry = &boot_info->mmap[i];
+        if (entry->type == E820_USABLE && entry->base + entry->length > end)
+            end = entry->base + entry->length;
+    }
+    if (end > physmap_size())
+        end = physmap_size();      // Frames must be reachable through the physmap
+    max_pfn = end >> FRAME_SHIFT;
+
+    uint64_t frames_size = (max_pfn * sizeof(frame_t) + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    uint64_t frames_phys = find_free_range(boot_info, frames_size);
+    if (!frames_phys)
+    {
+        printf("PMM: no room for %llu bytes of frame descriptors\n", frames_size);
+        return;
+    }
+    frames = PHYS_TO_VIRT(frames_phys);
+    memset(frames, 0, frames_size);
+
+    uint64_t reserved[][2] = {
+        { 0, LOW_MEMORY_END },
+        { boot_info->kernel_start, boot_info->kernel_end },
+        { frames_phys, frames_phys + frames_size },
+    };
+    int reserved_count = sizeof(reserved) / sizeof(reserved[0]);
+
+    for (uint32_t i = 0; i < boot_info->mmap_count; i++)
+    {
+        const struct e820_entry* entry = &boot_info->mmap[i];
+        if (entry->type == E820_USABLE)
+            add_usable(entry->base, entry->base + entry->length, reserved, reserved_count);
+    }
+}
+
+/**
+ * Allocate 2^order physically contiguous frames. Safe from interrupt
+ * context, softirqs and faults included, each zone is locked with
+ * interrupts off
+ * @order: Block size as a power of two in frames
+ * @zone: Highest zone to allocate from, lower zones are used as fallback
+ * @return: Physical address of the block, 0 on failure
+ */
+uint64_t alloc_frames(uint32_t order, int zone_idx)
+{
+    if (order > PMM_MAX_ORDER || !frames)
+        return 0;
+
+    for (int z = zone_idx; z >= 0; z--)
+    {
+        zone_t* zone = &zones[z];
+        uint64_t flags = irq_save();
+        spin_lock(&zone->lock);
+        uint32_t candidates = zone->nonempty & ~((1U << order) - 1);
+        if (!candidates)
+        {
+            spin_unlock(&zone->lock);
+            irq_restore(flags);
+            continue;
+        }
+
+        uint32_t found = __builtin_ctz(candidates);
+        uint64_t pfn = pfn_of(zone->free_lists[found]);
+        list_remove(zone, pfn, found);
+
+        // Split down, handing the upper halves back
+        while (found > order)
+        {
+            found--;
+            list_push(zone, pfn + (1ULL << found), found);
+        }
+
+        frames[pfn].order = order;
+        frames[pfn].flags = 0;
+        frames[pfn].refcount = 1;
+        zone->free_frames -= 1ULL << order;
+        spin_unlock(&zone->lock);
+        irq_restore(flags);
+        return pfn << FRAME_SHIFT;
+    }
+    return 0;
+}
+
+uint64_t alloc_frame()
+{
+    return alloc_frames(0, ZONE_NORMAL);
+}
+
+/**
+ * Free a block from alloc_frames
+ * @phys: Physical address returned by alloc_frames
+ * @order: The order it was allocated with
+ */
+void free_frames(uint64_t phys, uint32_t order)
+{
+    uint64_t pfn = phys >> FRAME_SHIFT;
+    if (!phys || pfn >= max_pfn)
+        return;
+
+    zone_t* zone = &zones[zone_of(pfn)];
+    uint64_t flags = irq_save();
+    spin_lock(&zone->lock);
+    if (!(frames[pfn].flags & FRAME_FREE))
+        release_block(pfn, order);
+    spin_unlock(&zone->lock);
+    irq_restore(flags);
+}
+
+void free_frame(uint64_t phys)
+{
+    free_frames(phys, 0);
+}
+
+uint64_t pmm_free_frames()
+{
+    uint64_t total = 0;
+    for (int z = 0; z < ZONE_COUNT; z++)
+        total += zones[z].free_frames;
+    return total;
+}
+
+void pmm_print_stats()
+{
+    for (int z = 0; z < ZONE_COUNT; z++)
+    {
+        if (!zones[z].total_frames)
+            continue;
+        printf("PMM %s: %llu KB free of %llu KB\n", zones[z].name,
+               zones[z].free_frames << 2, zones[z].total_frames << 2);
+    }
+}
+
+/**
+ * Take another reference on a shared block
+ * @phys: First frame of the block
+ * @order: Block order, for a split block every frame is referenced
+ */
+void frame_ref(uint64_t phys, uint32_t order)
+{
+    uint64_t pfn = phys >> FRAME_SHIFT;
+    if (order && (frames[pfn].flags & FRAME_SPLIT))
+    {
+        for (uint64_t i = 0; i < (1ULL << order); i++)
+            __atomic_add_fetch(&frames[pfn + i].refcount, 1, __ATOMIC_RELAXED);
+    }
+    else
+        __atomic_add_fetch(&frames[pfn].refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference, freeing what nobody maps anymore
+ * @phys: First frame of the block
+ * @order: Block order, a split block is released frame by frame
+ */
+void frame_unref(uint64_t phys, uint32_t order)
+{
+    uint64_t pfn = phys >> FRAME_SHIFT;
+    if (order && (frames[pfn].flags & FRAME_SPLIT))
+    {
+        for (uint64_t i = 0; i < (1ULL << order); i++)
+        {
+            if (!__atomic_sub_fetch(&frames[pfn + i].refcount, 1, __ATOMIC_ACQ_REL))
+                free_frames((pfn + i) << FRAME_SHIFT, 0);
+        }
+    }
+    else if (!__atomic_sub_fetch(&frames[pfn].refcount, 1, __ATOMIC_ACQ_REL))
+        free_frames(phys, order);
+}
+
+uint32_t frame_refcount(uint64_t phys)
+{
+    return __atomic_load_n(&frames[phys >> FRAME_SHIFT].refcount, __ATOMIC_ACQUIRE);
+}
+
+// A block shared through huge mappings keeps one count on its head.
+// Once any sharer maps part of it with small pages every frame needs
+// its own count, each starting with all the current sharers
+void frame_split_refs(uint64_t phys, uint32_t order)
+{
+    uint64_t pfn = phys >> FRAME_SHIFT;
+    if (frames[pfn].flags & FRAME_SPLIT)
+        return;
+    for (uint64_t i = 1; i < (1ULL << order); i++)
+        frames[pfn + i].refcount = frames[pfn].refcount;
+    frames[pfn].flags |= FRAME_SPLIT;
+}
+
+bool frame_is_split(uint64_t phys)
+{
+    return (frames[phys >> FRAME_SHIFT].flags & FRAME_SPLIT) != 0;
+}
+
+static void* heap_alloc_pages(uint32_t order)
+{
+    uint64_t phys = alloc_frames(order, ZONE_NORMAL);
+    return phys ? PHYS_TO_VIRT(phys) : NULL;
+}
+
+static void heap_free_pages(void* addr, uint32_t order)
+{
+    free_frames(VIRT_TO_PHYS(addr), order);
+}
+
+static const kmem_backend_t heap_backend = {
+    .alloc_pages = heap_alloc_pages,
+    .free_pages = heap_free_pages,
+    .cpu_id = cpu_id,
+};
+
+// Backs the libk slab allocator with frames through the physmap
+void init_heap()
+{
+    init_kmalloc(&heap_backend);
+}
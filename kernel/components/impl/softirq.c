@@ -0,0 +1,195 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../softirq.h"
+#include "../../../libk/memory.h"
+#include "../../../libk/spinlock.h"
+#include "../../../drivers/timer.h"
+
+// Top halves acknowledge their device and queue the rest here. It runs
+// as the outermost interrupt returns, with interrupts back on, until
+// nothing is pending or the budget is spent, and the idle loop picks
+// up whatever is left, in place of a softirq thread
+static softirq_fn_t softirq_actions[SOFTIRQ_COUNT];
+static softirq_cpu_t softirq_cpus[MAX_CPUS];
+
+static void tasklet_run(int nr)
+{
+    softirq_cpu_t* cpu = &softirq_cpus[cpu_id()];
+    int queue = nr == SOFTIRQ_HI ? 0 : 1;
+
+    uint64_t flags = irq_save();
+    tasklet_t* tasklet = cpu->head[queue];
+    cpu->head[queue] = NULL;
+    cpu->tail[queue] = &cpu->head[queue];
+    irq_restore(flags);
+
+    while (tasklet)
+    {
+        tasklet_t* next = tasklet->next;
+        // Cleared first so the tasklet can queue itself again
+        __atomic_and_fetch(&tasklet->state, ~TASKLET_SCHEDULED, __ATOMIC_ACQ_REL);
+        tasklet->fn(tasklet->data);
+        tasklet = next;
+    }
+}
+
+static void tasklet_hi_action()
+{
+    tasklet_run(SOFTIRQ_HI);
+}
+
+static void tasklet_action()
+{
+    tasklet_run(SOFTIRQ_TASKLET);
+}
+
+void init_softirq()
+{
+    for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        softirq_cpus[i].tail[0] = &softirq_cpus[i].head[0];
+        softirq_cpus[i].tail[1] = &softirq_cpus[i].head[1];
+    }
+    open_softirq(SOFTIRQ_HI, tasklet_hi_action);
+    open_softirq(SOFTIRQ_TASKLET, tasklet_action);
+}
+
+void open_softirq(int nr, softirq_fn_t fn)
+{
+    softirq_actions[nr] = fn;
+}
+
+/**
+ * Mark a softirq pending on this CPU. It runs on the way out of the
+ * current interrupt, or from the idle loop if raised outside one
+ * @param nr: SOFTIRQ_*
+ */
+void raise_softirq(int nr)
+{
+    __atomic_or_fetch(&softirq_cpus[cpu_id()].pending, 1U << nr, __ATOMIC_RELAXED);
+}
+
+static void tasklet_queue(tasklet_t* tasklet, int nr)
+{
+    if (__atomic_fetch_or(&tasklet->state, TASKLET_SCHEDULED, __ATOMIC_ACQ_REL) & TASKLET_SCHEDULED)
+        return;
+
+    softirq_cpu_t* cpu = &softirq_cpus[cpu_id()];
+    int queue = nr == SOFTIRQ_HI ? 0 : 1;
+    uint64_t flags = irq_save();
+    tasklet->next = NULL;
+    *cpu->tail[queue] = tasklet;
+    cpu->tail[queue] = &tasklet->next;
+    raise_softirq(nr);
+    irq_restore(flags);
+}
+
+/**
+ * Queue a tasklet on this CPU, does nothing if it is already queued
+ * @param tasklet: From TASKLET_INIT
+ */
+void tasklet_schedule(tasklet_t* tasklet)
+{
+    tasklet_queue(tasklet, SOFTIRQ_TASKLET);
+}
+
+void tasklet_hi_schedule(tasklet_t* tasklet)
+{
+    tasklet_queue(tasklet, SOFTIRQ_HI);
+}
+
+/**
+ * Run pending softirqs with interrupts enabled. Entered and left with
+ * them off, the caller is either the last thing an interrupt does
+ * before iretq or the idle loop
+ * @param budget: TSC cycles after which remaining work is left pending
+ * @param rounds: Most passes over the pending mask
+ */
+static void softirq_run(uint64_t budget, int rounds)
+{
+    softirq_cpu_t* cpu = &softirq_cpus[cpu_id()];
+    if (cpu->active || !cpu->pending)
+        return;
+    cpu->active = true;
+
+    uint64_t start = rdtsc();
+    while (rounds-- > 0)
+    {
+        uint32_t pending = __atomic_exchange_n(&cpu->pending, 0, __ATOMIC_ACQ_REL);
+        if (!pending)
+            break;
+
+        __asm__ volatile("sti" ::: "memory");
+        while (pending)
+        {
+            int nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            uint64_t t0 = rdtsc();
+            softirq_actions[nr]();
+            uint64_t cycles = rdtsc() - t0;
+            cpu->runs[nr]++;
+            cpu->cycles[nr] += cycles;
+            if (cycles > cpu->max[nr])
+                cpu->max[nr] = cycles;
+        }
+        __asm__ volatile("cli" ::: "memory");
+
+        if (budget && rdtsc() - start >= budget)
+            break;
+    }
+
+    if (cpu->pending)
+        cpu->deferred++;
+    cpu->active = false;
+}
+
+/**
+ * Last step of irq_dispatch, after the EOI. Softirqs only run if the
+ * interrupted code had interrupts on, an int instruction inside an
+ * irq_save section must not find them turned back on. Vector registers
+ * are off limits meanwhile, they still hold the interrupted code's state
+ * @param interrupted_if: RFLAGS.IF in the interrupt frame
+ */
+void irq_exit(bool interrupted_if)
+{
+    if (!interrupted_if)
+        return;
+    uint64_t budget = get_tsc_khz() * SOFTIRQ_BUDGET_US / 1000;
+    __atomic_add_fetch(&simd_hold, 1, __ATOMIC_RELAXED);
+    softirq_run(budget, SOFTIRQ_MAX_ROUNDS);
+    __atomic_sub_fetch(&simd_hold, 1, __ATOMIC_RELAXED);
+}
+
+bool softirq_pending()
+{
+    return softirq_cpus[cpu_id()].pending != 0;
+}
+
+/**
+ * Finish work an interrupt exit left over, from the idle loop with
+ * interrupts enabled. One round at a time so new interrupts still get
+ * their own exits in between
+ */
+void softirq_idle()
+{
+    softirq_cpu_t* cpu = &softirq_cpus[cpu_id()];
+    uint64_t flags = irq_save();
+    if (cpu->pending && !cpu->active)
+    {
+        cpu->idle_runs++;
+        softirq_run(0, 1);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Softirq counters for one CPU
+ * @param cpu: cpu_id() of the CPU
+ * @return: NULL past MAX_CPUS
+ */
+const softirq_cpu_t* softirq_stats(uint32_t cpu)
+{
+    return cpu < MAX_CPUS ? &softirq_cpus[cpu] : NULL;
+}
@@ -0,0 +1,123 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../stack.h"
+#include "../pmm.h"
+#include "../../../libk/spinlock.h"
+#include "../../../drivers/paging.h"
+#include "../../../drivers/cpu.h"
+
+static uint64_t slot_bitmap[STACK_SLOTS / 64];
+static uint32_t slot_hint = 0;        // Word to start searching from
+static spinlock_t slot_lock = SPINLOCK_INIT;
+
+static stack_cache_t stack_caches[MAX_CPUS];
+
+static int claim_slot()
+{
+    uint64_t flags = irq_save();
+    spin_lock(&slot_lock);
+
+    int slot = -1;
+    for (uint32_t n = 0; n < STACK_SLOTS / 64; n++)
+    {
+        uint32_t word = (slot_hint + n) % (STACK_SLOTS / 64);
+        if (slot_bitmap[word] == ~0ULL)
+            continue;
+        int bit = __builtin_ctzll(~slot_bitmap[word]);
+        slot_bitmap[word] |= 1ULL << bit;
+        slot_hint = word;
+        slot = word * 64 + bit;
+        break;
+    }
+
+    spin_unlock(&slot_lock);
+    irq_restore(flags);
+    return slot;
+}
+
+static void release_slot(int slot)
+{
+    uint64_t flags = irq_save();
+    spin_lock(&slot_lock);
+    slot_bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+    spin_unlock(&slot_lock);
+    irq_restore(flags);
+}
+
+/**
+ * Allocate a kernel stack with an unmapped guard below it, from this
+ * CPU's cache of freed stacks when possible
+ * @return: Top of the stack (it grows down), NULL on failure
+ */
+void* stack_alloc()
+{
+    uint64_t flags = irq_save();
+    stack_cache_t* cache = &stack_caches[cpu_id()];
+    if (cache->count)
+    {
+        void* top = cache->tops[--cache->count];
+        irq_restore(flags);
+        return top;
+    }
+    irq_restore(flags);
+
+    int slot = claim_slot();
+    if (slot < 0)
+        return NULL;
+
+    uint64_t phys = alloc_frames(STACK_ORDER, ZONE_NORMAL);
+    uint64_t top = STACK_REGION_BASE + (slot + 1) * STACK_SLOT_SIZE;
+    if (!phys)
+    {
+        release_slot(slot);
+        return NULL;
+    }
+    if (!vmm_map(&kernel_space, top - STACK_SIZE, phys, STACK_SIZE, PAGE_WRITE | PAGE_GLOBAL | page_nx(),
+                 MEM_WB))
+    {
+        vmm_unmap(&kernel_space, top - STACK_SIZE, STACK_SIZE);
+        free_frames(phys, STACK_ORDER);
+        release_slot(slot);
+        return NULL;
+    }
+    return (void*)top;
+}
+
+/**
+ * Give a stack back, it stays mapped in this CPU's cache if there's room
+ * @top: Value returned by stack_alloc
+ */
+void stack_free(void* top)
+{
+    if (!top)
+        return;
+
+    uint64_t flags = irq_save();
+    stack_cache_t* cache = &stack_caches[cpu_id()];
+    if (cache->count < STACK_CACHE_SIZE)
+    {
+        cache->tops[cache->count++] = top;
+        irq_restore(flags);
+        return;
+    }
+    irq_restore(flags);
+
+    uint64_t base = (uint64_t)top - STACK_SIZE;
+    uint64_t phys;
+    if (vmm_translate(&kernel_space, base, &phys))
+    {
+        vmm_unmap(&kernel_space, base, STACK_SIZE);
+        free_frames(phys, STACK_ORDER);
+    }
+    release_slot((base - STACK_REGION_BASE) / STACK_SLOT_SIZE);
+}
+
+// True when addr falls in the guard part of a stack slot
+bool stack_guard_hit(uint64_t addr)
+{
+    if (addr < STACK_REGION_BASE || addr >= STACK_REGION_END)
+        return false;
+    return (addr - STACK_REGION_BASE) % STACK_SLOT_SIZE < STACK_SLOT_SIZE - STACK_SIZE;
+}
@@ -0,0 +1,101 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../timeline.h"
+#include "../../../libk/io.h"
+#include "../../../drivers/cpu.h"
+#include "../../../drivers/timer.h"
+#include "../../../drivers/serial.h"
+
+static const char* boot_stage_names[BOOT_TSC_COUNT] = {
+    "stage1",
+    "stage2",
+    "e820",
+    "a20",
+    "kernel_load",
+    "protected_mode",
+    "decompress",
+    "long_mode",
+    "handoff",
+};
+
+static timeline_entry_t timeline[TIMELINE_MAX];
+static size_t timeline_count = 0;
+
+static void timeline_add(const char* name, uint64_t tsc)
+{
+    if (timeline_count >= TIMELINE_MAX)
+        return;
+    timeline[timeline_count].name = name;
+    timeline[timeline_count].tsc = tsc;
+    timeline_count++;
+}
+
+static uint64_t cycles_to_us(uint64_t cycles)
+{
+    uint64_t khz = get_tsc_khz();
+    if (!khz)
+        khz = calibrate_tsc();
+    return khz ? cycles * 1000 / khz : 0;
+}
+
+void timeline_init(const struct boot_info* boot_info, uint64_t kernel_start_tsc)
+{
+    timeline_count = 0;
+    for (int i = 0; i < BOOT_TSC_COUNT; i++)
+    {
+        // Stages that never ran (e.g. no stage 1 stamp) stay zero
+        if (boot_info->tsc[i])
+            timeline_add(boot_stage_names[i], boot_info->tsc[i]);
+    }
+    timeline_add("kernel_start", kernel_start_tsc);
+}
+
+void timeline_mark(const char* name)
+{
+    timeline_add(name, rdtsc());
+}
+
+/**
+ * Prints each phase as the time from the previous milestone
+ * to the one it is named after
+ */
+void timeline_report()
+{
+    if (timeline_count < 2)
+        return;
+
+    printf("Boot timeline (TSC %llu kHz):\n", get_tsc_khz() ? get_tsc_khz() : calibrate_tsc());
+    for (size_t i = 1; i < timeline_count; i++)
+    {
+        uint64_t cycles = timeline[i].tsc - timeline[i - 1].tsc;
+        printf("  %s: %llu cycles, %llu us\n", timeline[i].name, cycles, cycles_to_us(cycles));
+    }
+
+    uint64_t total = timeline[timeline_count - 1].tsc - timeline[0].tsc;
+    printf("  total: %llu cycles, %llu us\n", total, cycles_to_us(total));
+}
+
+/**
+ * Same as timeline_report but one 'timeline <phase> <cycles> <us>'
+ * line per phase on the serial port, for headless runs
+ */
+void timeline_report_serial()
+{
+    char line[128];
+    if (timeline_count < 2)
+        return;
+
+    for (size_t i = 1; i < timeline_count; i++)
+    {
+        uint64_t cycles = timeline[i].tsc - timeline[i - 1].tsc;
+        snprintf(line, sizeof(line), "timeline %s %llu %llu\n",
+                 timeline[i].name, cycles, cycles_to_us(cycles));
+        serial_write(line);
+    }
+
+    uint64_t total = timeline[timeline_count - 1].tsc - timeline[0].tsc;
+    snprintf(line, sizeof(line), "timeline total %llu %llu\n", total, cycles_to_us(total));
+    serial_write(line);
+}
@@ -0,0 +1,456 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../vma.h"
+#include "../pmm.h"
+#include "../../../libk/memory.h"
+#include "../../../libk/slab.h"
+#include "../../../drivers/cpu.h"
+
+static kmem_cache_t* vma_cache = NULL;
+static uint64_t zero_page = 0;        // Shared by every read-only demand-zero page
+static fault_stats_t fault_stats;
+
+void init_vma()
+{
+    vma_cache = kmem_cache_create("vma", sizeof(vma_t), 8, NULL, 0);
+    zero_page = alloc_frame();
+    if (zero_page)
+        memset(PHYS_TO_VIRT(zero_page), 0, FRAME_SIZE);
+}
+
+// Caller holds space->vma_lock
+static vma_t* vma_find(addr_space_t* space, uint64_t addr)
+{
+    vma_t* vma = space->vma_hint;
+    if (vma && addr >= vma->start && addr < vma->end)
+        return vma;
+
+    for (vma = space->vmas; vma && vma->start <= addr; vma = vma->next)
+    {
+        if (addr < vma->end)
+        {
+            space->vma_hint = vma;
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+// Links a new region in address order, caller holds space->vma_lock
+static vma_t* vma_insert(addr_space_t* space, uint64_t start, uint64_t end, uint32_t flags)
+{
+    vma_t** link = &space->vmas;
+    while (*link && (*link)->end <= start)
+        link = &(*link)->next;
+    if (*link && (*link)->start < end)
+        return NULL;
+
+    vma_t* vma = kmem_cache_alloc(vma_cache);
+    if (!vma)
+        return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->next = *link;
+    *link = vma;
+    return vma;
+}
+
+/**
+ * Reserve a region that gets memory on first touch
+ * @space: Address space to reserve in
+ * @start: Page aligned start
+ * @size: Bytes, rounded up to pages
+ * @flags: VMA_* flags
+ * @return: The region, NULL if it overlaps another or out of memory
+ */
+vma_t* vma_reserve(addr_space_t* space, uint64_t start, uint64_t size, uint32_t flags)
+{
+    if (!vma_cache || (start & (FRAME_SIZE - 1)) || !size)
+        return NULL;
+    uint64_t end = start + ((size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1));
+
+    uint64_t irq = irq_save();
+    spin_lock(&space->vma_lock);
+    vma_t* vma = vma_insert(space, start, end, flags);
+    spin_unlock(&space->vma_lock);
+    irq_restore(irq);
+    return vma;
+}
+
+// Frame behind a 4KB or 2MB leaf, regions never get 1GB ones
+static inline uint64_t leaf_frame(uint64_t entry, int level)
+{
+    uint64_t size = level == 1 ? FRAME_SIZE : PAGE_SIZE;
+    return entry & PAGE_ADDR_MASK & ~(size - 1);
+}
+
+static bool release_leaf(uint64_t virt, uint64_t* entry, int level, void* ctx)
+{
+    (void)virt;
+    (void)ctx;
+    uint64_t phys = leaf_frame(*entry, level);
+    if (level <= 2 && phys != zero_page)
+        frame_unref(phys, level == 1 ? 0 : HUGE_ORDER);
+    return true;
+}
+
+/**
+ * Drop a region, releasing its share of every frame faulted into it
+ * @space: Address space it was reserved in
+ * @start: Start it was reserved at
+ */
+void vma_release(addr_space_t* space, uint64_t start)
+{
+    uint64_t irq = irq_save();
+    spin_lock(&space->vma_lock);
+    vma_t** link = &space->vmas;
+    while (*link && (*link)->start != start)
+        link = &(*link)->next;
+    vma_t* vma = *link;
+    if (vma)
+    {
+        *link = vma->next;
+        if (space->vma_hint == vma)
+            space->vma_hint = NULL;
+    }
+    spin_unlock(&space->vma_lock);
+    irq_restore(irq);
+    if (!vma)
+        return;
+
+    vmm_walk(space, vma->start, vma->end - vma->start, release_leaf, NULL);
+    vmm_unmap(space, vma->start, vma->end - vma->start);
+    kmem_cache_free(vma_cache, vma);
+}
+
+typedef struct
+{
+    uint64_t* entry;
+    uint64_t virt;
+    int level;
+} leaf_t;
+
+static bool find_leaf(uint64_t virt, uint64_t* entry, int level, void* ctx)
+{
+    leaf_t* leaf = ctx;
+    leaf->entry = entry;
+    leaf->virt = virt;
+    leaf->level = level;
+    return false;
+}
+
+static uint64_t vma_page_flags(vma_t* vma, uint64_t addr, bool writable)
+{
+    uint64_t flags = (vma->flags & VMA_EXEC) ? 0 : page_nx();
+    if (writable)
+        flags |= PAGE_WRITE;
+    if (vma->flags & VMA_USER)
+        flags |= PAGE_USER;
+    if (addr >= KERNEL_HALF_BASE)
+        flags |= PAGE_GLOBAL;
+    return flags;
+}
+
+// Backs one page, a fresh zeroed frame for writes and the shared
+// zero page for reads
+static bool populate(addr_space_t* space, vma_t* vma, uint64_t page, bool write)
+{
+    uint64_t phys = zero_page;
+    if (write)
+    {
+        phys = alloc_frame();
+        if (!phys)
+            return false;
+        memset(PHYS_TO_VIRT(phys), 0, FRAME_SIZE);
+    }
+
+    if (!vmm_map(space, page, phys, FRAME_SIZE, vma_page_flags(vma, page, write), MEM_WB))
+    {
+        if (write)
+            free_frame(phys);
+        return false;
+    }
+    fault_stats.pages++;
+    return true;
+}
+
+static bool any_leaf(uint64_t virt, uint64_t* entry, int level, void* ctx)
+{
+    (void)virt;
+    (void)entry;
+    (void)level;
+    *(bool*)ctx = true;
+    return false;
+}
+
+// Backs a whole 2MB window of a VMA_HUGE region with one block
+static bool populate_huge(addr_space_t* space, vma_t* vma, uint64_t huge)
+{
+    bool mapped = false;
+    vmm_walk(space, huge, PAGE_SIZE, any_leaf, &mapped);
+    if (mapped)
+        return false;
+
+    uint64_t phys = alloc_frames(HUGE_ORDER, ZONE_NORMAL);
+    if (!phys)
+        return false;
+    memset(PHYS_TO_VIRT(phys), 0, PAGE_SIZE);
+    if (!vmm_map(space, huge, phys, PAGE_SIZE, vma_page_flags(vma, huge, true), MEM_WB))
+    {
+        frame_unref(phys, HUGE_ORDER);
+        return false;
+    }
+
+    // A leftover page table below forces 4KB entries, count them that way
+    leaf_t leaf = { NULL, 0, 0 };
+    vmm_walk(space, huge, FRAME_SIZE, find_leaf, &leaf);
+    if (leaf.level == 1)
+        frame_split_refs(phys, HUGE_ORDER);
+    fault_stats.pages += PAGE_SIZE / FRAME_SIZE;
+    return true;
+}
+
+// Write to a present read-only page of a writable region: the zero
+// page or a frame shared by clone_address_space
+static bool break_cow(addr_space_t* space, vma_t* vma, uint64_t page)
+{
+    leaf_t leaf = { NULL, 0, 0 };
+    vmm_walk(space, page, FRAME_SIZE, find_leaf, &leaf);
+    if (!leaf.entry || leaf.level > 2)
+        return false;
+    if (*leaf.entry & PAGE_WRITE)
+        return true;                  // Already resolved, the TLB was stale
+
+    if (leaf.level == 2)
+    {
+        uint64_t head = leaf_frame(*leaf.entry, 2);
+        if (!frame_is_split(head) && frame_refcount(head) == 1)
+            return vmm_protect(space, leaf.virt, PAGE_SIZE, vma_page_flags(vma, leaf.virt, true));
+
+        // Only the written 4KB gets copied, the rest of the block stays
+        // shared behind read-only 4KB entries
+        frame_split_refs(head, HUGE_ORDER);
+        if (!vmm_protect(space, page, FRAME_SIZE, vma_page_flags(vma, page, false)))
+            return false;
+        fault_stats.splits++;
+    }
+
+    uint64_t phys;
+    if (!vmm_translate(space, page, &phys))
+        return false;
+    phys &= ~(FRAME_SIZE - 1);
+    if (phys == zero_page)
+        return populate(space, vma, page, true);
+    if (frame_refcount(phys) == 1)
+        return vmm_protect(space, page, FRAME_SIZE, vma_page_flags(vma, page, true));
+
+    uint64_t copy = alloc_frame();
+    if (!copy)
+        return false;
+    memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(phys), FRAME_SIZE);
+    if (!vmm_map(space, page, copy, FRAME_SIZE, vma_page_flags(vma, page, true), MEM_WB))
+    {
+        free_frame(copy);
+        return false;
+    }
+    frame_unref(phys, 0);
+    fault_stats.copies++;
+    return true;
+}
+
+// Backs the faulting page and, for reads or VMA_FAULT_AROUND regions,
+// the rest of its aligned window so neighbouring touches don't trap.
+// Caller holds space->vma_lock
+static bool resolve_fault(addr_space_t* space, vma_t* vma, uint64_t page, uint64_t error)
+{
+    bool write = (error & PF_WRITE) != 0;
+    if (error & PF_PRESENT)
+        return write && break_cow(space, vma, page);
+
+    uint64_t huge = page & ~(PAGE_SIZE - 1);
+    if (write && (vma->flags & VMA_HUGE) && huge >= vma->start && huge + PAGE_SIZE <= vma->end &&
+        populate_huge(space, vma, huge))
+        return true;
+
+    if (!populate(space, vma, page, write))
+        return false;
+    if (write && !(vma->flags & VMA_FAULT_AROUND))
+        return true;
+
+    uint64_t window = FAULT_AROUND_PAGES * FRAME_SIZE;
+    uint64_t around = page & ~(window - 1);
+    uint64_t around_end = around + window;
+    if (around < vma->start)
+        around = vma->start;
+    if (around_end > vma->end)
+        around_end = vma->end;
+
+    for (uint64_t p = around; p < around_end; p += FRAME_SIZE)
+    {
+        uint64_t phys;
+        if (p != page && !vmm_translate(space, p, &phys) && !populate(space, vma, p, write))
+            break;
+    }
+    return true;
+}
+
+/**
+ * Resolve a page fault against the faulting space's regions
+ * @addr: Faulting address from CR2
+ * @error: Page fault error code
+ * @return: true if the access can be retried
+ */
+bool vma_handle_fault(uint64_t addr, uint64_t error)
+{
+    uint64_t start = rdtsc();
+    if (!vma_cache || !zero_page || (error & PF_RESERVED))
+        return false;
+
+    addr_space_t* space = addr >= KERNEL_HALF_BASE ? &kernel_space : current_space();
+    bool handled = false;
+
+    spin_lock(&space->vma_lock);
+    vma_t* vma = vma_find(space, addr);
+    bool allowed = vma && (!(error & PF_WRITE) || (vma->flags & VMA_WRITE)) &&
+                   (!(error & PF_USER) || (vma->flags & VMA_USER)) &&
+                   (!(error & PF_INSTR) || (vma->flags & VMA_EXEC));
+    if (allowed)
+        handled = resolve_fault(space, vma, addr & ~(FRAME_SIZE - 1), error);
+    spin_unlock(&space->vma_lock);
+
+    if (handled)
+    {
+        uint64_t cycles = rdtsc() - start;
+        fault_stats.faults++;
+        fault_stats.cycles += cycles;
+        if (cycles > fault_stats.max_cycles)
+            fault_stats.max_cycles = cycles;
+    }
+    return handled;
+}
+
+const fault_stats_t* vma_fault_stats()
+{
+    return &fault_stats;
+}
+
+typedef struct
+{
+    addr_space_t* child;
+    vma_t* vma;
+} clone_ctx_t;
+
+// Shares one leaf read-only between parent and child
+static bool clone_leaf(uint64_t virt, uint64_t* entry, int level, void* ctx)
+{
+    clone_ctx_t* clone = ctx;
+    if (level > 2)
+        return true;
+
+    uint64_t size = level == 1 ? FRAME_SIZE : PAGE_SIZE;
+    uint32_t order = level == 1 ? 0 : HUGE_ORDER;
+    uint64_t phys = leaf_frame(*entry, level);
+    if (!vmm_map(clone->child, virt, phys, size, vma_page_flags(clone->vma, virt, false), MEM_WB))
+        return false;
+    if (phys != zero_page)
+        frame_ref(phys, order);
+    *entry &= ~PAGE_WRITE;
+    return true;
+}
+
+/**
+ * Clone an address space's regions without copying their memory. Every
+ * page ends up shared read-only and is copied on the first write to it
+ * @parent: Space to clone, its kernel half is shared as always
+ * @return: The new space, NULL when out of memory
+ */
+addr_space_t* clone_address_space(addr_space_t* parent)
+{
+    addr_space_t* child = create_address_space();
+    if (!child)
+        return NULL;
+
+    uint64_t irq = irq_save();
+    spin_lock(&parent->vma_lock);
+    bool ok = true;
+    vma_t** tail = &child->vmas;
+    for (vma_t* vma = parent->vmas; vma && ok; vma = vma->next)
+    {
+        if (vma->start >= KERNEL_HALF_BASE)
+            continue;
+
+        vma_t* copy = kmem_cache_alloc(vma_cache);
+        if (!copy)
+        {
+            ok = false;
+            break;
+        }
+        *copy = *vma;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+
+        clone_ctx_t clone = { child, copy };
+        ok = vmm_walk(parent, vma->start, vma->end - vma->start, clone_leaf, &clone);
+        vmm_flush(parent, vma->start, vma->end - vma->start);
+    }
+    spin_unlock(&parent->vma_lock);
+    irq_restore(irq);
+
+    if (!ok)
+    {
+        vma_release_all(child);
+        destroy_address_space(child);
+        return NULL;
+    }
+    return child;
+}
+
+// Releases every region, before destroy_address_space
+void vma_release_all(addr_space_t* space)
+{
+    while (space->vmas)
+        vma_release(space, space->vmas->start);
+}
+
+/**
+ * Reserve zeroed kernel memory that is only backed once touched
+ * @size: Bytes needed
+ * @return: Page aligned address, NULL if no room
+ */
+void* vzalloc(size_t size)
+{
+    if (!vma_cache || !size)
+        return NULL;
+    size = (size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+
+    // First fit between the regions already in the window, leaving an
+    // unmapped page after each one to catch overruns
+    uint64_t irq = irq_save();
+    spin_lock(&kernel_space.vma_lock);
+    uint64_t start = VMALLOC_BASE;
+    for (vma_t* vma = kernel_space.vmas; vma; vma = vma->next)
+    {
+        if (vma->end <= VMALLOC_BASE)
+            continue;
+        if (vma->start >= VMALLOC_END || start + size + FRAME_SIZE <= vma->start)
+            break;
+        start = vma->end + FRAME_SIZE;
+    }
+
+    vma_t* vma = NULL;
+    if (start + size <= VMALLOC_END)
+        vma = vma_insert(&kernel_space, start, start + size, VMA_WRITE | VMA_FAULT_AROUND);
+    spin_unlock(&kernel_space.vma_lock);
+    irq_restore(irq);
+    return vma ? (void*)vma->start : NULL;
+}
+
+void vfree(void* ptr)
+{
+    if (ptr)
+        vma_release(&kernel_space, (uint64_t)ptr);
+}
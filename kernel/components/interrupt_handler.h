@@ -10,6 +10,31 @@
 #define IST_DOUBLE_FAULT   2
 #define IST_STACK_FAULT    3
 
+#define PIC1_CMD     0x20
+#define PIC1_DATA    0x21
+#define PIC2_CMD     0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_IRQ_BASE 32     // Vector of IRQ 0, just past the exceptions
+#define PIC_CASCADE  2      // Slave PIC's line on the master
+#define PIC_IRQS     16
+#define PIC_READ_ISR 0x0B   // OCW3: next command port read returns the ISR
+
+// Vectors from IRQ_FIRST_VECTOR up enter through the stubs in entry.asm
+// and irq_dispatch, which runs the handlers requested for them
+#define IRQ_FIRST_VECTOR 32
+#define IRQ_VECTORS      256
+#define IRQ_VECTOR(irq)  (PIC_IRQ_BASE + (irq))    // Vector of a legacy line
+#define TIMER_VECTOR     0xEC                      // Local APIC timer
+#define SPURIOUS_VECTOR  0xFF                      // Local APIC spurious, no EOI
+
+#define IRQF_SHARED      (1 << 0)   // Other handlers may chain on the vector
+
+// Handler time per call, bucket b counts calls of 2^(b + IRQ_HIST_SHIFT)
+// cycles or more, the first and last take everything below and above
+#define IRQ_HIST_BUCKETS 16
+#define IRQ_HIST_SHIFT   8
+
 #include "../../libk/kdef.h"
 
 typedef struct
@@ -44,26 +69,37 @@ __attribute__((interrupt)) void exception_simd_float(interrupt_frame_t* frame);
 __attribute__((interrupt)) void exception_virtualization(interrupt_frame_t* frame);
 __attribute__((interrupt)) void exception_security(interrupt_frame_t* frame, uint64_t error);
 
-// IRQ Handlers (32-47)
-__attribute__((interrupt)) void irq0_handler(interrupt_frame_t* frame);  // Timer
-__attribute__((interrupt)) void irq1_handler(interrupt_frame_t* frame);  // Keyboard
-__attribute__((interrupt)) void irq2_handler(interrupt_frame_t* frame);  // Cascade
-__attribute__((interrupt)) void irq3_handler(interrupt_frame_t* frame);  // COM2
-__attribute__((interrupt)) void irq4_handler(interrupt_frame_t* frame);  // COM1
-__attribute__((interrupt)) void irq5_handler(interrupt_frame_t* frame);  // LPT2
-__attribute__((interrupt)) void irq6_handler(interrupt_frame_t* frame);  // Floppy
-__attribute__((interrupt)) void irq7_handler(interrupt_frame_t* frame);  // LPT1
-__attribute__((interrupt)) void irq8_handler(interrupt_frame_t* frame);  // RTC
-__attribute__((interrupt)) void irq9_handler(interrupt_frame_t* frame);  // Free
-__attribute__((interrupt)) void irq10_handler(interrupt_frame_t* frame); // Free
-__attribute__((interrupt)) void irq11_handler(interrupt_frame_t* frame); // Free
-__attribute__((interrupt)) void irq12_handler(interrupt_frame_t* frame); // PS/2 Mouse
-__attribute__((interrupt)) void irq13_handler(interrupt_frame_t* frame); // FPU
-__attribute__((interrupt)) void irq14_handler(interrupt_frame_t* frame); // Primary ATA
-__attribute__((interrupt)) void irq15_handler(interrupt_frame_t* frame); // Secondary ATA
+// Returns true when its device raised the interrupt, so a shared
+// vector can tell unclaimed interrupts apart
+typedef bool (*irq_handler_t)(uint8_t vector, void* data);
+
+typedef struct irq_action
+{
+    irq_handler_t handler;
+    void* data;
+    const char* name;
+    uint32_t flags;
+    struct irq_action* next;
+} irq_action_t;
+
+// Per CPU, written only by that CPU's dispatcher. Cycles run from entry
+// to the EOI, the part of an interrupt spent with interrupts off
+typedef struct
+{
+    uint64_t count[IRQ_VECTORS];
+    uint64_t cycles[IRQ_VECTORS];
+    uint64_t max[IRQ_VECTORS];
+    uint64_t unhandled[IRQ_VECTORS];      // No handler claimed it
+    uint32_t hist[IRQ_VECTORS][IRQ_HIST_BUCKETS];
+} irq_stats_t;
 
 void enable_irq(uint8_t irq);
 void disable_irq(uint8_t irq);
+bool request_irq(uint8_t vector, irq_handler_t handler, void* data, const char* name, uint32_t flags);
+bool free_irq(uint8_t vector, void* data);
+void irq_dispatch(uint64_t vector, interrupt_frame_t* frame);
+const irq_stats_t* irq_stats(uint32_t cpu);
+void irq_print_stats();
 void init_interrupt_handlers();
 
 #endif
\ No newline at end of file
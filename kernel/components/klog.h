@@ -0,0 +1,85 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KKLOG_H__
+#define __KKLOG_H__
+
+#include "../../libk/kdef.h"
+#include "../../drivers/cpu.h"
+
+// Severities, lower is more urgent
+#define KLOG_EMERG   0
+#define KLOG_ALERT   1
+#define KLOG_CRIT    2
+#define KLOG_ERR     3
+#define KLOG_WARNING 4
+#define KLOG_NOTICE  5
+#define KLOG_INFO    6
+#define KLOG_DEBUG   7
+#define KLOG_LEVEL_MASK 0x7
+
+// Or'ed into the level: print the text as is, without a prefix
+#define KLOG_CONT    0x80
+
+#define KLOG_RING_SIZE (16 * 1024)   // Per CPU, a power of two
+#define KLOG_TEXT_MAX 200            // Longer messages are cut short
+#define KLOG_MAGIC 0x474F4C4B        // "KLOG", marks each ring in memory dumps
+
+// Record states, kept in the low bits of the record's tag
+#define KLOG_RESERVED  1             // Claimed, text still being written
+#define KLOG_COMMITTED 2
+#define KLOG_PAD       3             // Filler up to the end of the ring
+#define KLOG_STATE_MASK 0x7
+
+// One message. Records are 8-byte aligned and never wrap, a pad record
+// fills the space at the end of the ring instead. The tag holds the
+// record's position in the ring with its state, so a reader can tell a
+// record from this lap of the ring from stale data with one load
+typedef struct
+{
+    volatile uint64_t tag;           // Position | KLOG_* state
+    uint16_t size;                   // Whole record, header included
+    uint16_t len;                    // Text bytes, no terminator
+    uint8_t level;                   // KLOG_* level, KLOG_CONT
+    uint8_t cpu;
+    uint16_t reserved;
+    uint64_t seq;                    // Per CPU, gaps mean lost records
+    uint64_t tsc;
+    char text[];
+} klog_record_t;
+
+// Producers on a CPU move head, and push tail past the oldest records
+// when the ring is full. The flusher only moves read, it never holds
+// producers back
+typedef struct
+{
+    uint32_t magic;
+    uint32_t cpu;
+    // One cmpxchg16b moves both, so ring order and sequence order agree
+    union
+    {
+        struct
+        {
+            volatile uint64_t head;  // Bytes reserved since boot
+            volatile uint64_t seq;   // Next sequence number
+        };
+        volatile unsigned __int128 claim;
+    } __attribute__((aligned(16)));
+    volatile uint64_t tail;          // Oldest byte still held
+    volatile uint64_t read;          // Next byte to print
+    uint64_t read_seq;               // Sequence expected at read
+    volatile uint64_t dropped;       // Refused, the oldest record was unfinished
+    uint8_t data[KLOG_RING_SIZE] __attribute__((aligned(8)));
+} klog_ring_t;
+
+extern klog_ring_t klog_rings[MAX_CPUS];
+
+void init_klog();
+void klog(int level, const char* fmt, ...);
+void klog_write(int level, const char* text, size_t len);
+bool klog_pending();
+size_t klog_flush(size_t budget);
+void klog_panic_flush();
+
+#endif
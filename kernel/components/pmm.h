@@ -0,0 +1,67 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KPMM_H__
+#define __KPMM_H__
+
+#include "../../libk/kdef.h"
+#include "../../libk/spinlock.h"
+#include "../boot.h"
+
+#define FRAME_SIZE 0x1000ULL
+#define FRAME_SHIFT 12
+#define PMM_MAX_ORDER 18              // 2^18 frames = 1GB
+#define PMM_ORDERS (PMM_MAX_ORDER + 1)
+
+#define ZONE_DMA    0                 // Below 16MB
+#define ZONE_DMA32  1                 // Below 4GB
+#define ZONE_NORMAL 2
+#define ZONE_COUNT  3
+
+#define ZONE_DMA_END   0x1000000ULL
+#define ZONE_DMA32_END 0x100000000ULL
+
+#define FRAME_FREE (1 << 0)           // First frame of a free block
+#define FRAME_SPLIT (1 << 1)          // Block head, refcounts are kept per frame
+
+#define HUGE_ORDER 9                  // 2MB block behind a huge mapping
+
+typedef struct
+{
+    uint8_t order;                    // Order of the block starting here
+    uint8_t flags;
+    uint16_t refcount;                // Mappings sharing it, 1 on allocation
+} frame_t;
+
+typedef struct free_block
+{
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
+
+typedef struct
+{
+    const char* name;
+    spinlock_t lock;                  // Free lists, nonempty and free_frames
+    free_block_t* free_lists[PMM_ORDERS];
+    uint32_t nonempty;                // Bit n set when free_lists[n] has blocks
+    uint64_t total_frames;
+    uint64_t free_frames;
+} zone_t;
+
+void init_pmm(const struct boot_info* boot_info);
+uint64_t alloc_frames(uint32_t order, int zone);
+uint64_t alloc_frame();
+void free_frames(uint64_t phys, uint32_t order);
+void free_frame(uint64_t phys);
+uint64_t pmm_free_frames();
+void pmm_print_stats();
+void init_heap();
+void frame_ref(uint64_t phys, uint32_t order);
+void frame_unref(uint64_t phys, uint32_t order);
+uint32_t frame_refcount(uint64_t phys);
+void frame_split_refs(uint64_t phys, uint32_t order);
+bool frame_is_split(uint64_t phys);
+
+#endif
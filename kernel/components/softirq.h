@@ -0,0 +1,60 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KSOFTIRQ_H__
+#define __KSOFTIRQ_H__
+
+#include "../../libk/kdef.h"
+#include "../../drivers/cpu.h"
+
+// Deferred work classes, a lower number runs first
+#define SOFTIRQ_HI      0            // Tasklets that must not wait behind others
+#define SOFTIRQ_TASKLET 1
+#define SOFTIRQ_COUNT   2
+
+#define SOFTIRQ_MAX_ROUNDS 10        // Passes over pending work on one irq exit
+#define SOFTIRQ_BUDGET_US  2000      // Then what is left waits for the idle loop
+
+// Tasklet states, a scheduled tasklet is queued at most once
+#define TASKLET_SCHEDULED (1 << 0)
+
+typedef void (*softirq_fn_t)();
+
+// A bottom half with its argument. It runs on the CPU that scheduled
+// it, with interrupts enabled, never concurrently with itself
+typedef struct tasklet
+{
+    struct tasklet* next;
+    void (*fn)(void* data);
+    void* data;
+    volatile uint32_t state;
+} tasklet_t;
+
+#define TASKLET_INIT(f, d) { NULL, (f), (d), 0 }
+
+// Per CPU, only touched by that CPU with interrupts off
+typedef struct
+{
+    volatile uint32_t pending;      // Bit per SOFTIRQ_* waiting to run
+    bool active;                    // Running softirqs, don't start again
+    tasklet_t* head[2];             // SOFTIRQ_HI and SOFTIRQ_TASKLET queues
+    tasklet_t** tail[2];
+    uint64_t runs[SOFTIRQ_COUNT];
+    uint64_t cycles[SOFTIRQ_COUNT];
+    uint64_t max[SOFTIRQ_COUNT];
+    uint64_t deferred;              // Irq exits that ran out of budget
+    uint64_t idle_runs;             // Passes the idle loop made instead
+} softirq_cpu_t;
+
+void init_softirq();
+void open_softirq(int nr, softirq_fn_t fn);
+void raise_softirq(int nr);
+void tasklet_schedule(tasklet_t* tasklet);
+void tasklet_hi_schedule(tasklet_t* tasklet);
+void irq_exit(bool interrupted_if);
+bool softirq_pending();
+void softirq_idle();
+const softirq_cpu_t* softirq_stats(uint32_t cpu);
+
+#endif
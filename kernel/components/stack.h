@@ -0,0 +1,31 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KSTACK_H__
+#define __KSTACK_H__
+
+#include "../../libk/kdef.h"
+
+// Kernel stacks live in their own region (PML4 slot 402), each in a
+// slot whose lower half stays unmapped as a guard
+#define STACK_REGION_BASE 0xFFFFC90000000000ULL
+#define STACK_SIZE 0x4000ULL          // 16KB usable
+#define STACK_SLOT_SIZE 0x8000ULL     // Stack plus guard below it
+#define STACK_SLOTS 4096              // 128MB of address space
+#define STACK_ORDER 2                 // Frames per stack as a buddy order
+#define STACK_CACHE_SIZE 8            // Free stacks kept mapped per CPU
+
+#define STACK_REGION_END (STACK_REGION_BASE + STACK_SLOTS * STACK_SLOT_SIZE)
+
+typedef struct
+{
+    void* tops[STACK_CACHE_SIZE];
+    uint32_t count;
+} __attribute__((aligned(64))) stack_cache_t;
+
+void* stack_alloc();
+void stack_free(void* top);
+bool stack_guard_hit(uint64_t addr);
+
+#endif
@@ -0,0 +1,24 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KTIMELINE_H__
+#define __KTIMELINE_H__
+
+#include "../../libk/kdef.h"
+#include "../boot.h"
+
+#define TIMELINE_MAX 32
+
+typedef struct
+{
+    const char* name;
+    uint64_t tsc;
+} timeline_entry_t;
+
+void timeline_init(const struct boot_info* boot_info, uint64_t kernel_start_tsc);
+void timeline_mark(const char* name);
+void timeline_report();
+void timeline_report_serial();
+
+#endif
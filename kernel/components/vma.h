@@ -0,0 +1,58 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KVMA_H__
+#define __KVMA_H__
+
+#include "../../libk/kdef.h"
+#include "../../drivers/paging.h"
+
+#define VMA_WRITE (1 << 0)
+#define VMA_EXEC (1 << 1)
+#define VMA_USER (1 << 2)
+#define VMA_FAULT_AROUND (1 << 3)     // Write faults also back their neighbours
+#define VMA_HUGE (1 << 4)             // Back aligned 2MB windows with huge pages
+
+// Page fault error code bits
+#define PF_PRESENT (1 << 0)
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
+#define PF_RESERVED (1 << 3)
+#define PF_INSTR (1 << 4)
+
+#define FAULT_AROUND_PAGES 16         // Aligned window filled per fault
+
+// Lazily backed kernel allocations (PML4 slot 400)
+#define VMALLOC_BASE 0xFFFFC80000000000ULL
+#define VMALLOC_END 0xFFFFC90000000000ULL
+
+typedef struct vma
+{
+    uint64_t start;
+    uint64_t end;                     // Exclusive
+    uint32_t flags;
+    struct vma* next;
+} vma_t;
+
+typedef struct
+{
+    uint64_t faults;
+    uint64_t pages;                   // Mapped by faults, fault-around included
+    uint64_t cycles;
+    uint64_t max_cycles;
+    uint64_t copies;                  // Copy-on-write breaks
+    uint64_t splits;                  // Huge pages split by a partial write
+} fault_stats_t;
+
+void init_vma();
+vma_t* vma_reserve(addr_space_t* space, uint64_t start, uint64_t size, uint32_t flags);
+void vma_release(addr_space_t* space, uint64_t start);
+void vma_release_all(addr_space_t* space);
+addr_space_t* clone_address_space(addr_space_t* parent);
+bool vma_handle_fault(uint64_t addr, uint64_t error);
+const fault_stats_t* vma_fault_stats();
+void* vzalloc(size_t size);
+void vfree(void* ptr);
+
+#endif
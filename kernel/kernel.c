@@ -2,36 +2,109 @@
 // Licensed under MIT License
 // See LICENSE for more information
 
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
-#define VGAMEMORY ((volatile unsigned short*) 0xFFFFFFFF800B8000)
-
+#include "boot.h"
 #include "components/interrupt_handler.h"
+#include "components/timeline.h"
+#include "components/pmm.h"
+#include "components/bench.h"
+#include "components/vma.h"
+#include "components/klog.h"
+#include "components/softirq.h"
 #include "../drivers/init.h"
 #include "../libk/io.h"
+#include "../libk/memory.h"
 #include "../drivers/timer.h"
 #include "../drivers/paging.h"
+#include "../drivers/cpu.h"
+#include "../drivers/serial.h"
+#include "../drivers/vga.h"
+#include "../drivers/fb.h"
+#include "../drivers/acpi.h"
+#include "../drivers/ioapic.h"
+#include "../drivers/port.h"
+
+// QEMU isa-debug-exit port used by 'make run-headless'
+#define QEMU_EXIT_PORT 0xF4
 
-void clear_vga_buffer(uint8_t color)
+static void print_memory_map(const struct boot_info* boot_info)
 {
-    uint16_t blank = (color << 8) | ' ';
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; ++i)
-        VGAMEMORY[i] = blank;
+    uint64_t usable = 0;
+    for (uint32_t i = 0; i < boot_info->mmap_count; i++)
+    {
+        const struct e820_entry* entry = &boot_info->mmap[i];
+        if (entry->type == E820_USABLE)
+            usable += entry->length;
+    }
+    printf("Memory: %llu KB usable in %u E820 regions\n", usable >> 10, boot_info->mmap_count);
 }
 
-void kernel_main()
+void kernel_main(struct boot_info* boot_info, uint64_t kernel_start_tsc)
 {
     __asm__ volatile("cli"); 
+    // In a VBE mode the text buffer isn't on screen, init_fb takes over later
+    if (boot_info->magic != BOOT_INFO_MAGIC || !boot_info->fb_addr)
+        init_vga(VGA_COLOR(VGA_WHITE, VGA_BLACK));
     
-    clear_vga_buffer(0x0F);
+    if (boot_info->magic != BOOT_INFO_MAGIC)
+    {
+        printf("Bad boot info magic: 0x%x\n", boot_info->magic);
+        while (1)
+            __asm__("hlt");
+    }
+
+    timeline_init(boot_info, kernel_start_tsc);
+    init_serial();
+    // Nothing is on screen until init_fb takes over, or ever if it fails
+    if (boot_info->fb_addr)
+        serial_take_console();
+    timeline_mark("init_serial");
+    init_klog();
+    timeline_mark("init_klog");
     init_cpu();
+    timeline_mark("init_cpu");
     init_gdt();
+    timeline_mark("init_gdt");
+    init_physmap(boot_info);
+    timeline_mark("init_physmap");
+    init_pmm(boot_info);
+    timeline_mark("init_pmm");
+    init_heap();
+    timeline_mark("init_heap");
     init_paging();
+    timeline_mark("init_paging");
+    init_fb(boot_info);
+    timeline_mark("init_fb");
+    init_vma();
+    timeline_mark("init_vma");
     init_idt();
+    timeline_mark("init_idt");
+    init_softirq();
+    timeline_mark("init_softirq");
     init_interrupt_handlers();
+    timeline_mark("init_interrupt_handlers");
+    init_serial_irq();
+    timeline_mark("init_serial_irq");
     init_apic();
+    timeline_mark("init_apic");
+    if (init_acpi())
+        init_ioapic();
+    timeline_mark("init_ioapic");
     init_timer(100);
+    timeline_mark("init_timer");
 
+    print_memory_map(boot_info);
+    pmm_print_stats();
+    printf("Memory routines: %s\n", memory_variant());
+    printf("Interrupt routing: %s\n", ioapic_active() ? "I/O APIC" : "8259 PIC");
+#ifdef BENCH
+    run_benchmarks();
+#endif
+#ifdef HEADLESS
+    timeline_report_serial();
+    outb(QEMU_EXIT_PORT, 0);
+#else
+    timeline_report();
+#endif
     printf("All initialized, enabling interrupts\n");
     __asm__ volatile("sti");
     
@@ -39,6 +112,18 @@ void kernel_main()
     printf(".");
     printf(".");
     
+    // Idle, finish deferred work interrupt exits ran out of budget for
+    // and print the log whenever an interrupt left something in it. The
+    // check runs with interrupts off so work queued between it and hlt
+    // still wakes us through the sti shadow
     while(1) 
-        __asm__("hlt");
+    {
+        softirq_idle();
+        klog_flush(0);
+        __asm__ volatile("cli");
+        if (klog_pending() || softirq_pending())
+            __asm__ volatile("sti");
+        else
+            __asm__ volatile("sti; hlt");
+    }
 }
\ No newline at end of file
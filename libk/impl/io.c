@@ -6,425 +6,734 @@
 #include "../memory.h"
 #include "../string.h"
 
-#define VGA_MEMORY ((uint16_t*)0xFFFFFFFF800B8000)
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
+#define MAX_NUMBER_LENGTH 24            // 22 octal digits for 64 bits
+#define FORMAT_STAGE_SIZE 128           // Output batched per sink write
+#define FORMAT_COPY_INLINE 16           // Shorter runs are copied in place
 
-#define VGA_BLACK 0
-#define VGA_LIGHT_GREY 7
-#define VGA_WHITE 15
-
-#define VGA_COLOR(fg, bg) ((bg << 4) | fg)
-#define VGA_ENTRY(c, color) ((uint16_t)(c) | ((uint16_t)(color) << 8))
-
-#define MAX_NUMBER_LENGTH 32
-#define PRINT_BUF_SIZE 1024
+// Conversion flags
+#define FMT_LEFT  (1 << 0)              // '-'
+#define FMT_ZERO  (1 << 1)              // '0'
+#define FMT_ALT   (1 << 2)              // '#'
+#define FMT_PLUS  (1 << 3)              // '+'
+#define FMT_SPACE (1 << 4)              // ' '
 
 static const char hex_chars[] = "0123456789ABCDEF";
 static const char hex_chars_lower[] = "0123456789abcdef";
 
-static size_t vga_row = 0;
-static size_t vga_col = 0;
-static uint8_t vga_color = VGA_COLOR(VGA_WHITE, VGA_BLACK);
-static uint16_t* vga_buffer = VGA_MEMORY;
+// "00" to "99", each division by 100 yields two digits
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static format_sink_t* consoles[CONSOLE_MAX];
+
+void putc(char c)
+{
+    console_write(CONSOLE_VGA, &c, 1);
+}
+
+void puts(const char* str)
+{
+    console_write(CONSOLE_VGA, str, strlen(str));
+    putc('\n');
+}
+
+/**
+ * Make a sink available to dprintf
+ * @param console: One of the CONSOLE_* numbers
+ * @param sink: Sink to route it to, NULL to drop its output
+ * @return: false if console is out of range
+ */
+bool console_register(int console, format_sink_t* sink)
+{
+    if (console < 0 || console >= CONSOLE_MAX)
+        return false;
+    consoles[console] = sink;
+    return true;
+}
+
+/**
+ * Sink behind a console, two consoles may share one
+ * @param console: One of the CONSOLE_* numbers
+ * @return: NULL if it has none or console is out of range
+ */
+format_sink_t* console_sink(int console)
+{
+    if (console < 0 || console >= CONSOLE_MAX)
+        return NULL;
+    return consoles[console];
+}
 
-static void vga_scroll() 
+/**
+ * Write text to a console as is, without formatting
+ * @param console: One of the CONSOLE_* numbers
+ * @param data: Text to write
+ * @param len: Number of bytes
+ * @return: false if the console has no sink
+ */
+bool console_write(int console, const char* data, size_t len)
 {
-    memcpy(vga_buffer, 
-           vga_buffer + VGA_WIDTH,
-           (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
-    
-    for (size_t x = 0; x < VGA_WIDTH; x++)
-        vga_buffer[(VGA_HEIGHT-1) * VGA_WIDTH + x] = VGA_ENTRY(' ', vga_color);
-    
-    vga_row--;
+    if (console < 0 || console >= CONSOLE_MAX || !consoles[console])
+        return false;
+    consoles[console]->write(consoles[console], data, len);
+    return true;
 }
 
-void vga_putchar(const char c)
+// Keeps buf NUL terminated after every write, counting what did not fit
+static void string_sink_write(format_sink_t* sink, const char* data, size_t len)
 {
-    switch (c) 
+    string_sink_t* str = (string_sink_t*)sink;
+    if (str->len + 1 < str->size)
     {
-        case '\n':
-            vga_col = 0;
-            vga_row++;
-            break;
-        case '\r':
-            vga_col = 0;
-            break;
-        case '\t':
-            vga_col = (vga_col + 8) & ~7;
-            break;
-        case '\b':
-            if (vga_col > 0) 
-                vga_col--;
-            break;
-        default:
-        {
-            size_t index = vga_row * VGA_WIDTH + vga_col;
-            vga_buffer[index] = VGA_ENTRY(c, vga_color);
-            vga_col++;
-            break;
-        }
+        size_t room = str->size - 1 - str->len;
+        size_t n = len < room ? len : room;
+        memcpy(str->buf + str->len, data, n);
+        str->buf[str->len + n] = '\0';
     }
+    str->len += len;
+}
+
+/**
+ * Set up a sink that fills buf, truncating at size - 1 bytes
+ * @param sink: Sink to initialise
+ * @param buf: Destination, may be NULL if size is 0
+ * @param size: Size of buf including the terminator
+ */
+void string_sink_init(string_sink_t* sink, char* buf, size_t size)
+{
+    sink->sink.write = string_sink_write;
+    sink->buf = buf;
+    sink->size = size;
+    sink->len = 0;
+    if (size)
+        buf[0] = '\0';
+}
+
+static void ring_sink_write(format_sink_t* sink, const char* data, size_t len)
+{
+    ring_sink_t* ring = (ring_sink_t*)sink;
 
-    if (vga_col >= VGA_WIDTH)
+    // Only the newest size bytes would survive anyway
+    if (len > ring->size)
     {
-        vga_col = 0;
-        vga_row++;
+        data += len - ring->size;
+        ring->head += len - ring->size;
+        len = ring->size;
     }
 
-    if (vga_row >= VGA_HEIGHT)
-        vga_scroll();
+    size_t at = ring->head & (ring->size - 1);
+    size_t first = len < ring->size - at ? len : ring->size - at;
+    memcpy(ring->buf + at, data, first);
+    memcpy(ring->buf, data + first, len - first);
+    ring->head += len;
 }
 
-void putc(char c)
+/**
+ * Set up a sink that keeps the newest size bytes written to it
+ * @param ring: Sink to initialise
+ * @param buf: Storage
+ * @param size: Size of buf, a power of two
+ */
+void ring_sink_init(ring_sink_t* ring, char* buf, size_t size)
 {
-    vga_putchar(c);
+    ring->sink.write = ring_sink_write;
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = 0;
 }
 
-void puts(const char* str)
+/**
+ * Copy out bytes written since a reader's position. A reader that fell
+ * more than a buffer behind skips to the oldest byte still held
+ * @param ring: Ring to read
+ * @param pos: Reader position, 0 for the start, advanced past the bytes read
+ * @param out: Destination
+ * @param len: Size of out
+ * @return: Number of bytes copied
+ */
+size_t ring_sink_read(ring_sink_t* ring, uint64_t* pos, char* out, size_t len)
 {
-    while (*str)
-        putc(*str++);
-    putc('\n');
+    if (ring->head - *pos > ring->size)
+        *pos = ring->head - ring->size;
+
+    size_t avail = ring->head - *pos;
+    size_t n = len < avail ? len : avail;
+    size_t at = *pos & (ring->size - 1);
+    size_t first = n < ring->size - at ? n : ring->size - at;
+    memcpy(out, ring->buf + at, first);
+    memcpy(out + first, ring->buf, n - first);
+    *pos += n;
+    return n;
 }
 
-static void utoa(uint64_t value, char* buf, int base, bool uppercase)
+// vformat output, staged so the sink sees a few large writes. Without
+// a sink buf is the caller's string and output past cap is dropped
+typedef struct
 {
-    char tmp[MAX_NUMBER_LENGTH];
-    char* ptr = tmp;
-    const char* chars = uppercase ? hex_chars : hex_chars_lower;
+    format_sink_t* sink;
+    char* buf;
+    size_t cap;
+    size_t used;
+    size_t done;                        // Bytes passed to the sink or dropped
+} format_out_t;
 
-    if (value == 0) 
+static void out_flush(format_out_t* out)
+{
+    if (out->used)
+        out->sink->write(out->sink, out->buf, out->used);
+    out->done += out->used;
+    out->used = 0;
+}
+
+// Output that does not fit: flush to the sink, or truncate a string
+static void out_overflow(format_out_t* out, const char* data, size_t len)
+{
+    if (!out->sink)
     {
-        *buf++ = '0';
-        *buf = '\0';
+        size_t room = out->cap - out->used;
+        memcpy(out->buf + out->used, data, room);
+        out->used += room;
+        out->done += len - room;
         return;
     }
 
-    do 
+    out_flush(out);
+    // Runs longer than the stage skip the copy
+    if (len >= out->cap)
     {
-        *ptr++ = chars[value % base];
-        value /= base;
-    } 
-    while (value);
-
-    while (ptr > tmp)
-        *buf++ = *--ptr;
-    *buf = '\0';
+        out->sink->write(out->sink, data, len);
+        out->done += len;
+        return;
+    }
+    memcpy(out->buf, data, len);
+    out->used = len;
 }
 
-static void itoa(int64_t value, char* buf, int base)
+static inline void out_write(format_out_t* out, const char* data, size_t len)
 {
-    if (value < 0) 
+    if (len > out->cap - out->used)
+    {
+        out_overflow(out, data, len);
+        return;
+    }
+
+    // Most runs are a separator or a number, not worth a memcpy call
+    char* to = out->buf + out->used;
+    if (len <= FORMAT_COPY_INLINE)
     {
-        *buf++ = '-';
-        utoa(-value, buf, base, true);
-    } 
-    else 
+        for (size_t i = 0; i < len; i++)
+            to[i] = data[i];
+    }
+    else
     {
-        utoa(value, buf, base, true);
+        memcpy(to, data, len);
     }
+    out->used += len;
 }
 
-int printf(const char* format, ...)
+// A NUL terminated string, copied as it is scanned while the output has room
+static void out_puts(format_out_t* out, const char* s)
 {
-    va_list args;
-    va_start(args, format);
-    int ret = 0;
-    char num_buf[MAX_NUMBER_LENGTH];
-
-    while (*format)
+    char* to = out->buf + out->used;
+    size_t room = out->cap - out->used;
+    size_t i = 0;
+    while (i < room && s[i])
     {
-        if (*format != '%') 
-        {
-            putc(*format++);
-            ret++;
-            continue;
-        }
+        to[i] = s[i];
+        i++;
+    }
+    out->used += i;
+    if (s[i])
+        out_write(out, s + i, strlen(s + i));
+}
 
-        format++;
-        bool is_long_long = false;
-        if (*format == 'l') 
+static void out_fill(format_out_t* out, char c, size_t n)
+{
+    while (n)
+    {
+        if (out->used == out->cap)
         {
-            format++;
-            if (*format == 'l') 
+            if (!out->sink)
             {
-                is_long_long = true;
-                format++;
+                out->done += n;
+                return;
             }
+            out_flush(out);
+        }
+        size_t room = out->cap - out->used;
+        size_t chunk = n < room ? n : room;
+        char* to = out->buf + out->used;
+        if (chunk <= FORMAT_COPY_INLINE)
+        {
+            for (size_t i = 0; i < chunk; i++)
+                to[i] = c;
         }
-       
-        switch (*format) 
+        else
         {
-            case 'c': 
+            memset(to, c, chunk);
+        }
+        out->used += chunk;
+        n -= chunk;
+    }
+}
+
+static const uint64_t powers_of_10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL,
+    10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+    10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+// Digits value takes in base 10 for a shift of 0, else in base 1 << shift.
+// The bit length gives the count directly for powers of two and picks
+// the power of ten to compare with for base 10
+static size_t digit_count(uint64_t value, int shift)
+{
+    size_t bits = 64 - __builtin_clzll(value | 1);
+    if (shift == 4)
+        return (bits + 3) >> 2;
+    if (shift == 3)
+        return (bits + 2) / 3;
+
+    size_t guess = (bits * 1233) >> 12;     // 1233 / 4096 ~ log10(2)
+    return guess + ((value | 1) >= powers_of_10[guess]);
+}
+
+// Decimal digits of value ending at end. Division by the constant 100
+// compiles to a multiply, in 32 bits once the value fits
+static void format_dec(char* end, uint64_t value)
+{
+    while (value > 0xFFFFFFFF)
+    {
+        uint64_t q = value / 100;
+        uint32_t r = (uint32_t)(value - q * 100) * 2;
+        end -= 2;
+        end[0] = digit_pairs[r];
+        end[1] = digit_pairs[r + 1];
+        value = q;
+    }
+
+    uint32_t v = (uint32_t)value;
+    while (v >= 100)
+    {
+        uint32_t q = v / 100;
+        uint32_t r = (v - q * 100) * 2;
+        end -= 2;
+        end[0] = digit_pairs[r];
+        end[1] = digit_pairs[r + 1];
+        v = q;
+    }
+
+    if (v >= 10)
+    {
+        end[-2] = digit_pairs[v * 2];
+        end[-1] = digit_pairs[v * 2 + 1];
+    }
+    else
+    {
+        end[-1] = '0' + v;
+    }
+}
+
+// Power of two bases are shifts and masks, no division at all
+static void format_pow2(char* end, uint64_t value, int shift, const char* digits)
+{
+    uint64_t mask = (1ULL << shift) - 1;
+    do
+    {
+        *--end = digits[value & mask];
+        value >>= shift;
+    }
+    while (value);
+}
+
+// The len digits of value, written in place when the output has room
+static void out_digits(format_out_t* out, uint64_t value, char conv, size_t len)
+{
+    char buf[MAX_NUMBER_LENGTH];
+    bool direct = len <= out->cap - out->used;
+    char* end = (direct ? out->buf + out->used : buf) + len;
+
+    switch (conv)
+    {
+        case 'x':
+            format_pow2(end, value, 4, hex_chars_lower);
+            break;
+        case 'X':
+        case 'p':
+            format_pow2(end, value, 4, hex_chars);
+            break;
+        case 'o':
+            format_pow2(end, value, 3, hex_chars);
+            break;
+        default:
+            format_dec(end, value);
+            break;
+    }
+
+    if (direct)
+        out->used += len;
+    else
+        out_write(out, buf, len);
+}
+
+/**
+ * Emit one integer conversion with flags, precision or padding
+ * @param out: Output
+ * @param value: Magnitude
+ * @param sign: '-', '+', ' ' or 0
+ * @param conv: Conversion character, d u x X o or p
+ * @param flags: FMT_* flags
+ * @param width: Minimum field width
+ * @param precision: Minimum digits, -1 if not given
+ */
+static void format_int_padded(format_out_t* out, uint64_t value, char sign, char conv,
+                              uint32_t flags, int width, int precision)
+{
+    int shift = conv == 'd' || conv == 'u' ? 0 : conv == 'o' ? 3 : 4;
+
+    // An explicit precision of 0 prints nothing for a zero value
+    size_t len = value || precision != 0 ? digit_count(value, shift) : 0;
+
+    // Alternate octal form only guarantees a leading zero
+    if (conv == 'o' && (flags & FMT_ALT) && (value || len == 0) &&
+        (precision < 0 || (size_t)precision <= len))
+        precision = len + 1;
+
+    char prefix[3];
+    size_t prefix_len = 0;
+    if (sign)
+        prefix[prefix_len++] = sign;
+    if (conv == 'p' || ((flags & FMT_ALT) && value && (conv == 'x' || conv == 'X')))
+    {
+        prefix[prefix_len++] = '0';
+        prefix[prefix_len++] = conv == 'X' ? 'X' : 'x';
+    }
+
+    size_t zeros = precision > 0 && (size_t)precision > len ? precision - len : 0;
+    size_t body = prefix_len + zeros + len;
+    size_t field = width > 0 ? (size_t)width : 0;
+    if ((flags & (FMT_ZERO | FMT_LEFT)) == FMT_ZERO && precision < 0 && field > body)
+    {
+        zeros += field - body;
+        body = field;
+    }
+
+    size_t pad = field > body ? field - body : 0;
+    if (pad && !(flags & FMT_LEFT))
+        out_fill(out, ' ', pad);
+    if (prefix_len)
+        out_write(out, prefix, prefix_len);
+    if (zeros)
+        out_fill(out, '0', zeros);
+    if (len)
+        out_digits(out, value, conv, len);
+    if (pad && (flags & FMT_LEFT))
+        out_fill(out, ' ', pad);
+}
+
+// Most conversions are a bare %d or %x, those skip the field layout
+static inline void format_int(format_out_t* out, uint64_t value, char sign, char conv,
+                              uint32_t flags, int width, int precision)
+{
+    if (flags || width || precision >= 0 || conv == 'p')
+    {
+        format_int_padded(out, value, sign, conv, flags, width, precision);
+        return;
+    }
+
+    if (sign)
+        out_write(out, &sign, 1);
+    out_digits(out, value, conv, digit_count(value, conv == 'd' || conv == 'u' ? 0 : conv == 'o' ? 3 : 4));
+}
+
+static inline void format_str(format_out_t* out, const char* s, size_t len, uint32_t flags, int width)
+{
+    size_t pad = width > 0 && (size_t)width > len ? width - len : 0;
+    if (!(flags & FMT_LEFT))
+        out_fill(out, ' ', pad);
+    out_write(out, s, len);
+    if (flags & FMT_LEFT)
+        out_fill(out, ' ', pad);
+}
+
+// Argument sizes from the length modifier
+typedef enum
+{
+    ARG_INT,
+    ARG_CHAR,                           // hh
+    ARG_SHORT,                          // h
+    ARG_LONG,                           // l ll z j t, all 64 bits here
+} arg_size_t;
+
+static int64_t arg_signed(va_list* args, arg_size_t size)
+{
+    switch (size)
+    {
+        case ARG_LONG:
+            return va_arg(*args, int64_t);
+        case ARG_SHORT:
+            return (int16_t)va_arg(*args, int);
+        case ARG_CHAR:
+            return (int8_t)va_arg(*args, int);
+        default:
+            return va_arg(*args, int);
+    }
+}
+
+static uint64_t arg_unsigned(va_list* args, arg_size_t size)
+{
+    switch (size)
+    {
+        case ARG_LONG:
+            return va_arg(*args, uint64_t);
+        case ARG_SHORT:
+            return (uint16_t)va_arg(*args, unsigned int);
+        case ARG_CHAR:
+            return (uint8_t)va_arg(*args, unsigned int);
+        default:
+            return va_arg(*args, unsigned int);
+    }
+}
+
+/**
+ * The format parser shared by vformat and vsnprintf. Supports the flags
+ * - 0 # + and space, width and precision including *, the hh h l ll z j t
+ * modifiers and the conversions c s d i u x X o p %. %p prints 0x and 16
+ * uppercase digits. Unknown conversions are printed as written
+ * @param out: Output, flushed by the caller
+ * @param fmt: Format string
+ * @param args: Arguments
+ */
+static void format_run(format_out_t* out, const char* fmt, va_list args)
+{
+    va_list ap;
+    va_copy(ap, args);
+
+    while (*fmt)
+    {
+        // Literal text up to the next conversion is a single run
+        const char* run = fmt;
+        while (*fmt && *fmt != '%')
+            fmt++;
+        if (fmt != run)
+            out_write(out, run, fmt - run);
+        if (!*fmt)
+            break;
+
+        const char* spec = fmt++;
+        uint32_t flags = 0;
+        int width = 0;
+        int precision = -1;
+
+        // Flags, width and precision all sort below 'A', a bare
+        // conversion like %d or %llx skips straight to the length
+        if (*fmt < 'A')
+        {
+            for (;; fmt++)
             {
-                char c = va_arg(args, int);
-                putc(c);
-                ret++;
-                break;
+                if (*fmt == '-')
+                    flags |= FMT_LEFT;
+                else if (*fmt == '0')
+                    flags |= FMT_ZERO;
+                else if (*fmt == '#')
+                    flags |= FMT_ALT;
+                else if (*fmt == '+')
+                    flags |= FMT_PLUS;
+                else if (*fmt == ' ')
+                    flags |= FMT_SPACE;
+                else
+                    break;
             }
-            case 's':
+
+            if (*fmt == '*')
             {
-                char* s = va_arg(args, char*);
-                if (!s) s = "(null)";
-                while (*s) 
+                width = va_arg(ap, int);
+                if (width < 0)
                 {
-                    putc(*s++);
-                    ret++;
+                    flags |= FMT_LEFT;
+                    width = -width;
                 }
-                break;
+                fmt++;
             }
-            case 'd':
-            case 'i': 
+            while (*fmt >= '0' && *fmt <= '9')
+                width = width * 10 + (*fmt++ - '0');
+
+            if (*fmt == '.')
             {
-                int64_t num;
-                if (is_long_long) 
-                {
-                    num = va_arg(args, int64_t);
-                } 
-                else 
+                fmt++;
+                precision = 0;
+                if (*fmt == '*')
                 {
-                    num = va_arg(args, int);
+                    precision = va_arg(ap, int);
+                    if (precision < 0)
+                        precision = -1;
+                    fmt++;
                 }
-                itoa(num, num_buf, 10);
-                char* s = num_buf;
-                while (*s) 
-                {
-                    putc(*s++);
-                    ret++;
-                }
-                break;
+                while (*fmt >= '0' && *fmt <= '9')
+                    precision = precision * 10 + (*fmt++ - '0');
             }
-            case 'u': 
+        }
+
+        arg_size_t size = ARG_INT;
+        if (*fmt == 'h')
+        {
+            size = fmt[1] == 'h' ? ARG_CHAR : ARG_SHORT;
+            fmt += size == ARG_CHAR ? 2 : 1;
+        }
+        else if (*fmt == 'l' || *fmt == 'z' || *fmt == 'j' || *fmt == 't')
+        {
+            size = ARG_LONG;
+            fmt += fmt[0] == 'l' && fmt[1] == 'l' ? 2 : 1;
+        }
+
+        char conv = *fmt;
+        switch (conv)
+        {
+            case 'd':
+            case 'i':
             {
-                uint64_t num;
-                if (is_long_long) 
-                {
-                    num = va_arg(args, uint64_t);
-                } 
-                else 
-                {
-                    num = va_arg(args, unsigned int);
-                }
-                utoa(num, num_buf, 10, false);
-                char* s = num_buf;
-                while (*s) 
-                {
-                    putc(*s++);
-                    ret++;
-                }
+                int64_t value = arg_signed(&ap, size);
+                char sign = value < 0 ? '-' : flags & FMT_PLUS ? '+' : flags & FMT_SPACE ? ' ' : 0;
+                uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+                format_int(out, magnitude, sign, 'd', flags, width, precision);
                 break;
             }
+            case 'u':
             case 'x':
-            case 'X': 
+            case 'X':
+            case 'o':
+                format_int(out, arg_unsigned(&ap, size), 0, conv, flags, width, precision);
+                break;
+            case 'p':
             {
-                uint64_t num;
-                if (is_long_long) 
-                {
-                    num = va_arg(args, uint64_t);
-                } 
-                else 
-                {
-                    num = va_arg(args, unsigned int);
-                }
-                putc('0');
-                putc('x');
-                ret += 2;
-                
-                utoa(num, num_buf, 16, *format == 'X');
-                if (is_long_long) 
-                {
-                    size_t len = strlen(num_buf);
-                    while (len < 16)
-                    {
-                        putc('0');
-                        ret++;
-                        len++;
-                    }
-                }
-                
-                char* s = num_buf;
-                while (*s) 
-                {
-                    putc(*s++);
-                    ret++;
-                }
+                uint64_t value = (uintptr_t)va_arg(ap, void*);
+                format_int(out, value, 0, 'p', flags, width, precision < 0 ? 16 : precision);
                 break;
             }
-            case 'p': 
+            case 'c':
             {
-                void* ptr = va_arg(args, void*);
-                putc('0');
-                putc('x');
-                ret += 2;
-                utoa((uint64_t)ptr, num_buf, 16, true);
-                size_t len = strlen(num_buf);
-                while (len < 16) 
-                {
-                    putc('0');
-                    ret++;
-                    len++;
-                }
-                char* s = num_buf;
-                while (*s) 
-                {
-                    putc(*s++);
-                    ret++;
-                }
+                char c = (char)va_arg(ap, int);
+                format_str(out, &c, 1, flags, width);
+                break;
+            }
+            case 's':
+            {
+                const char* s = va_arg(ap, const char*);
+                if (!s)
+                    s = "(null)";
+                if (!width && precision < 0)
+                    out_puts(out, s);
+                else
+                    format_str(out, s, precision < 0 ? strlen(s) : strnlen(s, precision), flags, width);
                 break;
             }
             case '%':
-                putc('%');
-                ret++;
+                out_write(out, "%", 1);
                 break;
+            case '\0':
+                // A lone % at the end
+                out_write(out, spec, fmt - spec);
+                continue;
             default:
-                putc('%');
-                putc(*format);
-                ret += 2;
+                out_write(out, spec, fmt + 1 - spec);
                 break;
         }
-        format++;
+        fmt++;
     }
 
+    va_end(ap);
+}
+
+/**
+ * Format to a sink, the engine behind printf and dprintf
+ * @param sink: Destination of the output
+ * @param fmt: Format string
+ * @param args: Arguments
+ * @return: Number of bytes produced
+ */
+int vformat(format_sink_t* sink, const char* fmt, va_list args)
+{
+    char stage[FORMAT_STAGE_SIZE];
+    format_out_t out = { sink, stage, sizeof(stage), 0, 0 };
+    format_run(&out, fmt, args);
+    out_flush(&out);
+    return (int)out.done;
+}
+
+int vprintf(const char* format, va_list args)
+{
+    return vdprintf(CONSOLE_VGA, format, args);
+}
+
+int printf(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int ret = vprintf(format, args);
     va_end(args);
     return ret;
 }
 
+/**
+ * Format into a buffer, truncating to size - 1 bytes plus the terminator
+ * @return: Length of the untruncated output, as C's vsnprintf
+ */
+int vsnprintf(char* buf, size_t size, const char* fmt, va_list args)
+{
+    // Formats in place, the buffer is the stage and nothing is flushed
+    format_out_t out = { NULL, buf, size ? size - 1 : 0, 0, 0 };
+    format_run(&out, fmt, args);
+    if (size)
+        buf[out.used] = '\0';
+    return (int)(out.done + out.used);
+}
+
 int snprintf(char* buf, size_t size, const char* fmt, ...)
 {
-    if (!buf || size == 0)
-        return 0;
-    
     va_list args;
     va_start(args, fmt);
-    size_t pos = 0;
-    char num_buf[MAX_NUMBER_LENGTH];
+    int ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return ret;
+}
 
-    while (*fmt && pos < size - 1)
-    {
-        if (*fmt != '%') 
-        {
-            buf[pos++] = *fmt++;
-            continue;
-        }
+/**
+ * Format to a registered console
+ * @param console: One of the CONSOLE_* numbers
+ * @return: Number of bytes produced, 0 if the console has no sink
+ */
+int vdprintf(int console, const char* fmt, va_list args)
+{
+    if (console < 0 || console >= CONSOLE_MAX || !consoles[console])
+        return 0;
+    return vformat(consoles[console], fmt, args);
+}
 
-        fmt++; // Skip '%'
-        switch (*fmt) 
-        {
-            case 'c': 
-            {
-                char c = va_arg(args, int);
-                if (pos < size - 1)
-                    buf[pos++] = c;
-                break;
-            }
-            case 's': 
-            {
-                char* s = va_arg(args, char*);
-                if (!s) 
-                    s = "(null)";
-                while (*s && pos < size - 1)
-                    buf[pos++] = *s++;
-                break;
-            }
-            case 'd':
-            case 'i': 
-            {
-                int64_t num = va_arg(args, int64_t);
-                itoa(num, num_buf, 10);
-                char* s = num_buf;
-                while (*s && pos < size - 1)
-                    buf[pos++] = *s++;
-                break;
-            }
-            case 'u': 
-            {
-                uint64_t num = va_arg(args, uint64_t);
-                utoa(num, num_buf, 10, false);
-                char* s = num_buf;
-                while (*s && pos < size - 1)
-                    buf[pos++] = *s++;
-                break;
-            }
-            case 'x':
-            case 'X': 
-            {
-                uint64_t num = va_arg(args, uint64_t);
-                utoa(num, num_buf, 16, *fmt == 'X');
-                char* s = num_buf;
-                while (*s && pos < size - 1)
-                    buf[pos++] = *s++;
-                break;
-            }
-            case 'p': 
-            {
-                void* ptr = va_arg(args, void*);
-                if (pos < size - 2) 
-                {
-                    buf[pos++] = '0';
-                    buf[pos++] = 'x';
-                    utoa((uint64_t)ptr, num_buf, 16, true);
-                    // Pad with 0s
-                    size_t len = strlen(num_buf);
-                    while (len < 16 && pos < size - 1) 
-                    {
-                        buf[pos++] = '0';
-                        len++;
-                    }
-                    char* s = num_buf;
-                    while (*s && pos < size - 1)
-                        buf[pos++] = *s++;
-                }
-                break;
-            }
-            case '%':
-                if (pos < size - 1)
-                    buf[pos++] = '%';
-                break;
-            default:
-                if (pos < size - 2) 
-                {
-                    buf[pos++] = '%';
-                    buf[pos++] = *fmt;
-                }
-                break;
-        }
-        fmt++;
-    }
-    
-    buf[pos] = '\0';
+int dprintf(int console, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int ret = vdprintf(console, fmt, args);
     va_end(args);
-    return pos;
+    return ret;
 }
 
 void print_hex(uint64_t value)
 {
-    char buf[MAX_NUMBER_LENGTH];
-    utoa(value, buf, 16, true);
-    puts(buf);
+    printf("%llX\n", value);
 }
 
 void print_dec(int64_t value)
 {
-    char buf[MAX_NUMBER_LENGTH];
-    itoa(value, buf, 10);
-    puts(buf);
+    printf("%lld\n", value);
 }
 
 void print_ptr(void* ptr)
 {
-    char buf[MAX_NUMBER_LENGTH];
-    putc('0');
-    putc('x');
-    utoa((uint64_t)ptr, buf, 16, true);
-    // Pad with 0s
-    // Check if its actually 16 characters
-    size_t len = strlen(buf);
-    while (len < 16) 
-    {
-        putc('0');
-        len++;
-    }
-    puts(buf);
-}
\ No newline at end of file
+    printf("%p\n", ptr);
+}
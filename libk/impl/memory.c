@@ -4,6 +4,476 @@
 
 #include "../memory.h"
 
+#define SIZE_NONE ((size_t)-1)
+
+typedef uint16_t __attribute__((aligned(1), may_alias)) u16_unaligned_t;
+typedef uint32_t __attribute__((aligned(1), may_alias)) u32_unaligned_t;
+typedef uint64_t __attribute__((aligned(1), may_alias)) u64_unaligned_t;
+
+// Vector types, only usable inside functions built for SSE2 or AVX2
+typedef long long vec128_t __attribute__((vector_size(16)));
+typedef long long vec128_unaligned_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char bytes128_t __attribute__((vector_size(16)));
+typedef long long vec256_t __attribute__((vector_size(32)));
+typedef long long vec256_unaligned_t __attribute__((vector_size(32), aligned(1), may_alias));
+typedef char bytes256_t __attribute__((vector_size(32)));
+
+typedef struct
+{
+    const char* name;
+    void (*copy)(uint8_t* d, const uint8_t* s, size_t n, bool nt);
+    void (*copy_back)(uint8_t* d, const uint8_t* s, size_t n);
+    void (*set)(uint8_t* d, uint8_t c, size_t n, bool nt);
+    int (*cmp)(const uint8_t* a, const uint8_t* b, size_t n);
+} mem_kernels_t;
+
+// Chosen once by memory_select(), the defaults work on any x86_64 CPU
+static const mem_kernels_t* mem_vector = NULL;
+static size_t mem_rep_min = SIZE_NONE;  // Smallest size handed to rep movsb/stosb
+static size_t mem_nt_min = SIZE_NONE;   // Smallest size written with non-temporal stores
+static const char* mem_variant = "words";
+
+volatile uint32_t simd_hold = 0;
+
+static inline uint16_t load16(const void* p) { return *(const u16_unaligned_t*)p; }
+static inline uint32_t load32(const void* p) { return *(const u32_unaligned_t*)p; }
+static inline uint64_t load64(const void* p) { return *(const u64_unaligned_t*)p; }
+static inline void store16(void* p, uint16_t v) { *(u16_unaligned_t*)p = v; }
+static inline void store32(void* p, uint32_t v) { *(u32_unaligned_t*)p = v; }
+static inline void store64(void* p, uint64_t v) { *(u64_unaligned_t*)p = v; }
+
+static inline void rep_movsb(uint8_t* d, const uint8_t* s, size_t n)
+{
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(uint8_t* d, uint8_t c, size_t n)
+{
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+}
+
+// Up to 16 bytes as two overlapping moves, both loads happen before
+// either store so overlapping buffers are fine
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t n)
+{
+    if (n >= 8)
+    {
+        uint64_t head = load64(s);
+        uint64_t tail = load64(s + n - 8);
+        store64(d, head);
+        store64(d + n - 8, tail);
+    }
+    else if (n >= 4)
+    {
+        uint32_t head = load32(s);
+        uint32_t tail = load32(s + n - 4);
+        store32(d, head);
+        store32(d + n - 4, tail);
+    }
+    else if (n >= 2)
+    {
+        uint16_t head = load16(s);
+        uint16_t tail = load16(s + n - 2);
+        store16(d, head);
+        store16(d + n - 2, tail);
+    }
+    else if (n)
+        *d = *s;
+}
+
+// Forward word copy for n >= 8, also safe when d is below an overlapping s
+static void copy_words(uint8_t* d, const uint8_t* s, size_t n)
+{
+    uint64_t tail = load64(s + n - 8);
+    for (size_t i = 0; i + 8 < n; i += 8)
+        store64(d + i, load64(s + i));
+    store64(d + n - 8, tail);
+}
+
+// Backward word copy for n >= 8 when d is above an overlapping s
+static void copy_back_words(uint8_t* d, const uint8_t* s, size_t n)
+{
+    uint64_t head = load64(s);
+    while (n > 8)
+    {
+        n -= 8;
+        store64(d + n, load64(s + n));
+    }
+    store64(d, head);
+}
+
+static inline void set_small(uint8_t* d, uint8_t c, size_t n)
+{
+    uint64_t pattern = 0x0101010101010101ULL * c;
+    if (n >= 8)
+    {
+        store64(d, pattern);
+        store64(d + n - 8, pattern);
+    }
+    else if (n >= 4)
+    {
+        store32(d, (uint32_t)pattern);
+        store32(d + n - 4, (uint32_t)pattern);
+    }
+    else if (n >= 2)
+    {
+        store16(d, (uint16_t)pattern);
+        store16(d + n - 2, (uint16_t)pattern);
+    }
+    else if (n)
+        *d = c;
+}
+
+static void set_words(uint8_t* d, uint8_t c, size_t n)
+{
+    uint64_t pattern = 0x0101010101010101ULL * c;
+    for (size_t i = 0; i + 8 < n; i += 8)
+        store64(d + i, pattern);
+    store64(d + n - 8, pattern);
+}
+
+// Difference of the first mismatching byte of two unequal words
+static inline int word_diff(uint64_t a, uint64_t b)
+{
+    int shift = __builtin_ctzll(a ^ b) & ~7;
+    return (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+}
+
+static int cmp_words(const uint8_t* a, const uint8_t* b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x = load64(a + i);
+        uint64_t y = load64(b + i);
+        if (x != y)
+            return word_diff(x, y);
+    }
+
+    // Everything before i matched, so an overlapping last word is exact
+    if (i < n && n >= 8)
+    {
+        uint64_t x = load64(a + n - 8);
+        uint64_t y = load64(b + n - 8);
+        return x != y ? word_diff(x, y) : 0;
+    }
+    for (; i < n; i++)
+    {
+        if (a[i] != b[i])
+            return a[i] - b[i];
+    }
+    return 0;
+}
+
+// The vector kernels below only see n > MEM_INLINE_MAX. Head and tail
+// are unaligned moves, the body uses aligned destination stores
+
+__attribute__((target("sse2")))
+static void sse2_copy(uint8_t* d, const uint8_t* s, size_t n, bool nt)
+{
+    vec128_t head = *(const vec128_unaligned_t*)s;
+    vec128_t tail = *(const vec128_unaligned_t*)(s + n - 16);
+    size_t i = 16 - ((uintptr_t)d & 15);
+    if (nt)
+    {
+        for (; i + 64 <= n - 16; i += 64)
+        {
+            for (int j = 0; j < 64; j += 16)
+                __builtin_ia32_movntdq((vec128_t*)(d + i + j), *(const vec128_unaligned_t*)(s + i + j));
+        }
+        __asm__ volatile("sfence" ::: "memory");
+    }
+    for (; i + 64 <= n - 16; i += 64)
+    {
+        vec128_t a = *(const vec128_unaligned_t*)(s + i);
+        vec128_t b = *(const vec128_unaligned_t*)(s + i + 16);
+        vec128_t c = *(const vec128_unaligned_t*)(s + i + 32);
+        vec128_t e = *(const vec128_unaligned_t*)(s + i + 48);
+        *(vec128_t*)(d + i) = a;
+        *(vec128_t*)(d + i + 16) = b;
+        *(vec128_t*)(d + i + 32) = c;
+        *(vec128_t*)(d + i + 48) = e;
+    }
+    for (; i < n - 16; i += 16)
+        *(vec128_t*)(d + i) = *(const vec128_unaligned_t*)(s + i);
+    *(vec128_unaligned_t*)d = head;
+    *(vec128_unaligned_t*)(d + n - 16) = tail;
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy_back(uint8_t* d, const uint8_t* s, size_t n)
+{
+    vec128_t head = *(const vec128_unaligned_t*)s;
+    vec128_t tail = *(const vec128_unaligned_t*)(s + n - 16);
+    size_t i = n - ((uintptr_t)(d + n) & 15);
+    while (i >= 64 + 16)
+    {
+        i -= 64;
+        vec128_t a = *(const vec128_unaligned_t*)(s + i);
+        vec128_t b = *(const vec128_unaligned_t*)(s + i + 16);
+        vec128_t c = *(const vec128_unaligned_t*)(s + i + 32);
+        vec128_t e = *(const vec128_unaligned_t*)(s + i + 48);
+        *(vec128_t*)(d + i + 48) = e;
+        *(vec128_t*)(d + i + 32) = c;
+        *(vec128_t*)(d + i + 16) = b;
+        *(vec128_t*)(d + i) = a;
+    }
+    while (i > 16)
+    {
+        i -= 16;
+        *(vec128_t*)(d + i) = *(const vec128_unaligned_t*)(s + i);
+    }
+    *(vec128_unaligned_t*)(d + n - 16) = tail;
+    *(vec128_unaligned_t*)d = head;
+}
+
+__attribute__((target("sse2")))
+static void sse2_set(uint8_t* d, uint8_t c, size_t n, bool nt)
+{
+    vec128_t v = (vec128_t)((bytes128_t){ 0 } + (char)c);
+    *(vec128_unaligned_t*)d = v;
+    *(vec128_unaligned_t*)(d + n - 16) = v;
+    size_t i = 16 - ((uintptr_t)d & 15);
+    if (nt)
+    {
+        for (; i < n - 16; i += 16)
+            __builtin_ia32_movntdq((vec128_t*)(d + i), v);
+        __asm__ volatile("sfence" ::: "memory");
+        return;
+    }
+    for (; i + 64 <= n - 16; i += 64)
+    {
+        *(vec128_t*)(d + i) = v;
+        *(vec128_t*)(d + i + 16) = v;
+        *(vec128_t*)(d + i + 32) = v;
+        *(vec128_t*)(d + i + 48) = v;
+    }
+    for (; i < n - 16; i += 16)
+        *(vec128_t*)(d + i) = v;
+}
+
+__attribute__((target("sse2")))
+static inline uint32_t sse2_eq_mask(const uint8_t* a, const uint8_t* b)
+{
+    bytes128_t x = (bytes128_t)*(const vec128_unaligned_t*)a;
+    bytes128_t y = (bytes128_t)*(const vec128_unaligned_t*)b;
+    return (uint32_t)__builtin_ia32_pmovmskb128(x == y);
+}
+
+__attribute__((target("sse2")))
+static int sse2_cmp(const uint8_t* a, const uint8_t* b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint32_t mask = sse2_eq_mask(a + i, b + i);
+        if (mask != 0xFFFF)
+        {
+            size_t k = i + __builtin_ctz(~mask);
+            return a[k] - b[k];
+        }
+    }
+    if (i < n)
+    {
+        uint32_t mask = sse2_eq_mask(a + n - 16, b + n - 16);
+        if (mask != 0xFFFF)
+        {
+            size_t k = n - 16 + __builtin_ctz(~mask);
+            return a[k] - b[k];
+        }
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy(uint8_t* d, const uint8_t* s, size_t n, bool nt)
+{
+    vec256_t head = *(const vec256_unaligned_t*)s;
+    vec256_t tail = *(const vec256_unaligned_t*)(s + n - 32);
+    size_t i = 32 - ((uintptr_t)d & 31);
+    if (nt)
+    {
+        for (; i + 128 <= n - 32; i += 128)
+        {
+            for (int j = 0; j < 128; j += 32)
+                __builtin_ia32_movntdq256((vec256_t*)(d + i + j), *(const vec256_unaligned_t*)(s + i + j));
+        }
+        __asm__ volatile("sfence" ::: "memory");
+    }
+    for (; i + 128 <= n - 32; i += 128)
+    {
+        vec256_t a = *(const vec256_unaligned_t*)(s + i);
+        vec256_t b = *(const vec256_unaligned_t*)(s + i + 32);
+        vec256_t c = *(const vec256_unaligned_t*)(s + i + 64);
+        vec256_t e = *(const vec256_unaligned_t*)(s + i + 96);
+        *(vec256_t*)(d + i) = a;
+        *(vec256_t*)(d + i + 32) = b;
+        *(vec256_t*)(d + i + 64) = c;
+        *(vec256_t*)(d + i + 96) = e;
+    }
+    for (; i < n - 32; i += 32)
+        *(vec256_t*)(d + i) = *(const vec256_unaligned_t*)(s + i);
+    *(vec256_unaligned_t*)d = head;
+    *(vec256_unaligned_t*)(d + n - 32) = tail;
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_back(uint8_t* d, const uint8_t* s, size_t n)
+{
+    vec256_t head = *(const vec256_unaligned_t*)s;
+    vec256_t tail = *(const vec256_unaligned_t*)(s + n - 32);
+    size_t i = n - ((uintptr_t)(d + n) & 31);
+    while (i >= 128 + 32)
+    {
+        i -= 128;
+        vec256_t a = *(const vec256_unaligned_t*)(s + i);
+        vec256_t b = *(const vec256_unaligned_t*)(s + i + 32);
+        vec256_t c = *(const vec256_unaligned_t*)(s + i + 64);
+        vec256_t e = *(const vec256_unaligned_t*)(s + i + 96);
+        *(vec256_t*)(d + i + 96) = e;
+        *(vec256_t*)(d + i + 64) = c;
+        *(vec256_t*)(d + i + 32) = b;
+        *(vec256_t*)(d + i) = a;
+    }
+    while (i > 32)
+    {
+        i -= 32;
+        *(vec256_t*)(d + i) = *(const vec256_unaligned_t*)(s + i);
+    }
+    *(vec256_unaligned_t*)(d + n - 32) = tail;
+    *(vec256_unaligned_t*)d = head;
+}
+
+__attribute__((target("avx2")))
+static void avx2_set(uint8_t* d, uint8_t c, size_t n, bool nt)
+{
+    vec256_t v = (vec256_t)((bytes256_t){ 0 } + (char)c);
+    *(vec256_unaligned_t*)d = v;
+    *(vec256_unaligned_t*)(d + n - 32) = v;
+    size_t i = 32 - ((uintptr_t)d & 31);
+    if (nt)
+    {
+        for (; i < n - 32; i += 32)
+            __builtin_ia32_movntdq256((vec256_t*)(d + i), v);
+        __asm__ volatile("sfence" ::: "memory");
+        return;
+    }
+    for (; i + 128 <= n - 32; i += 128)
+    {
+        *(vec256_t*)(d + i) = v;
+        *(vec256_t*)(d + i + 32) = v;
+        *(vec256_t*)(d + i + 64) = v;
+        *(vec256_t*)(d + i + 96) = v;
+    }
+    for (; i < n - 32; i += 32)
+        *(vec256_t*)(d + i) = v;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t avx2_eq_mask(const uint8_t* a, const uint8_t* b)
+{
+    bytes256_t x = (bytes256_t)*(const vec256_unaligned_t*)a;
+    bytes256_t y = (bytes256_t)*(const vec256_unaligned_t*)b;
+    return (uint32_t)__builtin_ia32_pmovmskb256(x == y);
+}
+
+__attribute__((target("avx2")))
+static int avx2_cmp(const uint8_t* a, const uint8_t* b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        uint32_t mask = avx2_eq_mask(a + i, b + i);
+        if (mask != 0xFFFFFFFF)
+        {
+            size_t k = i + __builtin_ctz(~mask);
+            return a[k] - b[k];
+        }
+    }
+    if (i < n)
+    {
+        uint32_t mask = avx2_eq_mask(a + n - 32, b + n - 32);
+        if (mask != 0xFFFFFFFF)
+        {
+            size_t k = n - 32 + __builtin_ctz(~mask);
+            return a[k] - b[k];
+        }
+    }
+    return 0;
+}
+
+static const mem_kernels_t sse2_kernels = { "sse2", sse2_copy, sse2_copy_back, sse2_set, sse2_cmp };
+static const mem_kernels_t avx2_kernels = { "avx2", avx2_copy, avx2_copy_back, avx2_set, avx2_cmp };
+
+/**
+ * Pick the memory routine variants for this CPU, called once at boot
+ * after the vector state the features imply has been enabled
+ * @features: MEM_* flags the CPU supports
+ * @cache_size: Largest cache in bytes, 0 if unknown
+ */
+void memory_select(uint32_t features, uint64_t cache_size)
+{
+    static const char* names[3][3] = {
+        { "words", "words+erms", "words+fsrm" },
+        { "sse2", "sse2+erms", "sse2+fsrm" },
+        { "avx2", "avx2+erms", "avx2+fsrm" },
+    };
+
+    int vector = 0;
+    mem_vector = NULL;
+    if (features & MEM_AVX2)
+    {
+        mem_vector = &avx2_kernels;
+        vector = 2;
+    }
+    else if (features & MEM_SSE2)
+    {
+        mem_vector = &sse2_kernels;
+        vector = 1;
+    }
+
+    int rep = 0;
+    mem_rep_min = SIZE_NONE;
+    if (features & MEM_FSRM)
+    {
+        mem_rep_min = 0;
+        rep = 2;
+    }
+    else if (features & MEM_ERMS)
+    {
+        mem_rep_min = MEM_ERMS_MIN;
+        rep = 1;
+    }
+
+    // Copies much bigger than the cache would only evict the working set
+    mem_nt_min = SIZE_NONE;
+    if (mem_vector)
+        mem_nt_min = cache_size ? cache_size / 2 : MEM_NT_DEFAULT;
+    mem_variant = names[vector][rep];
+}
+
+/**
+ * Describe the selected memory routines
+ * @return: A name such as "avx2+erms"
+ */
+const char* memory_variant()
+{
+    return mem_variant;
+}
+
+static void set_large(uint8_t* d, uint8_t c, size_t n)
+{
+    bool nt = n >= mem_nt_min;
+    if (n >= mem_rep_min && !nt)
+        rep_stosb(d, c, n);
+    else if (mem_vector && simd_usable())
+        mem_vector->set(d, c, n, nt);
+    else if (n >= mem_rep_min)
+        rep_stosb(d, c, n);
+    else
+        set_words(d, c, n);
+}
+
 /**
  * Fill a region of memory with a repeated byte value
  * @s: Pointer to the destination memory area
@@ -13,42 +483,29 @@
  */
 void* memset(void *s, const int c, size_t count)
 {
-    uint8_t *xs = s;
-    uint8_t b = c;
-    if (count < 8) 
-    {
-        while (count--)
-            *xs++ = b;
-        return s;
-    }
-    
-    // Fill first few bytes to align to word boundary
-    size_t align = -(uintptr_t)xs & (sizeof(size_t) - 1);
-    count -= align;
-    while (align--)
-        *xs++ = b;
-        
-    // Create word-sized pattern
-    size_t pattern = (b << 24) | (b << 16) | (b << 8) | b;
-    pattern = (pattern << 32) | pattern;
-    
-    size_t *xw = (size_t *)xs;
-    
-    // Fill by words
-    while (count >= sizeof(size_t)) 
-    {
-        *xw++ = pattern;
-        count -= sizeof(size_t);
-    }
-    
-    // Fill the remaining bytes
-    xs = (uint8_t *)xw;
-    while (count--)
-        *xs++ = b;
-        
+    uint8_t *d = s;
+    if (count <= 16)
+        set_small(d, c, count);
+    else if (count <= MEM_INLINE_MAX)
+        set_words(d, c, count);
+    else
+        set_large(d, c, count);
     return s;
 }
 
+static void copy_large(uint8_t* d, const uint8_t* s, size_t n)
+{
+    bool nt = n >= mem_nt_min;
+    if (n >= mem_rep_min && !nt)
+        rep_movsb(d, s, n);
+    else if (mem_vector && simd_usable())
+        mem_vector->copy(d, s, n, nt);
+    else if (n >= mem_rep_min)
+        rep_movsb(d, s, n);
+    else
+        copy_words(d, s, n);
+}
+
 /**
  * Copy memory area
  * @dest: Pointer to the destination memory area
@@ -61,37 +518,50 @@ void* memcpy(void *dest, const void *src, size_t count)
 {
     uint8_t *d = dest;
     const uint8_t *s = src;
-    
-    // Handle small copies directly
-    if (count < 8) 
+    if (count <= 16)
+        copy_small(d, s, count);
+    else if (count <= MEM_INLINE_MAX)
+        copy_words(d, s, count);
+    else
+        copy_large(d, s, count);
+    return dest;
+}
+
+/**
+ * Copy memory area, the areas may overlap
+ * @dest: Pointer to the destination memory area
+ * @src: Pointer to the source memory area
+ * @count: Number of bytes to copy
+ * @return: A pointer to dest
+ */
+void* memmove(void *dest, const void *src, size_t count)
+{
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    if (count <= 16)
+    {
+        copy_small(d, s, count);
+        return dest;
+    }
+
+    if ((uintptr_t)d - (uintptr_t)s >= count)
     {
-        while (count--)
-            *d++ = *s++;
+        if ((uintptr_t)s - (uintptr_t)d >= count)
+            return memcpy(dest, src, count);
+
+        // Destination below the source, rep movsb is defined byte by byte
+        if (count >= mem_rep_min)
+            rep_movsb(d, s, count);
+        else
+            copy_words(d, s, count);
         return dest;
     }
-    
-    // Copy bytes until aligned
-    size_t align = -(uintptr_t)d & (sizeof(size_t)-1);
-    count -= align;
-    while (align--)
-        *d++ = *s++;
-        
-    // Copy by words
-    size_t *dw = (size_t *)d;
-    const size_t *sw = (const size_t *)s;
-    
-    while (count >= sizeof(size_t)) 
-    {
-        *dw++ = *sw++;
-        count -= sizeof(size_t);
-    }
-    
-    // Copy remaining bytes
-    d = (uint8_t *)dw;
-    s = (const uint8_t *)sw;
-    while (count--)
-        *d++ = *s++;
-        
+
+    // Destination above the source, copy from the end down
+    if (count > MEM_INLINE_MAX && mem_vector && simd_usable())
+        mem_vector->copy_back(d, s, count);
+    else
+        copy_back_words(d, s, count);
     return dest;
 }
 
@@ -106,58 +576,7 @@ int memcmp(const void *cs, const void *ct, size_t count)
 {
     const uint8_t *s1 = cs;
     const uint8_t *s2 = ct;
-    if (count < 8) 
-    {
-        while (count--)
-        {
-            if (*s1 != *s2)
-                return *s1 - *s2;
-            s1++;
-            s2++;
-        }
-        return 0;
-    }
-    
-    // Align to word boundary
-    size_t align = -(uintptr_t)s1 & (sizeof(size_t)-1);
-    count -= align;
-    while (align--) 
-    {
-        if (*s1 != *s2)
-            return *s1 - *s2;
-        s1++;
-        s2++;
-    }
-    
-    const size_t *w1 = (const size_t *)s1;
-    const size_t *w2 = (const size_t *)s2; 
-    while (count >= sizeof(size_t)) 
-    {
-        if (*w1 != *w2) 
-        {
-            s1 = (const uint8_t *)w1;
-            s2 = (const uint8_t *)w2;
-            for (size_t i = 0; i < sizeof(size_t); i++) 
-            {
-                if (s1[i] != s2[i])
-                    return s1[i] - s2[i];
-            }
-        }
-        w1++;
-        w2++;
-        count -= sizeof(size_t);
-    }
-    
-    // Compare remaining bytes
-    s1 = (const uint8_t *)w1;
-    s2 = (const uint8_t *)w2;
-    while (count--) 
-    {
-        if (*s1 != *s2)
-            return *s1 - *s2;
-        s1++;
-        s2++;
-    }
-    
-    return 0;
+    if (count > MEM_INLINE_MAX && mem_vector && simd_usable())
+        return mem_vector->cmp(s1, s2, count);
+    return cmp_words(s1, s2, count);
 }
@@ -0,0 +1,437 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include "../slab.h"
+#include "../io.h"
+#include "../memory.h"
+
+#define SLAB_MAGIC 0x42414C53         // 'SLAB'
+#define LARGE_MAGIC 0x4752414C        // 'LARG'
+#define SLAB_END 0xFFFF
+
+// Header in front of kmalloc blocks too big for a size class. Slab
+// objects always sit past the slab header, so a pointer 16 bytes into
+// a page can only be a large block
+typedef struct
+{
+    uint32_t magic;
+    uint32_t order;
+    uint64_t reserved;
+} large_header_t;
+
+static const kmem_backend_t* backend = NULL;
+static kmem_cache_t* caches = NULL;
+
+static kmem_cache_t cache_cache;      // Bootstraps the other caches
+static kmem_cache_t* magazine_cache;
+static kmem_cache_t* kmalloc_caches[KMALLOC_CLASSES];
+
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+static inline uint32_t kmem_cpu_id()
+{
+    return backend->cpu_id ? backend->cpu_id() % KMEM_MAX_CPUS : 0;
+}
+
+static inline size_t slab_bytes(kmem_cache_t* cache)
+{
+    return (size_t)KMEM_PAGE_SIZE << cache->order;
+}
+
+static inline size_t header_size(kmem_cache_t* cache, uint32_t count)
+{
+    size_t size = sizeof(slab_t) + count * sizeof(uint16_t);
+    return (size + cache->align - 1) & ~(cache->align - 1);
+}
+
+// Largest object count whose header and objects fit in one slab
+static uint32_t objects_fitting(kmem_cache_t* cache)
+{
+    uint32_t count = slab_bytes(cache) / cache->size;
+    while (count && header_size(cache, count) + count * cache->size > slab_bytes(cache))
+        count--;
+    return count < SLAB_END ? count : SLAB_END - 1;
+}
+
+static void kmem_cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align,
+                             void (*ctor)(void*), uint32_t flags)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    cache->name = name;
+    cache->align = align;
+    cache->size = (size + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+    cache->flags = flags;
+
+    while (!(flags & KMEM_PAGE_SLABS) && cache->order < KMEM_MAX_SLAB_ORDER &&
+           objects_fitting(cache) < KMEM_MIN_OBJECTS)
+        cache->order++;
+    cache->objects_per_slab = objects_fitting(cache);
+
+    cache->next = caches;
+    caches = cache;
+}
+
+static void slab_unlink(slab_t** list, slab_t* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static void slab_link(slab_t** list, slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next)
+        slab->next->prev = slab;
+    *list = slab;
+}
+
+// Carves a fresh slab and constructs every object in it once, objects
+// keep their constructed state across free and reuse
+static slab_t* slab_grow(kmem_cache_t* cache)
+{
+    slab_t* slab = backend->alloc_pages(cache->order);
+    if (!slab)
+        return NULL;
+
+    uint32_t count = cache->objects_per_slab;
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->free = 0;
+    slab->cache = cache;
+    slab->objects = (uint8_t*)slab + header_size(cache, count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        slab->freelist[i] = i + 1 < count ? i + 1 : SLAB_END;
+        if (cache->ctor)
+            cache->ctor(slab->objects + i * cache->size);
+    }
+
+    cache->slab_count++;
+    slab_link(&cache->empty, slab);
+    return slab;
+}
+
+// Slab layer, caller holds cache->lock
+static void* slab_alloc(kmem_cache_t* cache)
+{
+    slab_t* slab = cache->partial;
+    slab_t** list = &cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty ? cache->empty : slab_grow(cache);
+        list = &cache->empty;
+        if (!slab)
+            return NULL;
+    }
+
+    uint16_t idx = slab->free;
+    slab->free = slab->freelist[idx];
+    slab->inuse++;
+    cache->slab_inuse++;
+
+    if (slab->free == SLAB_END)
+    {
+        slab_unlink(list, slab);
+        slab_link(&cache->full, slab);
+    }
+    else if (list == &cache->empty)
+    {
+        slab_unlink(list, slab);
+        slab_link(&cache->partial, slab);
+    }
+    return slab->objects + idx * cache->size;
+}
+
+// Slab layer, caller holds cache->lock. Slabs are naturally aligned
+// to their size so the header is found by masking the object address
+static void slab_free(kmem_cache_t* cache, void* obj)
+{
+    slab_t* slab = (slab_t*)((uintptr_t)obj & ~(slab_bytes(cache) - 1));
+    uint16_t idx = ((uint8_t*)obj - slab->objects) / cache->size;
+    bool was_full = slab->free == SLAB_END;
+
+    slab->freelist[idx] = slab->free;
+    slab->free = idx;
+    slab->inuse--;
+    cache->slab_inuse--;
+
+    if (slab->inuse == 0)
+    {
+        slab_unlink(was_full ? &cache->full : &cache->partial, slab);
+        // Keep one empty slab around to absorb alloc/free ping-pong
+        if (cache->empty)
+        {
+            cache->slab_count--;
+            backend->free_pages(slab, cache->order);
+        }
+        else
+            slab_link(&cache->empty, slab);
+    }
+    else if (was_full)
+    {
+        slab_unlink(&cache->full, slab);
+        slab_link(&cache->partial, slab);
+    }
+}
+
+static void* slab_alloc_locked(kmem_cache_t* cache)
+{
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    void* obj = slab_alloc(cache);
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+    return obj;
+}
+
+static void slab_free_locked(kmem_cache_t* cache, void* obj)
+{
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    slab_free(cache, obj);
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+}
+
+void init_kmalloc(const kmem_backend_t* kmem_backend)
+{
+    backend = kmem_backend;
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 64, NULL, KMEM_NO_MAGAZINES);
+    magazine_cache = kmem_cache_create("magazine", sizeof(magazine_t), 64, NULL, KMEM_NO_MAGAZINES);
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1 << (KMALLOC_MIN_SHIFT + i), 16, NULL,
+                                               KMEM_PAGE_SLABS);
+}
+
+/**
+ * Create a named object cache
+ * @name: Shown in kmem_print_stats, must outlive the cache
+ * @size: Object size in bytes
+ * @align: Object alignment, a power of two
+ * @ctor: Run once per object when its slab is created, may be NULL
+ * @flags: KMEM_* flags
+ * @return: The cache, NULL on failure
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                void (*ctor)(void*), uint32_t flags)
+{
+    if (!backend)
+        return NULL;
+
+    kmem_cache_t* cache = slab_alloc_locked(&cache_cache);
+    if (!cache)
+        return NULL;
+    kmem_cache_setup(cache, name, size, align, ctor, flags);
+    if (!cache->objects_per_slab)
+    {
+        caches = cache->next;
+        slab_free_locked(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/**
+ * Allocate an object, from this CPU's magazines when possible
+ * @cache: Cache to allocate from
+ * @return: A constructed object, NULL when out of memory
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    if (cache->flags & KMEM_NO_MAGAZINES)
+        return slab_alloc_locked(cache);
+
+    uint64_t flags = irq_save();
+    kmem_cpu_t* cpu = &cache->cpu[kmem_cpu_id()];
+    void* obj = NULL;
+
+    if (cpu->loaded && cpu->loaded->rounds)
+    {
+        obj = cpu->loaded->objects[--cpu->loaded->rounds];
+        cpu->hits++;
+    }
+    else if (cpu->previous && cpu->previous->rounds)
+    {
+        magazine_t* mag = cpu->previous;
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+        obj = mag->objects[--mag->rounds];
+        cpu->hits++;
+    }
+    else
+    {
+        spin_lock(&cache->lock);
+        magazine_t* full = cache->depot_full;
+        if (full)
+        {
+            // Swap a loaded magazine in from the depot, the empty
+            // previous one goes back for frees to fill
+            cache->depot_full = full->next;
+            if (cpu->previous)
+            {
+                cpu->previous->next = cache->depot_empty;
+                cache->depot_empty = cpu->previous;
+            }
+            cpu->previous = cpu->loaded;
+            cpu->loaded = full;
+            obj = full->objects[--full->rounds];
+            cpu->hits++;
+        }
+        else
+        {
+            obj = slab_alloc(cache);
+            cpu->misses++;
+        }
+        spin_unlock(&cache->lock);
+    }
+
+    if (obj)
+        cpu->allocs++;
+    irq_restore(flags);
+    return obj;
+}
+
+/**
+ * Return an object to its cache
+ * @cache: Cache it was allocated from
+ * @obj: The object, must be back in its constructed state
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+    if (!obj)
+        return;
+    if (cache->flags & KMEM_NO_MAGAZINES)
+    {
+        slab_free_locked(cache, obj);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    kmem_cpu_t* cpu = &cache->cpu[kmem_cpu_id()];
+    cpu->frees++;
+
+    if (cpu->loaded && cpu->loaded->rounds < KMEM_MAGAZINE_SIZE)
+        cpu->loaded->objects[cpu->loaded->rounds++] = obj;
+    else if (cpu->previous && cpu->previous->rounds == 0)
+    {
+        magazine_t* mag = cpu->previous;
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+        mag->objects[mag->rounds++] = obj;
+    }
+    else
+    {
+        spin_lock(&cache->lock);
+        magazine_t* empty = cache->depot_empty;
+        if (empty)
+            cache->depot_empty = empty->next;
+        else
+            empty = slab_alloc_locked(magazine_cache);
+
+        if (empty)
+        {
+            if (cpu->previous)
+            {
+                cpu->previous->next = cache->depot_full;
+                cache->depot_full = cpu->previous;
+            }
+            cpu->previous = cpu->loaded;
+            cpu->loaded = empty;
+            empty->rounds = 0;
+            empty->objects[empty->rounds++] = obj;
+        }
+        else
+            slab_free(cache, obj);
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+}
+
+void kmem_print_stats()
+{
+    for (kmem_cache_t* cache = caches; cache; cache = cache->next)
+    {
+        uint64_t allocs = 0, frees = 0, hits = 0, misses = 0;
+        for (int i = 0; i < KMEM_MAX_CPUS; i++)
+        {
+            allocs += cache->cpu[i].allocs;
+            frees += cache->cpu[i].frees;
+            hits += cache->cpu[i].hits;
+            misses += cache->cpu[i].misses;
+        }
+
+        uint64_t inuse = cache->flags & KMEM_NO_MAGAZINES ? cache->slab_inuse : allocs - frees;
+        uint64_t lookups = hits + misses;
+        printf("%s: %llu in use, %llu slabs, %llu%% magazine hits\n", cache->name,
+               inuse, cache->slab_count, lookups ? hits * 100 / lookups : 0ULL);
+    }
+}
+
+static inline int kmalloc_class(size_t size)
+{
+    if (size <= (1 << KMALLOC_MIN_SHIFT))
+        return 0;
+    return 64 - __builtin_clzll(size - 1) - KMALLOC_MIN_SHIFT;
+}
+
+/**
+ * Allocate memory from the general purpose size classes
+ * @size: Bytes needed, above 1024 whole pages are used
+ * @return: 16 byte aligned memory, NULL on failure
+ */
+void* kmalloc(size_t size)
+{
+    if (!backend || !size)
+        return NULL;
+    if (size <= (1 << KMALLOC_MAX_SHIFT))
+        return kmem_cache_alloc(kmalloc_caches[kmalloc_class(size)]);
+
+    uint32_t order = 0;
+    while (((size_t)KMEM_PAGE_SIZE << order) < size + sizeof(large_header_t))
+        order++;
+    large_header_t* header = backend->alloc_pages(order);
+    if (!header)
+        return NULL;
+    header->magic = LARGE_MAGIC;
+    header->order = order;
+    return header + 1;
+}
+
+void* kzalloc(size_t size)
+{
+    void* ptr = kmalloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void kfree(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    uintptr_t page = (uintptr_t)ptr & ~(uintptr_t)(KMEM_PAGE_SIZE - 1);
+    large_header_t* header = (large_header_t*)page;
+    if ((uintptr_t)ptr - page == sizeof(large_header_t) && header->magic == LARGE_MAGIC)
+    {
+        header->magic = 0;
+        backend->free_pages(header, header->order);
+        return;
+    }
+
+    slab_t* slab = (slab_t*)page;
+    if (slab->magic == SLAB_MAGIC)
+        kmem_cache_free(slab->cache, ptr);
+}
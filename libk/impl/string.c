@@ -7,6 +7,222 @@
 #define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
 
 #include "../string.h"
+#include "../memory.h"
+
+typedef char bytes128_t __attribute__((vector_size(16)));
+typedef char bytes128_unaligned_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char bytes256_t __attribute__((vector_size(32)));
+
+typedef struct
+{
+    size_t (*strlen)(const char *s);
+    size_t (*strnlen)(const char *s, size_t maxlen);
+    char *(*strchr)(const char *s, int c);
+    char *(*strrchr)(const char *s, int c);
+    void *(*memchr)(const void *s, int c, size_t n);
+    void *(*memrchr)(const void *s, int c, size_t n);
+} str_kernels_t;
+
+// Chosen once by string_select(), NULL keeps the scalar code
+static const str_kernels_t *str_vector = NULL;
+static int (*str_cmp)(const char *s1, const char *s2) = NULL;
+
+/*
+ * Block scanners for one vector width. Every load is aligned to the
+ * vector size, so a block never reaches into a page the string does not
+ * already touch. Bytes before the start are shifted out of the first
+ * mask, bytes past a length bound are dropped from the last one.
+ */
+#define STRING_KERNELS(isa, bytes_t, width, movemask)                           \
+__attribute__((target(#isa)))                                                   \
+static inline uint32_t isa##_match(const char *p, bytes_t v)                    \
+{                                                                               \
+    return (uint32_t)movemask(*(const bytes_t *)p == v);                        \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static size_t isa##_strlen(const char *s)                                       \
+{                                                                               \
+    const bytes_t zero = { 0 };                                                 \
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(width - 1));     \
+    uint32_t mask = isa##_match(p, zero) >> (s - p);                            \
+    if (mask)                                                                   \
+        return __builtin_ctz(mask);                                             \
+    for (;;)                                                                    \
+    {                                                                           \
+        p += width;                                                             \
+        mask = isa##_match(p, zero);                                            \
+        if (mask)                                                               \
+            return p + __builtin_ctz(mask) - s;                                 \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static size_t isa##_strnlen(const char *s, size_t maxlen)                       \
+{                                                                               \
+    if (!maxlen)                                                                \
+        return 0;                                                               \
+    const bytes_t zero = { 0 };                                                 \
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(width - 1));     \
+    uint32_t mask = isa##_match(p, zero) >> (s - p);                            \
+    size_t len = mask ? (size_t)__builtin_ctz(mask) : (size_t)(p + width - s);  \
+    while (!mask && len < maxlen)                                               \
+    {                                                                           \
+        p += width;                                                             \
+        mask = isa##_match(p, zero);                                            \
+        len = mask ? (size_t)(p + __builtin_ctz(mask) - s) : len + width;       \
+    }                                                                           \
+    return len < maxlen ? len : maxlen;                                         \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static char *isa##_strchr(const char *s, int c)                                 \
+{                                                                               \
+    const bytes_t zero = { 0 };                                                 \
+    const bytes_t needle = zero + (char)c;                                      \
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(width - 1));     \
+    const char *base = s;                                                       \
+    uint32_t found = isa##_match(p, needle) >> (s - p);                         \
+    uint32_t end = isa##_match(p, zero) >> (s - p);                             \
+    while (!(found | end))                                                      \
+    {                                                                           \
+        p += width;                                                             \
+        base = p;                                                               \
+        found = isa##_match(p, needle);                                         \
+        end = isa##_match(p, zero);                                             \
+    }                                                                           \
+    uint32_t first = (found | end) & -(found | end);                            \
+    return found & first ? (char *)base + __builtin_ctz(first) : NULL;          \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static char *isa##_strrchr(const char *s, int c)                                \
+{                                                                               \
+    const bytes_t zero = { 0 };                                                 \
+    const bytes_t needle = zero + (char)c;                                      \
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(width - 1));     \
+    const char *base = s;                                                       \
+    const char *last = NULL;                                                    \
+    uint32_t found = isa##_match(p, needle) >> (s - p);                         \
+    uint32_t end = isa##_match(p, zero) >> (s - p);                             \
+    for (;;)                                                                    \
+    {                                                                           \
+        if (end)                                                                \
+            found &= end ^ (end - 1);  /* Up to and including the NUL */        \
+        if (found)                                                              \
+            last = base + 31 - __builtin_clz(found);                            \
+        if (end)                                                                \
+            return (char *)last;                                                \
+        p += width;                                                             \
+        base = p;                                                               \
+        found = isa##_match(p, needle);                                         \
+        end = isa##_match(p, zero);                                             \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static void *isa##_memchr(const void *s, int c, size_t n)                       \
+{                                                                               \
+    if (!n)                                                                     \
+        return NULL;                                                            \
+    const bytes_t needle = (bytes_t){ 0 } + (char)c;                            \
+    const char *start = s;                                                      \
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(width - 1));     \
+    uint32_t found = isa##_match(p, needle) >> (start - p);                     \
+    size_t pos = found ? (size_t)__builtin_ctz(found) : (size_t)(p + width - start); \
+    while (!found && pos < n)                                                   \
+    {                                                                           \
+        p += width;                                                             \
+        found = isa##_match(p, needle);                                         \
+        pos = found ? (size_t)(p + __builtin_ctz(found) - start) : pos + width; \
+    }                                                                           \
+    return found && pos < n ? (void *)(start + pos) : NULL;                     \
+}                                                                               \
+                                                                                \
+__attribute__((target(#isa)))                                                   \
+static void *isa##_memrchr(const void *s, int c, size_t n)                      \
+{                                                                               \
+    if (!n)                                                                     \
+        return NULL;                                                            \
+    const bytes_t needle = (bytes_t){ 0 } + (char)c;                            \
+    const char *start = s;                                                      \
+    const char *end = start + n;                                                \
+    const char *p = (const char *)((uintptr_t)(end - 1) & ~(uintptr_t)(width - 1)); \
+    uint32_t found = isa##_match(p, needle);                                    \
+    if (end - p < 32)                                                           \
+        found &= (1U << (end - p)) - 1;                                         \
+    while (p > start)                                                           \
+    {                                                                           \
+        if (found)                                                              \
+            return (void *)(p + 31 - __builtin_clz(found));                     \
+        p -= width;                                                             \
+        found = isa##_match(p, needle);                                         \
+    }                                                                           \
+    found &= ~0U << (start - p);                                                \
+    return found ? (void *)(p + 31 - __builtin_clz(found)) : NULL;              \
+}                                                                               \
+                                                                                \
+static const str_kernels_t isa##_kernels = {                                    \
+    isa##_strlen, isa##_strnlen, isa##_strchr,                                  \
+    isa##_strrchr, isa##_memchr, isa##_memrchr,                                 \
+};
+
+STRING_KERNELS(sse2, bytes128_t, 16, __builtin_ia32_pmovmskb128)
+STRING_KERNELS(avx2, bytes256_t, 32, __builtin_ia32_pmovmskb256)
+
+// Unsigned bytes, equal each, negated: the index is the first byte that
+// differs or where only one of the strings has ended
+#define PCMPSTR_STRCMP 0x18
+
+/*
+ * strcmp with PCMPISTRI on unaligned 16-byte blocks. A block that would
+ * cross into the next page is done bytewise instead, the string may end
+ * before it
+ */
+__attribute__((target("sse4.2")))
+static int sse42_strcmp(const char *s1, const char *s2)
+{
+    for (;;)
+    {
+        if (((uintptr_t)s1 & 4095) > 4096 - 16 || ((uintptr_t)s2 & 4095) > 4096 - 16)
+        {
+            for (int i = 0; i < 16; i++, s1++, s2++)
+            {
+                if (*s1 != *s2)
+                    return (unsigned char)*s1 - (unsigned char)*s2;
+                if (!*s1)
+                    return 0;
+            }
+            continue;
+        }
+
+        bytes128_t a = *(const bytes128_unaligned_t *)s1;
+        bytes128_t b = *(const bytes128_unaligned_t *)s2;
+        int index = __builtin_ia32_pcmpistri128(a, b, PCMPSTR_STRCMP);
+        if (index < 16)
+            return (unsigned char)s1[index] - (unsigned char)s2[index];
+        if (__builtin_ia32_pcmpistriz128(a, b, PCMPSTR_STRCMP))
+            return 0;  // Both ended together
+        s1 += 16;
+        s2 += 16;
+    }
+}
+
+/**
+ * string_select - Pick the string routine variants for this CPU
+ * @features: MEM_* flags the CPU supports
+ *
+ * Called once at boot after the vector state has been enabled.
+ */
+void string_select(uint32_t features)
+{
+    str_vector = NULL;
+    if (features & MEM_AVX2)
+        str_vector = &avx2_kernels;
+    else if (features & MEM_SSE2)
+        str_vector = &sse2_kernels;
+    str_cmp = features & MEM_SSE42 ? sse42_strcmp : NULL;
+}
 
 /**
  * strlen - Find the length of a string
@@ -19,6 +235,9 @@
  */
 size_t strlen(const char *str) 
 {
+    if (str_vector && simd_usable())
+        return str_vector->strlen(str);
+
     const char *s = str;
     size_t *ls;
 
@@ -53,6 +272,9 @@ size_t strlen(const char *str)
  */
 size_t strnlen(const char *s, size_t maxlen)
 {
+    if (str_vector && simd_usable())
+        return str_vector->strnlen(s, maxlen);
+
     const char *es = s;
     // Count until either null or maxlen reached
     while (*es && maxlen) 
@@ -273,6 +495,9 @@ size_t strlcat(char *dest, const char *src, size_t size)
  */
 int strcmp(const char *s1, const char *s2) 
 {
+    if (str_cmp && simd_usable())
+        return str_cmp(s1, s2);
+
     size_t l1;
     size_t l2;
     while ((size_t)s1 & (sizeof(long) - 1)) 
@@ -286,12 +511,27 @@ int strcmp(const char *s1, const char *s2)
     
     while (1) 
     {
-        l1 = *(size_t *)s1;
-        l2 = *(size_t *)s2;
-        
-        if (HAS_ZERO(l1) || l1 != l2) 
+        // s2 may be misaligned, its word must not straddle into a page
+        // the string never reaches
+        if (((uintptr_t)s2 & 4095) > 4096 - sizeof(long))
         {
-            break;
+            for (size_t i = 0; i < sizeof(long); i++)
+            {
+                if (s1[i] != s2[i])
+                    return (unsigned char)s1[i] - (unsigned char)s2[i];
+                if (!s1[i])
+                    return 0;
+            }
+        }
+        else
+        {
+            l1 = *(size_t *)s1;
+            l2 = *(size_t *)s2;
+
+            if (HAS_ZERO(l1) || l1 != l2) 
+            {
+                break;
+            }
         }
         s1 += sizeof(long);
         s2 += sizeof(long);
@@ -406,6 +646,9 @@ int strncasecmp(const char *s1, const char *s2, size_t len)
  */
 char *strchr(const char *s, int c)
 {
+    if (str_vector && simd_usable())
+        return str_vector->strchr(s, c);
+
     for (; *s != (char)c; s++)
         if (*s == '\0')
             return NULL;
@@ -424,6 +667,9 @@ char *strchr(const char *s, int c)
  */
 char *strrchr(const char *s, int c)
 {
+    if (str_vector && simd_usable())
+        return str_vector->strrchr(s, c);
+
     const char *last = NULL;
 
     do 
@@ -460,6 +706,157 @@ char *strnchr(const char *s, size_t count, int c)
     return NULL;
 }
 
+/**
+ * memchr - Locate a byte in a memory area
+ * @s: Memory area to search
+ * @c: Byte to find
+ * @n: Number of bytes to search
+ *
+ * Return: pointer to the first occurrence of @c or NULL if not found
+ */
+void *memchr(const void *s, int c, size_t n)
+{
+    if (str_vector && simd_usable())
+        return str_vector->memchr(s, c, n);
+
+    const unsigned char *p = s;
+    for (; n; n--, p++)
+        if (*p == (unsigned char)c)
+            return (void *)p;
+    return NULL;
+}
+
+/**
+ * memrchr - Locate the last occurrence of a byte in a memory area
+ * @s: Memory area to search
+ * @c: Byte to find
+ * @n: Number of bytes to search
+ *
+ * Return: pointer to the last occurrence of @c or NULL if not found
+ */
+void *memrchr(const void *s, int c, size_t n)
+{
+    if (str_vector && simd_usable())
+        return str_vector->memrchr(s, c, n);
+
+    const unsigned char *p = (const unsigned char *)s + n;
+    while (n--)
+        if (*--p == (unsigned char)c)
+            return (void *)p;
+    return NULL;
+}
+
+/*
+ * Critical factorization of the needle for the Two-Way algorithm: the
+ * position of the larger of the two maximal suffixes under both byte
+ * orders, and the period of that suffix.
+ */
+static size_t critical_factorization(const unsigned char *n, size_t nl, size_t *period)
+{
+    if (nl < 3)
+    {
+        *period = 1;
+        return nl - 1;
+    }
+
+    size_t suffix[2];
+    size_t periods[2];
+    for (int order = 0; order < 2; order++)
+    {
+        size_t ms = (size_t)-1;
+        size_t j = 0;
+        size_t k = 1;
+        size_t p = 1;
+        while (j + k < nl)
+        {
+            unsigned char a = n[j + k];
+            unsigned char b = n[ms + k];
+            if (order ? b < a : a < b)
+            {
+                j += k;
+                k = 1;
+                p = j - ms;
+            }
+            else if (a == b)
+            {
+                if (k != p)
+                    k++;
+                else
+                {
+                    j += p;
+                    k = 1;
+                }
+            }
+            else
+            {
+                ms = j++;
+                k = p = 1;
+            }
+        }
+        suffix[order] = ms + 1;
+        periods[order] = p;
+    }
+
+    int pick = suffix[1] > suffix[0];
+    *period = periods[pick];
+    return suffix[pick];
+}
+
+/*
+ * Two-Way string matching (Crochemore and Perrin), linear in the
+ * haystack with constant extra space. Whenever no partial match is
+ * carried over, memchr skips ahead to the next possible first byte.
+ */
+static char *two_way(const unsigned char *h, size_t hl, const unsigned char *n, size_t nl)
+{
+    size_t period;
+    size_t suffix = critical_factorization(n, nl, &period);
+    bool periodic = !memcmp(n, n + period, suffix);
+    if (!periodic)
+        period = (suffix > nl - suffix ? suffix : nl - suffix) + 1;
+
+    size_t memory = 0;
+    size_t j = 0;
+    while (j <= hl - nl)
+    {
+        if (!memory && h[j] != n[0])
+        {
+            // Short gaps inline, a memchr call only pays off on long ones
+            size_t stop = hl - nl - j < 16 ? hl - nl : j + 16;
+            while (j < stop && h[j] != n[0])
+                j++;
+            if (h[j] != n[0])
+            {
+                const unsigned char *next = memchr(h + j, n[0], hl - nl - j + 1);
+                if (!next)
+                    return NULL;
+                j = next - h;
+            }
+        }
+
+        // Right half first, then the left half back to the memory
+        size_t i = suffix > memory ? suffix : memory;
+        while (i < nl && n[i] == h[i + j])
+            i++;
+        if (i < nl)
+        {
+            j += i - suffix + 1;
+            memory = 0;
+            continue;
+        }
+
+        i = suffix - 1;
+        while (memory < i + 1 && n[i] == h[i + j])
+            i--;
+        if (i + 1 < memory + 1)
+            return (char *)(h + j);
+        j += period;
+        if (periodic)
+            memory = nl - period;
+    }
+    return NULL;
+}
+
 /**
  * strnstr - Locate a substring in a length-limited string
  * @s1: String to search in (haystack)
@@ -468,38 +865,23 @@ char *strnchr(const char *s, size_t count, int c)
  *
  * The strnstr() function locates the first occurrence of the 
  * null-terminated string s2 in the string s1, where not more 
- * than len bytes are searched.
+ * than len bytes are searched. Characters after a '\0' in s1
+ * are not searched.
  *
  * Return: pointer to the located substring or NULL if not found
  */
 char *strnstr(const char *s1, const char *s2, size_t len)
 {
     size_t l2 = strlen(s2);
-    
     if (!l2)
         return (char *)s1;
 
-    while (len >= l2) 
-    {
-        size_t i;
-        bool match = true;
-        
-        for (i = 0; i < l2; i++)
-        {
-            if (s1[i] != s2[i]) 
-            {
-                match = false;
-                break;
-            }
-        }
-        
-        if (match)
-            return (char *)s1;
-            
-        s1++;
-        len--;
-    }
-    return NULL;
+    size_t l1 = strnlen(s1, len);
+    if (l1 < l2)
+        return NULL;
+    if (l2 == 1)
+        return memchr(s1, *s2, l1);
+    return two_way((const unsigned char *)s1, l1, (const unsigned char *)s2, l2);
 }
 
 /**
@@ -515,28 +897,14 @@ char *strnstr(const char *s1, const char *s2, size_t len)
  */
 char *strstr(const char *haystack, const char *needle)
 {
-    const char first = *needle;
-    if (first == '\0')
+    if (*needle == '\0')
         return (char *)haystack;
-
-    while (*haystack) 
-    {
-        if (*haystack == first) 
-        {
-            const char *h = haystack + 1;
-            const char *n = needle + 1;
-            
-            while (*n && *h == *n) 
-            {
-                h++;
-                n++;
-            }
-            
-            if (*n == '\0')
-                return (char *)haystack;
-        }
-        haystack++;
-    }
-    
-    return NULL;
-}
\ No newline at end of file
+    if (needle[1] == '\0')
+        return strchr(haystack, *needle);
+
+    size_t hl = strlen(haystack);
+    size_t nl = strlen(needle);
+    if (hl < nl)
+        return NULL;
+    return two_way((const unsigned char *)haystack, hl, (const unsigned char *)needle, nl);
+}
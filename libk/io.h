@@ -13,8 +13,53 @@ typedef __builtin_va_list va_list;
 #define va_arg(v,l)     __builtin_va_arg(v,l)
 #define va_copy(d,s)    __builtin_va_copy(d,s)
 
+// Targets for dprintf, drivers register a sink for each. printf is VGA
+#define CONSOLE_VGA 0
+#define CONSOLE_SERIAL 1
+#define CONSOLE_MAX 4
+
+// Where vformat output goes. The engine batches its output, so write
+// gets whole runs of text instead of one character at a time
+typedef struct format_sink
+{
+    void (*write)(struct format_sink* sink, const char* data, size_t len);
+} format_sink_t;
+
+// Fixed buffer that keeps what fits, as vsnprintf uses
+typedef struct
+{
+    format_sink_t sink;
+    char* buf;
+    size_t size;
+    size_t len;                   // Bytes offered, may exceed size
+} string_sink_t;
+
+// Circular buffer that keeps the newest size bytes, size a power of two.
+// Writers and readers must be serialised by the caller
+typedef struct
+{
+    format_sink_t sink;
+    char* buf;
+    size_t size;
+    uint64_t head;                // Bytes written since init
+} ring_sink_t;
+
+int vformat(format_sink_t* sink, const char* fmt, va_list args);
+
 int printf(const char* format, ...);
+int vprintf(const char* format, va_list args);
 int snprintf(char* buf, size_t size, const char* fmt, ...);
+int vsnprintf(char* buf, size_t size, const char* fmt, va_list args);
+int dprintf(int console, const char* fmt, ...);
+int vdprintf(int console, const char* fmt, va_list args);
+
+bool console_register(int console, format_sink_t* sink);
+format_sink_t* console_sink(int console);
+bool console_write(int console, const char* data, size_t len);
+
+void string_sink_init(string_sink_t* sink, char* buf, size_t size);
+void ring_sink_init(ring_sink_t* ring, char* buf, size_t size);
+size_t ring_sink_read(ring_sink_t* ring, uint64_t* pos, char* out, size_t len);
 
 void putc(char c);
 void puts(const char* str);
@@ -23,6 +68,4 @@ void print_hex(uint64_t value);
 void print_dec(int64_t value);
 void print_ptr(void* ptr);
 
-void vga_putchar(char c);
-
-#endif
\ No newline at end of file
+#endif
@@ -7,9 +7,40 @@
 
 #include "kdef.h"
 
+// CPU features memory_select() and string_select() can take advantage of
+#define MEM_ERMS (1 << 0)             // Enhanced REP MOVSB/STOSB
+#define MEM_FSRM (1 << 1)             // Fast short REP MOVSB
+#define MEM_SSE2 (1 << 2)             // SSE enabled in CR0/CR4
+#define MEM_AVX2 (1 << 3)             // AVX2 with YMM state enabled in XCR0
+#define MEM_SSE42 (1 << 4)            // SSE4.2 string instructions
+
+// Copies and fills up to this size never leave general purpose registers
+#define MEM_INLINE_MAX 256
+// Where rep movsb/stosb beats a vector loop with only ERMS
+#define MEM_ERMS_MIN 2048
+// Non-temporal threshold when the cache size is unknown
+#define MEM_NT_DEFAULT (4 * 1024 * 1024)
+
+// Raised while deferred interrupt work runs with IF set on top of the
+// interrupted code, whose vector registers are still live
+extern volatile uint32_t simd_hold;
+
+// Vector registers are not saved on interrupt entry, so libk only
+// touches them with interrupts enabled. Every handler runs through an
+// interrupt gate with IF clear and takes the general purpose paths
+static inline bool simd_usable()
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq\n\tpop %0" : "=r"(flags));
+    return (flags & (1 << 9)) != 0 && !simd_hold;
+}
+
+void memory_select(uint32_t features, uint64_t cache_size);
+const char* memory_variant();
+
 void* memset(void *s, int c, size_t count);
 void* memcpy(void *dest, const void *src, size_t count);
-void* memmove(void *dest, const char *src, size_t count);
+void* memmove(void *dest, const void *src, size_t count);
 int memcmp(const void *cs, const void *ct, size_t count);
 
-#endif
\ No newline at end of file
+#endif
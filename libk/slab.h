@@ -0,0 +1,97 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KSLAB_H__
+#define __KSLAB_H__
+
+#include "kdef.h"
+#include "spinlock.h"
+
+#define KMEM_MAX_CPUS 8
+#define KMEM_MAGAZINE_SIZE 30         // Rounds per magazine, 256 byte magazines
+#define KMEM_PAGE_SIZE 4096
+#define KMEM_MAX_SLAB_ORDER 3
+#define KMEM_MIN_OBJECTS 8            // Grow the slab order until this many fit
+
+#define KMEM_NO_MAGAZINES (1 << 0)    // Always go straight to the slab layer
+#define KMEM_PAGE_SLABS (1 << 1)      // Single page slabs, lets kfree find them
+
+#define KMALLOC_MIN_SHIFT 4           // 16 bytes
+#define KMALLOC_MAX_SHIFT 10          // 1024 bytes, larger goes to whole pages
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Where slabs come from, supplied by the kernel
+typedef struct
+{
+    void* (*alloc_pages)(uint32_t order);      // Naturally aligned 2^order pages
+    void (*free_pages)(void* addr, uint32_t order);
+    uint32_t (*cpu_id)();
+} kmem_backend_t;
+
+typedef struct magazine
+{
+    struct magazine* next;
+    uint64_t rounds;
+    void* objects[KMEM_MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct slab
+{
+    uint32_t magic;
+    uint16_t inuse;
+    uint16_t free;                    // Index of the first free object
+    struct slab* next;
+    struct slab* prev;
+    struct kmem_cache* cache;
+    uint8_t* objects;
+    uint16_t freelist[];              // Next free index, per object
+} slab_t;
+
+// Per-CPU magazine pair, only ever touched by its own CPU
+typedef struct
+{
+    magazine_t* loaded;
+    magazine_t* previous;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;                    // Served from a magazine
+    uint64_t misses;                  // Had to go to the slab layer
+} __attribute__((aligned(64))) kmem_cpu_t;
+
+typedef struct kmem_cache
+{
+    const char* name;
+    size_t size;
+    size_t align;
+    uint32_t flags;
+    uint32_t order;
+    uint32_t objects_per_slab;
+    void (*ctor)(void* obj);
+
+    spinlock_t lock;                  // Guards the slab lists and the depot
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;
+    magazine_t* depot_full;
+    magazine_t* depot_empty;
+    uint64_t slab_count;
+    uint64_t slab_inuse;              // Objects handed out by the slab layer
+
+    struct kmem_cache* next;
+    kmem_cpu_t cpu[KMEM_MAX_CPUS];
+} kmem_cache_t;
+
+void init_kmalloc(const kmem_backend_t* backend);
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                void (*ctor)(void*), uint32_t flags);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_print_stats();
+
+void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void kfree(void* ptr);
+
+#endif
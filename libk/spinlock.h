@@ -0,0 +1,47 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __KSPINLOCK_H__
+#define __KSPINLOCK_H__
+
+#include "kdef.h"
+
+#define RFLAGS_IF (1ULL << 9)
+
+typedef struct
+{
+    volatile uint8_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t* lock)
+{
+    while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE))
+    {
+        while (lock->locked)
+            __asm__ volatile("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+// Disables interrupts and returns the previous RFLAGS
+static inline uint64_t irq_save()
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & RFLAGS_IF)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+#endif
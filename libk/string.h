@@ -7,6 +7,9 @@
 
 #include "kdef.h"
 
+// Picks the vector kernels from MEM_* feature flags, see memory.h
+void string_select(uint32_t features);
+
 size_t strlen(const char *s);
 size_t strnlen(const char *s, size_t maxlen);
 
@@ -32,5 +35,7 @@ char *strrchr(const char *s, int c);
 char *strnchr(const char *s, size_t count, int c);
 char *strstr(const char *s1, const char *s2);
 char *strnstr(const char *s1, const char *s2, size_t len);
+void *memchr(const void *s, int c, size_t n);
+void *memrchr(const void *s, int c, size_t n);
 
 #endif
\ No newline at end of file
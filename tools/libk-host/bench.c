@@ -0,0 +1,225 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+// Microbenchmarks of libk's copy and search paths in bytes per cycle,
+// per size bucket and variant, and of snprintf in cycles per log line,
+// with glibc as the reference
+// Usage: libk-bench [output.json]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include "libk.h"
+
+#define MAX_SIZE (4 * 1024 * 1024)
+#define TARGET_BYTES (64ULL * 1024 * 1024)  // Work per timed run
+#define MIN_REPS 16
+#define RUNS 5                              // Best of
+
+typedef enum
+{
+    OP_MEMCPY,
+    OP_MEMMOVE,                             // Backward, destination above source
+    OP_MEMSET,
+    OP_MEMCMP,
+    OP_STRLEN,
+    OP_MEMCHR,
+    OP_STRCHR,
+    OP_STRSTR,
+    OP_COUNT,
+} op_t;
+
+static const char* op_names[OP_COUNT] = {
+    "memcpy", "memmove", "memset", "memcmp", "strlen", "memchr", "strchr", "strstr",
+};
+
+static const size_t sizes[] = {
+    8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144, 1048576, MAX_SIZE,
+};
+
+#define FORMAT_REPS 100000
+
+// Log lines, mixed and then dominated by one kind of conversion
+typedef enum
+{
+    FMT_LOG,
+    FMT_DEC,
+    FMT_HEX,
+    FMT_COUNT,
+} fmt_t;
+
+static const char* fmt_names[FMT_COUNT] = { "log", "decimal", "hex" };
+
+static char* a;
+static char* b;
+static volatile uintptr_t sink;
+
+// One call of op on size bytes, libk or glibc
+static void run_op(op_t op, size_t size, int libk)
+{
+    switch (op)
+    {
+        case OP_MEMCPY:
+            sink = (uintptr_t)(libk ? libk_memcpy(b, a, size) : memcpy(b, a, size));
+            break;
+        case OP_MEMMOVE:
+            sink = (uintptr_t)(libk ? libk_memmove(a + 1, a, size) : memmove(a + 1, a, size));
+            break;
+        case OP_MEMSET:
+            sink = (uintptr_t)(libk ? libk_memset(b, 'x', size) : memset(b, 'x', size));
+            break;
+        case OP_MEMCMP:
+            sink = libk ? libk_memcmp(a, b, size) : memcmp(a, b, size);
+            break;
+        case OP_STRLEN:
+            sink = libk ? libk_strlen(a) : strlen(a);
+            break;
+        case OP_MEMCHR:
+            sink = (uintptr_t)(libk ? libk_memchr(a, 'z', size) : memchr(a, 'z', size));
+            break;
+        case OP_STRCHR:
+            sink = (uintptr_t)(libk ? libk_strchr(a, 'z') : strchr(a, 'z'));
+            break;
+        default:
+            sink = (uintptr_t)(libk ? libk_strstr(a, "abcz") : strstr(a, "abcz"));
+            break;
+    }
+}
+
+// Haystack without 'z', NUL terminated at size, and b equal to a
+static void prepare(size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        a[i] = "abcd"[i % 4];
+    a[size] = '\0';
+    memcpy(b, a, size + 1);
+}
+
+static double measure(op_t op, size_t size, int libk)
+{
+    uint64_t reps = TARGET_BYTES / size;
+    if (reps < MIN_REPS)
+        reps = MIN_REPS;
+
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < RUNS; run++)
+    {
+        prepare(size);
+        run_op(op, size, libk);  // Warm caches and page tables
+        _mm_lfence();
+        uint64_t start = __rdtsc();
+        for (uint64_t i = 0; i < reps; i++)
+            run_op(op, size, libk);
+        _mm_lfence();
+        uint64_t cycles = __rdtsc() - start;
+        if (cycles < best)
+            best = cycles;
+    }
+    return (double)size * reps / (double)(best ? best : 1);
+}
+
+static void emit(FILE* out, int* first, const char* variant, op_t op, size_t size, double rate)
+{
+    fprintf(out, "%s\n    {\"function\": \"%s\", \"variant\": \"%s\", \"size\": %zu, \"bytes_per_cycle\": %.3f}",
+            *first ? "" : ",", op_names[op], variant, size, rate);
+    *first = 0;
+    fprintf(stderr, "%-8s %-24s %8zu %8.3f B/cycle\n", op_names[op], variant, size, rate);
+}
+
+// One formatted line, libk or glibc
+static int run_format(fmt_t fmt, uint64_t i, int libk)
+{
+    char line[160];
+    int (*format)(char*, size_t, const char*, ...) = libk ? libk_snprintf : snprintf;
+    switch (fmt)
+    {
+        case FMT_LOG:
+            return format(line, sizeof(line), "[%5llu.%06llu] cpu%u %-8s pid %d addr 0x%016llx len %zu: %s\n",
+                          (unsigned long long)(i >> 20), (unsigned long long)(i & 0xFFFFF), (unsigned)(i & 3),
+                          "vmm", (int)(i % 4096), (unsigned long long)(0xFFFF800000000000ULL + i * 4096),
+                          (size_t)i * 64, "mapped");
+        case FMT_DEC:
+            return format(line, sizeof(line), "%llu %llu %llu %llu %d %d\n",
+                          (unsigned long long)i * 0x9E3779B97F4A7C15ULL, (unsigned long long)i * 1000003,
+                          (unsigned long long)i, (unsigned long long)i >> 3, (int)i, -(int)i);
+        default:
+            return format(line, sizeof(line), "%016llx %016llx %llx %x %x\n",
+                          (unsigned long long)i * 0x9E3779B97F4A7C15ULL, (unsigned long long)i << 12,
+                          (unsigned long long)i, (unsigned)i, (unsigned)i >> 8);
+    }
+}
+
+static double measure_format(fmt_t fmt, int libk)
+{
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < RUNS; run++)
+    {
+        _mm_lfence();
+        uint64_t start = __rdtsc();
+        for (uint64_t i = 0; i < FORMAT_REPS; i++)
+            sink += run_format(fmt, i, libk);
+        _mm_lfence();
+        uint64_t cycles = __rdtsc() - start;
+        if (cycles < best)
+            best = cycles;
+    }
+    return (double)best / FORMAT_REPS;
+}
+
+int main(int argc, char** argv)
+{
+    FILE* out = argc > 1 ? fopen(argv[1], "w") : stdout;
+    a = aligned_alloc(4096, MAX_SIZE + 4096);
+    b = aligned_alloc(4096, MAX_SIZE + 4096);
+    if (!out || !a || !b)
+    {
+        perror("libk-bench");
+        return 1;
+    }
+
+    host_variant_t variants[HOST_MAX_VARIANTS];
+    int count = host_variants(variants, HOST_MAX_VARIANTS);
+
+    // The largest cache sets the non-temporal cutoff, as cpu_cache_size() does
+    long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (cache <= 0)
+        cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache < 0)
+        cache = 0;
+
+    fprintf(out, "{\n  \"cache_size\": %ld,\n  \"results\": [", cache);
+    int first = 1;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            emit(out, &first, "glibc", op, sizes[s], measure(op, sizes[s], 0));
+            for (int v = 0; v < count; v++)
+            {
+                host_select(&variants[v], cache);
+                emit(out, &first, variants[v].name, op, sizes[s], measure(op, sizes[s], 1));
+            }
+        }
+    }
+    fprintf(out, "\n  ],\n  \"format\": [");
+    first = 1;
+    for (int fmt = 0; fmt < FMT_COUNT; fmt++)
+    {
+        for (int libk = 0; libk < 2; libk++)
+        {
+            double cycles = measure_format(fmt, libk);
+            fprintf(out, "%s\n    {\"function\": \"snprintf\", \"variant\": \"%s\", \"format\": \"%s\", "
+                    "\"cycles_per_call\": %.1f}", first ? "" : ",", libk ? "libk" : "glibc", fmt_names[fmt], cycles);
+            fprintf(stderr, "snprintf %-24s %-8s %8.1f cycles/call\n", libk ? "libk" : "glibc", fmt_names[fmt], cycles);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
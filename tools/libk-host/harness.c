@@ -0,0 +1,81 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#include <cpuid.h>
+#include <stdio.h>
+#include "libk.h"
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+void host_seed(uint64_t seed)
+{
+    random_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// xorshift64*, reproducible from the seed the tools print
+uint64_t host_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void name_variant(host_variant_t* variant)
+{
+    uint32_t f = variant->features;
+    snprintf(variant->name, sizeof(variant->name), "%s%s%s%s",
+             f & LIBK_MEM_AVX2 ? "avx2" : f & LIBK_MEM_SSE2 ? "sse2" : "scalar",
+             f & LIBK_MEM_SSE42 ? "+sse4.2" : "",
+             f & LIBK_MEM_FSRM ? "+fsrm" : "",
+             f & LIBK_MEM_ERMS && !(f & LIBK_MEM_FSRM) ? "+erms" : "");
+}
+
+/**
+ * Enumerate the feature sets libk would pick between on this CPU,
+ * from the plain word loops up to everything the CPU has
+ * @out: Array to fill
+ * @max: Capacity of out
+ * @return: Number of variants written
+ */
+int host_variants(host_variant_t* out, int max)
+{
+    uint32_t eax, ebx = 0, ecx, edx = 0;
+    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    __builtin_cpu_init();
+
+    uint32_t vectors[3];
+    int vector_count = 0;
+    vectors[vector_count++] = 0;
+    vectors[vector_count++] = LIBK_MEM_SSE2 |
+        (__builtin_cpu_supports("sse4.2") ? LIBK_MEM_SSE42 : 0);
+    if (__builtin_cpu_supports("avx2"))
+        vectors[vector_count++] = vectors[1] | LIBK_MEM_AVX2;
+
+    uint32_t reps[3];
+    int rep_count = 0;
+    reps[rep_count++] = 0;
+    if (ebx & (1 << 9))
+        reps[rep_count++] = LIBK_MEM_ERMS;
+    if (edx & (1 << 4))
+        reps[rep_count++] = LIBK_MEM_ERMS | LIBK_MEM_FSRM;
+
+    int count = 0;
+    for (int v = 0; v < vector_count; v++)
+    {
+        for (int r = 0; r < rep_count && count < max; r++)
+        {
+            out[count].features = vectors[v] | reps[r];
+            name_variant(&out[count]);
+            count++;
+        }
+    }
+    return count;
+}
+
+void host_select(const host_variant_t* variant, uint64_t cache_size)
+{
+    libk_memory_select(variant->features, cache_size);
+    libk_string_select(variant->features);
+}
@@ -0,0 +1,56 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+#ifndef __LIBK_HOST_H__
+#define __LIBK_HOST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libk's memory.c, string.c and io.c built for the host. objcopy gives
+// every symbol a libk_ prefix so they link next to glibc's versions
+
+// Mirrors the MEM_* flags in libk/memory.h, kdef.h clashes with stdint.h
+#define LIBK_MEM_ERMS (1 << 0)
+#define LIBK_MEM_FSRM (1 << 1)
+#define LIBK_MEM_SSE2 (1 << 2)
+#define LIBK_MEM_AVX2 (1 << 3)
+#define LIBK_MEM_SSE42 (1 << 4)
+
+void libk_memory_select(uint32_t features, uint64_t cache_size);
+const char* libk_memory_variant(void);
+void libk_string_select(uint32_t features);
+
+void* libk_memset(void* s, int c, size_t count);
+void* libk_memcpy(void* dest, const void* src, size_t count);
+void* libk_memmove(void* dest, const void* src, size_t count);
+int libk_memcmp(const void* cs, const void* ct, size_t count);
+
+size_t libk_strlen(const char* s);
+size_t libk_strnlen(const char* s, size_t maxlen);
+int libk_strcmp(const char* cs, const char* ct);
+int libk_strncmp(const char* cs, const char* ct, size_t count);
+char* libk_strchr(const char* s, int c);
+char* libk_strrchr(const char* s, int c);
+char* libk_strstr(const char* s1, const char* s2);
+char* libk_strnstr(const char* s1, const char* s2, size_t len);
+void* libk_memchr(const void* s, int c, size_t n);
+void* libk_memrchr(const void* s, int c, size_t n);
+
+int libk_snprintf(char* buf, size_t size, const char* fmt, ...);
+
+// Every feature set this CPU can run, in harness.c
+#define HOST_MAX_VARIANTS 16
+typedef struct
+{
+    uint32_t features;
+    char name[32];
+} host_variant_t;
+
+int host_variants(host_variant_t* out, int max);
+void host_select(const host_variant_t* variant, uint64_t cache_size);
+uint64_t host_random(void);
+void host_seed(uint64_t seed);
+
+#endif
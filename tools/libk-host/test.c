@@ -0,0 +1,355 @@
+// Part of the vOS project
+// Licensed under MIT License
+// See LICENSE for more information
+
+// Differential tests of libk against glibc: random sizes, alignments,
+// overlaps and strings that end right before an unmapped page
+// Usage: libk-test [seed] [iterations]
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "libk.h"
+
+#define PAGE 4096
+#define MAX_SIZE (256 * 1024)
+#define SLACK 128                     // Alignment offsets plus canaries
+#define CANARY 0xA5
+#define NT_CACHE (128 * 1024)         // Puts the non-temporal cutoff at 64KB
+#define MAX_FAILURES 20
+
+static uint8_t* src;
+static uint8_t* dst;
+static uint8_t* ref;
+static char* guarded;                 // One page right before a PROT_NONE page
+static const char* variant;
+static uint64_t iteration;
+static int failures;
+
+static void fail(const char* fn, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FAIL %s [%s] iteration %llu: ", fn, variant, (unsigned long long)iteration);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    if (++failures >= MAX_FAILURES)
+    {
+        fprintf(stderr, "too many failures\n");
+        exit(1);
+    }
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+// Mostly small sizes, the kernel's common case, with a long tail
+static size_t random_size(void)
+{
+    uint64_t r = host_random();
+    switch (r % 16)
+    {
+        case 0:
+            return (r >> 8) % MAX_SIZE;
+        case 1:
+        case 2:
+            return (r >> 8) % 16384;
+        case 3:
+        case 4:
+        case 5:
+            return (r >> 8) % 1024;
+        default:
+            return (r >> 8) % 65;
+    }
+}
+
+static void fill_random(uint8_t* p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = (uint8_t)host_random();
+}
+
+static void test_memcpy(void)
+{
+    size_t n = random_size();
+    size_t so = host_random() % 64;
+    size_t doff = host_random() % 64;
+    fill_random(src, n + SLACK);
+    memset(dst, CANARY, n + SLACK);
+    memset(ref, CANARY, n + SLACK);
+
+    void* ret = libk_memcpy(dst + doff, src + so, n);
+    memcpy(ref + doff, src + so, n);
+    if (ret != dst + doff)
+        fail("memcpy", "returned %p, not dest", ret);
+    if (memcmp(dst, ref, n + SLACK))
+        fail("memcpy", "n %zu src +%zu dst +%zu", n, so, doff);
+}
+
+static void test_memmove(void)
+{
+    // Bounded where GCC can see it, the buffers hold MAX_SIZE + 2 * SLACK
+    size_t n = random_size();
+    if (n > MAX_SIZE)
+        n = MAX_SIZE;
+    size_t gap = host_random() % 64;
+    bool up = host_random() & 1;
+    size_t from = 64 + (up ? 0 : gap);
+    size_t to = 64 + (up ? gap : 0);
+    fill_random(dst, n + 2 * SLACK);
+    memcpy(ref, dst, n + 2 * SLACK);
+
+    void* ret = libk_memmove(dst + to, dst + from, n);
+    memmove(ref + to, ref + from, n);
+    if (ret != dst + to)
+        fail("memmove", "returned %p, not dest", ret);
+    if (memcmp(dst, ref, n + 2 * SLACK))
+        fail("memmove", "n %zu %s by %zu", n, up ? "up" : "down", gap);
+}
+
+static void test_memset(void)
+{
+    size_t n = random_size();
+    size_t doff = host_random() % 64;
+    int c = (int)host_random();
+    memset(dst, CANARY, n + SLACK);
+    memset(ref, CANARY, n + SLACK);
+
+    void* ret = libk_memset(dst + doff, c, n);
+    memset(ref + doff, c, n);
+    if (ret != dst + doff)
+        fail("memset", "returned %p, not dest", ret);
+    if (memcmp(dst, ref, n + SLACK))
+        fail("memset", "n %zu dst +%zu c %#x", n, doff, c & 0xFF);
+}
+
+static void test_memcmp(void)
+{
+    size_t n = random_size();
+    size_t so = host_random() % 64;
+    size_t doff = host_random() % 64;
+    fill_random(src + so, n);
+    memcpy(dst + doff, src + so, n);
+    if (n && host_random() % 4)
+        dst[doff + host_random() % n] = (uint8_t)host_random();
+
+    int got = libk_memcmp(src + so, dst + doff, n);
+    int want = memcmp(src + so, dst + doff, n);
+    if (sign(got) != sign(want))
+        fail("memcmp", "n %zu got %d want %d", n, got, want);
+}
+
+// A NUL terminated string over a small alphabet so searches hit often,
+// either at a random offset or ending on the last byte before the guard
+static char* random_string(size_t len, int alphabet)
+{
+    char* s = host_random() & 1 ? guarded + PAGE - (len + 1) : guarded + host_random() % (PAGE / 2);
+    for (size_t i = 0; i < len; i++)
+        s[i] = 'a' + host_random() % alphabet;
+    s[len] = '\0';
+    return s;
+}
+
+static void test_strings(void)
+{
+    int alphabet = 2 + host_random() % 4;
+    size_t len = host_random() % 3 ? host_random() % 96 : host_random() % (PAGE / 2 - 1);
+    char* s = random_string(len, alphabet);
+    int c = host_random() % 8 ? 'a' + (int)(host_random() % (alphabet + 1)) : 0;
+    size_t maxlen = host_random() % (len + 40);
+
+    if (libk_strlen(s) != strlen(s))
+        fail("strlen", "len %zu got %zu", len, libk_strlen(s));
+    if (libk_strnlen(s, maxlen) != strnlen(s, maxlen))
+        fail("strnlen", "len %zu maxlen %zu", len, maxlen);
+    if (libk_strchr(s, c) != strchr(s, c))
+        fail("strchr", "len %zu c %#x", len, c);
+    if (libk_strrchr(s, c) != strrchr(s, c))
+        fail("strrchr", "len %zu c %#x", len, c);
+
+    // Byte searches over a region that ends at the guard page
+    size_t n = host_random() % (len + 1);
+    const char* region = guarded + PAGE - n;
+    if (libk_memchr(region, c, n) != memchr(region, c, n))
+        fail("memchr", "n %zu c %#x", n, c);
+    if (libk_memrchr(region, c, n) != memrchr(region, c, n))
+        fail("memrchr", "n %zu c %#x", n, c);
+
+    // Compare against a copy at another alignment, maybe changed or cut short
+    char* t = (char*)src + host_random() % 64;
+    memcpy(t, s, len + 1);
+    if (len && host_random() & 1)
+        t[host_random() % len] += host_random() % 3;
+    if (len && host_random() % 4 == 0)
+        t[host_random() % len] = '\0';
+    if (sign(libk_strcmp(s, t)) != sign(strcmp(s, t)) || sign(libk_strcmp(t, s)) != sign(strcmp(t, s)))
+        fail("strcmp", "len %zu", len);
+    if (sign(libk_strncmp(s, t, maxlen)) != sign(strncmp(s, t, maxlen)))
+        fail("strncmp", "len %zu maxlen %zu", len, maxlen);
+
+    // Needles from the same alphabet, or cut out of the haystack
+    char needle[64];
+    size_t nl = host_random() % 12;
+    if (len && host_random() & 1)
+    {
+        size_t at = host_random() % len;
+        nl = nl < len - at ? nl : len - at;
+        memcpy(needle, s + at, nl);
+    }
+    else
+    {
+        for (size_t i = 0; i < nl; i++)
+            needle[i] = 'a' + host_random() % alphabet;
+    }
+    needle[nl] = '\0';
+    if (libk_strstr(s, needle) != strstr(s, needle))
+        fail("strstr", "haystack %zu needle \"%s\"", len, needle);
+
+    // strnstr stops at the bound and at a NUL, glibc has no strnstr
+    char* bounded = strndup(s, strnlen(s, maxlen));
+    char* hit = strstr(bounded, needle);
+    char* want = hit ? s + (hit - bounded) : NULL;
+    free(bounded);
+    if (libk_strnstr(s, needle, maxlen) != want)
+        fail("strnstr", "haystack %zu bound %zu needle \"%s\"", len, maxlen, needle);
+}
+
+// Periodic needles are Two-Way's worst case for a naive matcher
+static void test_strstr_periodic(void)
+{
+    size_t hl = 1 + host_random() % (PAGE - 1);
+    char* h = guarded + PAGE - (hl + 1);
+    char needle[256];
+    size_t nl = 1 + host_random() % (sizeof(needle) - 1);
+    int period = 1 + host_random() % 4;
+    for (size_t i = 0; i < hl; i++)
+        h[i] = 'a' + (i % period == 0 && host_random() % 64 == 0);
+    h[hl] = '\0';
+    for (size_t i = 0; i < nl; i++)
+        needle[i] = 'a' + (i % period == 0 && host_random() % 32 == 0);
+    needle[nl] = '\0';
+    if (libk_strstr(h, needle) != strstr(h, needle))
+        fail("strstr", "periodic haystack %zu needle %zu", hl, nl);
+}
+
+// Everything but %p, whose fixed 16 digit form differs from glibc's
+static void test_snprintf(void)
+{
+    static const char* formats[] = {
+        "%d|%i|%u", "%x|%X|%c", "%s and %s", "%lld %llu %llx", "100%% %d",
+        "%5d|%-5d|%05d|%+d|% d", "%#x|%#o|%o|%#X|%08llx", "%.3s|%10.2s|%-6c|%-12s|",
+        "%zu %hhd %hu %ld %lo", "%*d|%.*d|%-*u|%.0d|%.0x", "%.5d|%8.3x|%-+7d|%#.0o|%%",
+    };
+    char got[64];
+    char want[64];
+    size_t size = host_random() % (sizeof(got) + 1);
+    int which = host_random() % 11;
+    long long a = (long long)host_random();
+    int b = (int)host_random();
+    int w = (int)(host_random() % 24) - 8;
+    const char* s = random_string(host_random() % 40, 4);
+
+    int ret;
+    int ref;
+    switch (which)
+    {
+        case 0:
+            ret = libk_snprintf(got, size, formats[0], b, ~b, (unsigned)b);
+            ref = snprintf(want, size, formats[0], b, ~b, (unsigned)b);
+            break;
+        case 1:
+            ret = libk_snprintf(got, size, formats[1], (unsigned)b, (unsigned)b, 'a' + (b & 15));
+            ref = snprintf(want, size, formats[1], (unsigned)b, (unsigned)b, 'a' + (b & 15));
+            break;
+        case 2:
+            ret = libk_snprintf(got, size, formats[2], s, s + strlen(s) / 2);
+            ref = snprintf(want, size, formats[2], s, s + strlen(s) / 2);
+            break;
+        case 3:
+            ret = libk_snprintf(got, size, formats[3], a, (unsigned long long)a, (unsigned long long)a);
+            ref = snprintf(want, size, formats[3], a, (unsigned long long)a, (unsigned long long)a);
+            break;
+        case 4:
+            ret = libk_snprintf(got, size, formats[4], b);
+            ref = snprintf(want, size, formats[4], b);
+            break;
+        case 5:
+            ret = libk_snprintf(got, size, formats[5], b % 1000, b % 1000, b % 1000, b, b % 100);
+            ref = snprintf(want, size, formats[5], b % 1000, b % 1000, b % 1000, b, b % 100);
+            break;
+        case 6:
+            ret = libk_snprintf(got, size, formats[6], (unsigned)b & 0xFFF, (unsigned)b & 0xFF, 0u,
+                                (unsigned)b, (unsigned long long)a >> (b & 63));
+            ref = snprintf(want, size, formats[6], (unsigned)b & 0xFFF, (unsigned)b & 0xFF, 0u,
+                           (unsigned)b, (unsigned long long)a >> (b & 63));
+            break;
+        case 7:
+            ret = libk_snprintf(got, size, formats[7], s, s, 'a' + (b & 15), s + strlen(s) / 2);
+            ref = snprintf(want, size, formats[7], s, s, 'a' + (b & 15), s + strlen(s) / 2);
+            break;
+        case 8:
+            ret = libk_snprintf(got, size, formats[8], (size_t)a, b, b, (long)a, (unsigned long)a);
+            ref = snprintf(want, size, formats[8], (size_t)a, (signed char)b, (unsigned short)b,
+                           (long)a, (unsigned long)a);
+            break;
+        case 9:
+            ret = libk_snprintf(got, size, formats[9], w, b % 100, w, b % 100, w, (unsigned)b, b & 1, b & 1);
+            ref = snprintf(want, size, formats[9], w, b % 100, w, b % 100, w, (unsigned)b, b & 1, b & 1);
+            break;
+        default:
+            ret = libk_snprintf(got, size, formats[10], b % 100, (unsigned)b & 0xFF, b % 100, b & 7);
+            ref = snprintf(want, size, formats[10], b % 100, (unsigned)b & 0xFF, b % 100, b & 7);
+            break;
+    }
+    if (ret != ref || (size && strcmp(got, want)))
+        fail("snprintf", "\"%s\" size %zu got \"%.*s\" %d want \"%.*s\" %d", formats[which], size,
+             size ? 64 : 0, got, ret, size ? 64 : 0, want, ref);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+    uint64_t iterations = argc > 2 ? strtoull(argv[2], NULL, 0) : 20000;
+
+    src = malloc(MAX_SIZE + 2 * SLACK);
+    dst = malloc(MAX_SIZE + 2 * SLACK);
+    ref = malloc(MAX_SIZE + 2 * SLACK);
+    char* pages = mmap(NULL, 2 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!src || !dst || !ref || pages == MAP_FAILED || mprotect(pages + PAGE, PAGE, PROT_NONE))
+    {
+        perror("libk-test");
+        return 1;
+    }
+    guarded = pages;
+
+    host_variant_t variants[HOST_MAX_VARIANTS];
+    int count = host_variants(variants, HOST_MAX_VARIANTS);
+    for (int v = 0; v < count; v++)
+    {
+        variant = variants[v].name;
+        host_select(&variants[v], NT_CACHE);
+        host_seed(seed + v);
+        for (iteration = 0; iteration < iterations; iteration++)
+        {
+            test_memcpy();
+            test_memmove();
+            test_memset();
+            test_memcmp();
+            test_strings();
+            test_strstr_periodic();
+            test_snprintf();
+        }
+        printf("%-24s %llu iterations, %s\n", variant, (unsigned long long)iterations,
+               failures ? "FAILED" : "ok");
+    }
+
+    printf("seed %llu: %d failures\n", (unsigned long long)seed, failures);
+    return failures != 0;
+}